@@ -54,6 +54,10 @@ typedef enum NeedleError {
    * Unknown error.
    */
   NeedleError_Unknown,
+  /**
+   * Analysis of a video exceeded one of the configured limits.
+   */
+  NeedleError_AnalyzerLimitExceeded,
 } NeedleError;
 
 /**
@@ -182,6 +186,41 @@ void needle_audio_analyzer_free(const struct NeedleAudioAnalyzer *analyzer);
  */
 void needle_audio_analyzer_print_paths(const struct NeedleAudioAnalyzer *analyzer);
 
+/**
+ * Set per-video limits on the [NeedleAudioAnalyzer].
+ *
+ * `max_wall_time` and `max_audio_duration` are in seconds. Passing in zero for any of the limits
+ * disables that limit. If `skip` is set, videos that hit a limit are skipped and
+ * [needle_audio_analyzer_run] returns [NeedleError::AnalyzerLimitExceeded]. Otherwise, the partial
+ * frame hash data is kept and marked as truncated.
+ *
+ * For more information, refer to [needle::audio::AnalyzerLimits].
+ */
+enum NeedleError needle_audio_analyzer_set_limits(const struct NeedleAudioAnalyzer *analyzer,
+                                                  float max_wall_time,
+                                                  float max_audio_duration,
+                                                  uint64_t max_packets,
+                                                  bool skip);
+
+/**
+ * Enable or disable background mode on the [NeedleAudioAnalyzer].
+ *
+ * `cpu_target` is the target CPU utilization of each worker thread, from 0 (exclusive) to 1.
+ *
+ * For more information, refer to [needle::background::BackgroundConfig].
+ */
+enum NeedleError needle_audio_analyzer_set_background(const struct NeedleAudioAnalyzer *analyzer,
+                                                      bool enabled,
+                                                      float cpu_target);
+
+/**
+ * Set the maximum number of audio tracks analyzed per video by the [NeedleAudioAnalyzer].
+ *
+ * For more information, refer to [needle::audio::Analyzer::with_audio_tracks].
+ */
+enum NeedleError needle_audio_analyzer_set_audio_tracks(const struct NeedleAudioAnalyzer *analyzer,
+                                                        size_t audio_tracks);
+
 /**
  * Run the [NeedleAudioAnalyzer].
  */
@@ -80,6 +80,8 @@ pub enum NeedleError {
     IOError,
     /// Unknown error.
     Unknown,
+    /// Analysis of a video exceeded one of the configured limits.
+    AnalyzerLimitExceeded,
 }
 
 impl Display for NeedleError {
@@ -109,6 +111,12 @@ impl Display for NeedleError {
                 f,
                 "Unknown error occurred; please re-run with logging enabled"
             ),
+            NeedleError::AnalyzerLimitExceeded => {
+                write!(
+                    f,
+                    "Analysis of a video exceeded one of the configured limits"
+                )
+            }
         }
     }
 }
@@ -122,6 +130,7 @@ impl From<needle::Error> for NeedleError {
             needle::Error::AnalyzerMissingPaths => Unknown,
             needle::Error::BincodeError(_) => InvalidFrameHashData,
             needle::Error::IOError(_) => IOError,
+            needle::Error::AnalyzerLimitExceeded(_, _) => AnalyzerLimitExceeded,
             _ => Unknown,
         }
     }
@@ -183,6 +192,12 @@ pub extern "C" fn needle_error_to_str(error: NeedleError) -> *const libc::c_char
             )
             .as_ptr()
         },
+        NeedleError::AnalyzerLimitExceeded => unsafe {
+            CStr::from_bytes_with_nul_unchecked(
+                "Analysis of a video exceeded one of the configured limits\0".as_bytes(),
+            )
+            .as_ptr()
+        },
     }
 }
 
@@ -391,6 +406,101 @@ pub extern "C" fn needle_audio_analyzer_print_paths(analyzer: *const NeedleAudio
     }
 }
 
+/// Set per-video limits on the [NeedleAudioAnalyzer].
+///
+/// `max_wall_time` and `max_audio_duration` are in seconds. Passing in zero for any of the limits
+/// disables that limit. If `skip` is set, videos that hit a limit are skipped and
+/// [needle_audio_analyzer_run] returns [NeedleError::AnalyzerLimitExceeded]. Otherwise, the partial
+/// frame hash data is kept and marked as truncated.
+///
+/// For more information, refer to [needle::audio::AnalyzerLimits].
+#[no_mangle]
+pub extern "C" fn needle_audio_analyzer_set_limits(
+    analyzer: *const NeedleAudioAnalyzer,
+    max_wall_time: f32,
+    max_audio_duration: f32,
+    max_packets: u64,
+    skip: bool,
+) -> NeedleError {
+    if analyzer.is_null() {
+        return NeedleError::NullArgument;
+    }
+    if max_wall_time < 0.0 || max_audio_duration < 0.0 {
+        return NeedleError::InvalidArgument;
+    }
+
+    // SAFETY: We assume that the user is passing in a _valid_ pointer. Otherwise, all bets are off.
+    let analyzer = unsafe { (analyzer as *mut NeedleAudioAnalyzer).as_mut().unwrap() };
+
+    let limits = audio::AnalyzerLimits {
+        max_wall_time: (max_wall_time > 0.0).then(|| Duration::from_secs_f32(max_wall_time)),
+        max_audio_duration: (max_audio_duration > 0.0)
+            .then(|| Duration::from_secs_f32(max_audio_duration)),
+        max_packets: (max_packets > 0).then(|| max_packets),
+        action: if skip {
+            audio::LimitAction::Skip
+        } else {
+            audio::LimitAction::Truncate
+        },
+    };
+    analyzer.0 = std::mem::take(&mut analyzer.0).with_limits(limits);
+
+    NeedleError::Ok
+}
+
+/// Enable or disable background mode on the [NeedleAudioAnalyzer].
+///
+/// `cpu_target` is the target CPU utilization of each worker thread, from 0 (exclusive) to 1.
+///
+/// For more information, refer to [needle::background::BackgroundConfig].
+#[no_mangle]
+pub extern "C" fn needle_audio_analyzer_set_background(
+    analyzer: *const NeedleAudioAnalyzer,
+    enabled: bool,
+    cpu_target: f32,
+) -> NeedleError {
+    if analyzer.is_null() {
+        return NeedleError::NullArgument;
+    }
+    if enabled && (cpu_target <= 0.0 || cpu_target > 1.0) {
+        return NeedleError::InvalidArgument;
+    }
+
+    // SAFETY: We assume that the user is passing in a _valid_ pointer. Otherwise, all bets are off.
+    let analyzer = unsafe { (analyzer as *mut NeedleAudioAnalyzer).as_mut().unwrap() };
+
+    let background = enabled.then(|| needle::background::BackgroundConfig {
+        cpu_target,
+        ..Default::default()
+    });
+    analyzer.0 = std::mem::take(&mut analyzer.0).with_background(background);
+
+    NeedleError::Ok
+}
+
+/// Set the maximum number of audio tracks analyzed per video by the [NeedleAudioAnalyzer].
+///
+/// For more information, refer to [needle::audio::Analyzer::with_audio_tracks].
+#[no_mangle]
+pub extern "C" fn needle_audio_analyzer_set_audio_tracks(
+    analyzer: *const NeedleAudioAnalyzer,
+    audio_tracks: libc::size_t,
+) -> NeedleError {
+    if analyzer.is_null() {
+        return NeedleError::NullArgument;
+    }
+    if audio_tracks == 0 {
+        return NeedleError::InvalidArgument;
+    }
+
+    // SAFETY: We assume that the user is passing in a _valid_ pointer. Otherwise, all bets are off.
+    let analyzer = unsafe { (analyzer as *mut NeedleAudioAnalyzer).as_mut().unwrap() };
+
+    analyzer.0 = std::mem::take(&mut analyzer.0).with_audio_tracks(audio_tracks);
+
+    NeedleError::Ok
+}
+
 /// Run the [NeedleAudioAnalyzer].
 #[no_mangle]
 pub extern "C" fn needle_audio_analyzer_run(
@@ -620,6 +730,18 @@ mod test {
             needle_audio_analyzer_new(path_ptrs.as_ptr(), num_paths, false, false, &mut analyzer);
         assert_eq!(error, NeedleError::Ok);
         assert_ne!(analyzer, std::ptr::null());
+        let error = needle_audio_analyzer_set_limits(analyzer, 60.0, 0.0, 1000, false);
+        assert_eq!(error, NeedleError::Ok);
+        let error = needle_audio_analyzer_set_limits(analyzer, -1.0, 0.0, 0, false);
+        assert_eq!(error, NeedleError::InvalidArgument);
+        let error = needle_audio_analyzer_set_background(analyzer, true, 0.25);
+        assert_eq!(error, NeedleError::Ok);
+        let error = needle_audio_analyzer_set_background(analyzer, true, 0.0);
+        assert_eq!(error, NeedleError::InvalidArgument);
+        let error = needle_audio_analyzer_set_audio_tracks(analyzer, 2);
+        assert_eq!(error, NeedleError::Ok);
+        let error = needle_audio_analyzer_set_audio_tracks(analyzer, 0);
+        assert_eq!(error, NeedleError::InvalidArgument);
         needle_audio_analyzer_free(analyzer);
     }
 
@@ -1,19 +1,42 @@
-extern crate chromaprint_rust;
 extern crate ffmpeg_next;
 #[cfg(feature = "rayon")]
 extern crate rayon;
 
-use chromaprint_rust as chromaprint;
-
-use std::path::Path;
-use std::time::Duration;
+use std::collections::BTreeMap;
+use std::fmt::Display;
+use std::io::{Read, Write};
+use std::path::{Path, PathBuf};
+use std::sync::{Condvar, Mutex};
+use std::time::{Duration, Instant};
 
 #[cfg(feature = "rayon")]
 use rayon::prelude::*;
 use serde::{Deserialize, Serialize};
 
+use super::cache::{PcmCache, PcmEntry, PcmRecorder};
+use super::chapters::{self, Chapter};
+use super::counters::CountingReader;
+use super::fingerprint::{FingerprintEngine, Fingerprinter};
+use super::prefetcher::{Prefetcher, StopGuard};
+use super::prescreen::MusicGate;
+use super::rehash::same_period;
+use super::sparse::SparseAudioReader;
+use super::subtitles::{Song, SubtitleEvent, SubtitleHints};
+use super::template::{AnalysisTemplate, Coverage, CoverageSource, Guide, GuideAction};
+use crate::background::{BackgroundConfig, Pacer};
+use crate::timing::{Stage, StageTimes, TimingSummary};
+use crate::util::FileIdentity;
 use crate::{Error, Result};
 
+/// Written at the start of every frame hash data file, followed by the format version. Files
+/// without it use the layout of [LegacyFrameHashes].
+const FRAME_HASH_DATA_MAGIC: &[u8; 8] = b"NEEDLEFH";
+
+/// Version of the on-disk layout of [FrameHashes]. This must be bumped whenever a field is added,
+/// removed or changed, and `FrameHashes::from_path` must be taught to read (or reject) the old
+/// layout.
+const FRAME_HASH_DATA_VERSION: u32 = 1;
+
 /// Represents frame hash data for a single video file. This is the result of running
 /// an [Analyzer] on a video file.
 ///
@@ -26,17 +49,187 @@ pub struct FrameHashes {
     pub(crate) hash_duration: f32,
     pub(crate) data: Vec<(u32, Duration)>,
     pub(crate) md5: String,
+    // MD5 hash of the codec parameters and all packets of the primary audio stream (see
+    // `ContentHasher`). Unlike `md5`, this does not change when the video is remuxed or its
+    // metadata is edited. Empty if the stream was not read in full (e.g., with a template).
+    pub(crate) content_md5: String,
+    pub(crate) truncated: Option<AnalyzerLimit>,
+    pub(crate) language: Option<String>,
+    pub(crate) tracks: Vec<AudioTrackHashes>,
+    pub(crate) identity: FileIdentity,
+    pub(crate) coverage: Option<Coverage>,
+    pub(crate) music_regions: Option<Vec<(Duration, Duration)>>,
+    pub(crate) engine: FingerprintEngine,
+    pub(crate) subtitle_hints: Option<SubtitleHints>,
+    pub(crate) chapters: Vec<Chapter>,
+}
+
+/// Layout of frame hash data files written before the format was versioned. These only hold the
+/// hashes of the primary track, computed using Chromaprint over the whole video.
+#[derive(Deserialize, Serialize)]
+struct LegacyFrameHashes {
+    hash_period: f32,
+    hash_duration: f32,
+    data: Vec<(u32, Duration)>,
+    md5: String,
+}
+
+impl From<LegacyFrameHashes> for FrameHashes {
+    fn from(legacy: LegacyFrameHashes) -> Self {
+        Self {
+            hash_period: legacy.hash_period,
+            hash_duration: legacy.hash_duration,
+            data: legacy.data,
+            md5: legacy.md5,
+            // Never matches the content MD5 of a video, so reuse falls back to `md5`.
+            content_md5: String::new(),
+            truncated: None,
+            language: None,
+            tracks: Vec::new(),
+            // Never matches a real video, so the data is checked using `md5` before it is used
+            // (see `FrameHashes::from_video_if_current`).
+            identity: FileIdentity::default(),
+            coverage: None,
+            music_regions: None,
+            engine: FingerprintEngine::Chromaprint,
+            subtitle_hints: None,
+            chapters: Vec::new(),
+        }
+    }
+}
+
+/// Frame hash data for an additional audio track of a video. See [Analyzer::with_audio_tracks].
+#[derive(Debug, Deserialize, Serialize)]
+pub struct AudioTrackHashes {
+    pub(crate) stream_index: usize,
+    pub(crate) language: Option<String>,
+    pub(crate) data: Vec<(u32, Duration)>,
+}
+
+impl AudioTrackHashes {
+    /// Returns the index of the audio stream in the video.
+    pub fn stream_index(&self) -> usize {
+        self.stream_index
+    }
+
+    /// Returns the language of the audio stream, if known.
+    pub fn language(&self) -> Option<&str> {
+        self.language.as_deref()
+    }
 }
 
 impl FrameHashes {
+    /// Returns the limit that cut the analysis of this video short, if any.
+    ///
+    /// If this is set, the frame hash data only covers part of the video.
+    pub fn truncated(&self) -> Option<AnalyzerLimit> {
+        self.truncated
+    }
+
+    /// Returns the parts of the video covered by this data if only part of the video was analyzed
+    /// (see [Analyzer::with_template], [Analyzer::with_subtitle_hints] and
+    /// [Analyzer::with_chapters]). Returns `None` if the whole video was analyzed.
+    pub fn coverage(&self) -> Option<&Coverage> {
+        self.coverage.as_ref()
+    }
+
+    /// Returns the regions of the primary track that were fingerprinted if the music pre-screen was
+    /// enabled (see [Analyzer::with_music_prescreen]). Returns `None` if all audio was fingerprinted.
+    pub fn music_regions(&self) -> Option<&[(Duration, Duration)]> {
+        self.music_regions.as_deref()
+    }
+
+    /// Returns the engine that was used to compute the hashes.
+    pub fn engine(&self) -> FingerprintEngine {
+        self.engine
+    }
+
+    /// Returns the opening and ending hints found in the subtitles of the video, if subtitle hints
+    /// were enabled (see [Analyzer::with_subtitle_hints]).
+    pub fn subtitle_hints(&self) -> Option<&SubtitleHints> {
+        self.subtitle_hints.as_ref()
+    }
+
+    /// Returns the chapters of the video, as stored in its container.
+    pub fn chapters(&self) -> &[Chapter] {
+        &self.chapters
+    }
+
+    /// Returns the period between hashes, in seconds.
+    pub fn hash_period(&self) -> f32 {
+        self.hash_period
+    }
+
+    /// Returns the duration of audio covered by each hash, in seconds.
+    pub fn hash_duration(&self) -> f32 {
+        self.hash_duration
+    }
+
+    /// Returns the language of the primary (best) audio track, if known.
+    pub fn language(&self) -> Option<&str> {
+        self.language.as_deref()
+    }
+
+    /// Returns the additional audio tracks that were analyzed alongside the primary track.
+    pub fn tracks(&self) -> &[AudioTrackHashes] {
+        &self.tracks
+    }
+
+    /// Returns the language and hash data of every analyzed track, starting with the primary one.
+    pub(crate) fn all_tracks(&self) -> impl Iterator<Item = (Option<&str>, &[(u32, Duration)])> {
+        std::iter::once((self.language(), &self.data[..])).chain(
+            self.tracks
+                .iter()
+                .map(|track| (track.language(), &track.data[..])),
+        )
+    }
+
     /// Load frame hashes from a path.
-    fn from_path(path: impl AsRef<Path>) -> Result<Self> {
+    ///
+    /// Data written before the format was versioned is migrated on load. Data written using an
+    /// unknown version results in [Error::FrameHashDataUnsupported].
+    pub(crate) fn from_path(path: impl AsRef<Path>) -> Result<Self> {
         let path = path.as_ref();
         if !path.exists() {
             return Err(Error::FrameHashDataNotFound(path.to_owned()).into());
         }
-        let f = std::fs::File::open(path)?;
-        Ok(bincode::deserialize_from(&f)?)
+        let mut f = std::io::BufReader::new(CountingReader::new(std::fs::File::open(path)?));
+        let mut magic = Vec::with_capacity(FRAME_HASH_DATA_MAGIC.len());
+        (&mut f)
+            .take(FRAME_HASH_DATA_MAGIC.len() as u64)
+            .read_to_end(&mut magic)?;
+        if magic[..] != FRAME_HASH_DATA_MAGIC[..] {
+            let f = std::io::Cursor::new(magic).chain(f);
+            let legacy: LegacyFrameHashes = bincode::deserialize_from(f)?;
+            return Ok(legacy.into());
+        }
+        let version: u32 = bincode::deserialize_from(&mut f)?;
+        if version != FRAME_HASH_DATA_VERSION {
+            return Err(Error::FrameHashDataUnsupported(path.to_owned(), version).into());
+        }
+        Ok(bincode::deserialize_from(f)?)
+    }
+
+    /// Write frame hashes to a path.
+    pub(crate) fn to_path(&self, path: impl AsRef<Path>) -> Result<()> {
+        let mut f = std::io::BufWriter::new(std::fs::File::create(path)?);
+        f.write_all(FRAME_HASH_DATA_MAGIC)?;
+        bincode::serialize_into(&mut f, &FRAME_HASH_DATA_VERSION)?;
+        bincode::serialize_into(&mut f, self)?;
+        f.flush()?;
+        Ok(())
+    }
+
+    /// Loads the frame hash data stored alongside `video`, but only if the video has not changed
+    /// since it was analyzed.
+    ///
+    /// This only looks at the metadata of the video (size and modification time), so the video
+    /// itself is never read.
+    pub(crate) fn from_video_if_current(video: impl AsRef<Path>) -> Option<Self> {
+        let video = video.as_ref();
+        let data = Self::from_path(video.with_extension(super::FRAME_HASH_DATA_FILE_EXT)).ok()?;
+        let identity = FileIdentity::from_path(video).ok()?;
+        (data.identity == identity).then(|| data)
     }
 
     /// Load frame hash data using a video path.
@@ -69,6 +262,59 @@ impl FrameHashes {
     }
 }
 
+/// Incrementally computes [FrameHashes::content_md5] from the packets of an audio stream.
+///
+/// Only data that is carried over as-is when a video is remuxed is hashed: the codec, sample rate
+/// and codec extradata of the stream, the payload of every packet, and the number of packets.
+/// Timestamps and time bases are left out, as they depend on the container.
+struct ContentHasher {
+    md5: md5::Context,
+    num_packets: u64,
+}
+
+impl ContentHasher {
+    fn new(stream: &ffmpeg_next::format::stream::Stream) -> Self {
+        let parameters = stream.parameters();
+        let mut md5 = md5::Context::new();
+        md5.consume(format!("{:?}", parameters.id()));
+        // SAFETY: The parameters are owned by the stream, which outlives this call.
+        unsafe {
+            let raw = &*parameters.as_ptr();
+            md5.consume(raw.sample_rate.to_le_bytes());
+            if !raw.extradata.is_null() && raw.extradata_size > 0 {
+                md5.consume(std::slice::from_raw_parts(
+                    raw.extradata,
+                    raw.extradata_size as usize,
+                ));
+            }
+        }
+        Self {
+            md5,
+            num_packets: 0,
+        }
+    }
+
+    fn consume(&mut self, packet: &ffmpeg_next::Packet) {
+        if let Some(data) = packet.data() {
+            self.md5.consume(data);
+        }
+        self.num_packets += 1;
+    }
+
+    fn finish(mut self) -> String {
+        self.md5.consume(self.num_packets.to_le_bytes());
+        format!("{:x}", self.md5.compute())
+    }
+}
+
+/// Options used to open audio decoders.
+#[derive(Clone, Copy, Debug, Default)]
+struct DecoderConfig {
+    threaded: bool,
+    // Trade decoding quality we do not need for fingerprinting for speed.
+    fast: bool,
+}
+
 /// Thin wrapper around the native `FFmpeg` audio decoder.
 struct Decoder {
     decoder: ffmpeg_next::codec::decoder::Audio,
@@ -84,15 +330,68 @@ impl Decoder {
         config
     }
 
-    fn from_stream(stream: ffmpeg_next::format::stream::Stream, threaded: bool) -> Result<Self> {
+    // Builds the codec options for fingerprint-grade decoding of the given codec.
+    //
+    // Fingerprints are computed from a stereo (or mono) mix at a low sample rate, so surround
+    // channels, dynamic range compression, and lossless extensions are wasted work. Codecs ignore
+    // options they do not know about.
+    fn build_fast_options(id: ffmpeg_next::codec::Id) -> ffmpeg_next::Dictionary<'static> {
+        use ffmpeg_next::codec::Id;
+
+        let mut options = ffmpeg_next::Dictionary::new();
+        // Allow speedups that are not bit-exact.
+        options.set("flags2", "+fast");
+
+        match id {
+            Id::AC3 | Id::EAC3 | Id::TRUEHD | Id::MLP | Id::DTS => {
+                // Downmix in the decoder instead of decoding every channel and throwing most of
+                // them away in the resampler. Older versions of FFmpeg only know about
+                // `request_channel_layout`; newer ones use `downmix`.
+                options.set("downmix", "stereo");
+                options.set(
+                    "request_channel_layout",
+                    &ffmpeg_next::ChannelLayout::STEREO.bits().to_string(),
+                );
+                // Skip dynamic range compression.
+                options.set("drc_scale", "0");
+                // Only decode the DTS core, skipping the XLL/XBR extensions.
+                options.set("core_only", "1");
+            }
+            Id::AAC | Id::AAC_LATM => {
+                // Requesting mono output makes the AAC decoder skip parametric stereo. Plain
+                // stereo streams are not affected.
+                options.set(
+                    "request_channel_layout",
+                    &ffmpeg_next::ChannelLayout::MONO.bits().to_string(),
+                );
+            }
+            _ => (),
+        }
+
+        options
+    }
+
+    fn from_stream(
+        stream: ffmpeg_next::format::stream::Stream,
+        config: DecoderConfig,
+    ) -> Result<Self> {
         let ctx = ffmpeg_next::codec::context::Context::from_parameters(stream.parameters())?;
         let mut decoder = ctx.decoder();
 
-        if threaded {
+        if config.threaded {
             decoder.set_threading(Self::build_threading_config());
         }
 
-        let decoder = decoder.audio()?;
+        let decoder = if config.fast {
+            let id = decoder.id();
+            let codec =
+                ffmpeg_next::decoder::find(id).ok_or(ffmpeg_next::Error::DecoderNotFound)?;
+            decoder
+                .open_as_with(codec, Self::build_fast_options(id))?
+                .audio()?
+        } else {
+            decoder.audio()?
+        };
 
         Ok(Self { decoder })
     }
@@ -106,6 +405,511 @@ impl Decoder {
     }
 }
 
+/// Decodes and fingerprints a single audio stream. Each analyzed track gets its own instance,
+/// which allows several tracks to be fingerprinted from a single demux pass.
+struct TrackFingerprinter {
+    stream_idx: usize,
+    time_base: f64,
+    // Timestamp of the first decoded audio. This is only known once the first packet after a seek
+    // has been read.
+    offset: Option<Duration>,
+    decoder: Decoder,
+    resampler: ffmpeg_next::software::resampling::Context,
+    fingerprinter: Fingerprinter,
+    decoder_config: DecoderConfig,
+    engine: FingerprintEngine,
+    hash_duration: Duration,
+    hash_period: Duration,
+    // If set, only music (plus a margin) is fingerprinted.
+    gate: Option<MusicGate>,
+    // Start of the audio currently being fingerprinted, relative to `offset`.
+    segment_start: Duration,
+    // Music regions from before the last seek.
+    music_regions: Vec<(Duration, Duration)>,
+    // If set, decoded audio is recorded for the PCM cache.
+    recorder: Option<PcmRecorder>,
+    times: StageTimes,
+    frame: ffmpeg_next::frame::Audio,
+    frame_resampled: ffmpeg_next::frame::Audio,
+    hashes: Vec<(u32, Duration)>,
+}
+
+impl TrackFingerprinter {
+    fn new(
+        ctx: &ffmpeg_next::format::context::Input,
+        stream_idx: usize,
+        decoder_config: DecoderConfig,
+        music_prescreen: bool,
+        engine: FingerprintEngine,
+        hash_duration: Duration,
+        hash_period: Duration,
+    ) -> Result<Self> {
+        let stream = ctx.stream(stream_idx).unwrap();
+        let time_base = f64::from(stream.time_base());
+        let decoder = Decoder::from_stream(stream, decoder_config)?;
+
+        // Setup the audio fingerprinter
+        let fingerprinter = Fingerprinter::new(engine, hash_duration, hash_period);
+
+        // The margin needs to cover at least one hash on either side of a region.
+        let gate = music_prescreen.then(|| {
+            let margin = Duration::max(super::prescreen::MIN_MARGIN, hash_duration);
+            MusicGate::new(fingerprinter.sample_rate(), margin)
+        });
+
+        // Setup the audio resampler
+        let resampler = decoder.decoder.resampler(
+            ffmpeg_next::format::Sample::I16(ffmpeg_next::format::sample::Type::Packed),
+            ffmpeg_next::ChannelLayout::STEREO,
+            fingerprinter.sample_rate(),
+        )?;
+
+        Ok(Self {
+            stream_idx,
+            time_base,
+            offset: Some(Duration::ZERO),
+            decoder,
+            resampler,
+            fingerprinter,
+            decoder_config,
+            engine,
+            hash_duration,
+            hash_period,
+            gate,
+            segment_start: Duration::ZERO,
+            music_regions: Vec::new(),
+            recorder: None,
+            times: StageTimes::default(),
+            frame: ffmpeg_next::frame::Audio::empty(),
+            frame_resampled: ffmpeg_next::frame::Audio::empty(),
+            hashes: Vec::new(),
+        })
+    }
+
+    // Starts over with a fresh decoder and fingerprinter after the input was seeked. Hashes computed
+    // so far are kept.
+    fn reset(&mut self, ctx: &ffmpeg_next::format::context::Input) -> Result<()> {
+        let hashes = std::mem::take(&mut self.hashes);
+        let music_regions = self.music_regions();
+        let times = self.times;
+        *self = Self::new(
+            ctx,
+            self.stream_idx,
+            self.decoder_config,
+            self.gate.is_some(),
+            self.engine,
+            self.hash_duration,
+            self.hash_period,
+        )?;
+        self.hashes = hashes;
+        self.music_regions = music_regions;
+        self.times = times;
+        self.offset = None;
+        Ok(())
+    }
+
+    // Returns the regions of audio that were fingerprinted by the music pre-screen.
+    fn music_regions(&self) -> Vec<(Duration, Duration)> {
+        let mut regions = self.music_regions.clone();
+        if let Some(gate) = &self.gate {
+            let offset = self.offset.unwrap_or_default();
+            regions.extend(
+                gate.regions()
+                    .map(|(start, end)| (offset + start, offset + end)),
+            );
+        }
+        regions
+    }
+
+    // Starts recording decoded audio for the PCM cache.
+    fn record_pcm(&mut self) {
+        self.recorder = Some(PcmRecorder::new());
+    }
+
+    // Returns the audio recorded so far, if recording was started.
+    fn take_pcm(&mut self) -> Option<PcmEntry> {
+        let offset = self.offset.unwrap_or_default();
+        self.recorder.take().map(|recorder| recorder.finish(offset))
+    }
+
+    // Decodes the packet and feeds the decoded audio to the fingerprinter. Returns the duration
+    // of audio that was decoded.
+    fn process_packet(&mut self, packet: &ffmpeg_next::Packet) -> Result<Duration> {
+        let mut audio_duration = Duration::ZERO;
+        let offset = *self.offset.get_or_insert_with(|| {
+            let pts = packet.pts().or_else(|| packet.dts()).unwrap_or(0);
+            Duration::from_secs_f64(f64::max(pts as f64 * self.time_base, 0.0))
+        });
+
+        self.times
+            .time(Stage::Decode, || self.decoder.send_packet(packet))?;
+        loop {
+            let started = Instant::now();
+            let received = self.decoder.receive_frame(&mut self.frame).is_ok();
+            self.times.add(Stage::Decode, started.elapsed());
+            if !received {
+                break;
+            }
+
+            let frame = &self.frame;
+            if frame.rate() > 0 {
+                audio_duration +=
+                    Duration::from_secs_f64(frame.samples() as f64 / frame.rate() as f64);
+            }
+
+            if let Some(recorder) = &mut self.recorder {
+                let started = Instant::now();
+                let recorded = recorder.record(frame);
+                self.times.add(Stage::Resample, started.elapsed());
+                if let Err(err) = recorded {
+                    tracing::warn!("failed to record audio for the PCM cache: {}", err);
+                    self.recorder = None;
+                }
+            }
+
+            self.process_frame(offset)?;
+        }
+
+        Ok(audio_duration)
+    }
+
+    // Feeds audio from the PCM cache to the fingerprinter instead of decoding the stream.
+    fn process_cached(&mut self, entry: &PcmEntry) -> Result<()> {
+        /// Number of cached samples passed through the resampler at a time.
+        const CHUNK_SAMPLES: usize = 4096;
+
+        self.offset = Some(entry.offset);
+        self.frame = ffmpeg_next::frame::Audio::new(
+            ffmpeg_next::format::Sample::I16(ffmpeg_next::format::sample::Type::Packed),
+            CHUNK_SAMPLES,
+            ffmpeg_next::ChannelLayout::MONO,
+        );
+        self.frame.set_rate(entry.sample_rate);
+
+        for chunk in entry.samples.chunks(CHUNK_SAMPLES) {
+            self.frame.set_samples(chunk.len());
+            // SAFETY: The frame was allocated for packed S16 samples.
+            let (_, data, _) = unsafe { self.frame.data_mut(0).align_to_mut::<i16>() };
+            data[..chunk.len()].copy_from_slice(chunk);
+            self.process_frame(entry.offset)?;
+        }
+        Ok(())
+    }
+
+    // Resamples the current frame and feeds it to the fingerprinter.
+    fn process_frame(&mut self, offset: Duration) -> Result<()> {
+        let (frame, frame_resampled) = (&self.frame, &mut self.frame_resampled);
+        let started = Instant::now();
+
+        // Resample the frame to S16 stereo and return the frame delay.
+        let mut delay = match self.resampler.run(frame, frame_resampled) {
+            Ok(v) => v,
+            // If resampling fails due to changed input, construct a new local resampler for this frame
+            // and swap out the global resampler.
+            Err(ffmpeg_next::Error::InputChanged) => {
+                let mut local_resampler = frame.resampler(
+                    ffmpeg_next::format::Sample::I16(ffmpeg_next::format::sample::Type::Packed),
+                    ffmpeg_next::ChannelLayout::STEREO,
+                    self.fingerprinter.sample_rate(),
+                )?;
+                let delay = local_resampler.run(frame, frame_resampled)?;
+
+                self.resampler = local_resampler;
+
+                delay
+            }
+            Err(err) => return Err(err.into()),
+        };
+        self.times.add(Stage::Resample, started.elapsed());
+
+        loop {
+            // Obtain a slice of raw bytes in interleaved format.
+            // We have two channels, so the bytes look like this: c1, c1, c2, c2, c1, c1, c2, c2, ...
+            //
+            // Note that `data` is a fixed-size buffer. To get the _actual_ sample bytes, we need to use:
+            // a) sample count, b) channel count, and c) number of bytes per S16 sample.
+            let raw_samples = &frame_resampled.data(0)
+                [..frame_resampled.samples() * frame_resampled.channels() as usize * 2];
+
+            // Transmute the raw byte slice into a slice of i16 samples.
+            // This looks like: c1, c2, c1, c2, ...
+            //
+            // SAFETY: We know for a fact that the returned buffer contains i16 samples
+            // because we explicitly told the resampler to return S16 samples (see above).
+            let (_, samples, _) = unsafe { raw_samples.align_to() };
+
+            // Feed the i16 samples to the fingerprinter. Since the audio was resampled to the
+            // fingerprinter's sample rate, it will _not_ do any resampling internally.
+            let started = Instant::now();
+            let (fingerprinter, hashes) = (&mut self.fingerprinter, &mut self.hashes);
+            let segment_start = &mut self.segment_start;
+            let (engine, hash_duration, hash_period) =
+                (self.engine, self.hash_duration, self.hash_period);
+            let mut feed = |samples: &[i16], start: Option<u64>| {
+                // Audio that is not contiguous with what came before needs a fresh fingerprinter.
+                if let Some(start) = start {
+                    *fingerprinter = Fingerprinter::new(engine, hash_duration, hash_period);
+                    *segment_start =
+                        Duration::from_secs_f64(start as f64 / fingerprinter.sample_rate() as f64);
+                }
+                let segment_start = *segment_start;
+                fingerprinter.feed(samples, |hash, ts| {
+                    hashes.push((hash, offset + segment_start + ts));
+                });
+            };
+            match &mut self.gate {
+                Some(gate) => gate.process(samples, &mut feed),
+                None => feed(samples, None),
+            }
+            self.times.add(Stage::Fingerprint, started.elapsed());
+
+            if delay.is_none() {
+                break;
+            } else {
+                let started = Instant::now();
+                delay = self.resampler.flush(frame_resampled)?;
+                self.times.add(Stage::Resample, started.elapsed());
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Output of [Analyzer::process_frames].
+struct ProcessedAudio {
+    // Hashes for each analyzed track, primary track first.
+    hashes: Vec<Vec<(u32, Duration)>>,
+    truncated: Option<AnalyzerLimit>,
+    coverage: Option<Coverage>,
+    music_regions: Option<Vec<(Duration, Duration)>>,
+    // Decoded audio of the primary track, if it should be added to the PCM cache.
+    pcm: Option<PcmEntry>,
+    // Content MD5 of the primary track, if all of its packets were read.
+    content_md5: Option<String>,
+    // Time spent in each stage, summed over all tracks.
+    times: StageTimes,
+}
+
+/// Identifies which of the [AnalyzerLimits] was hit while analyzing a video.
+#[derive(Clone, Copy, Debug, Deserialize, Serialize, PartialEq, Eq)]
+pub enum AnalyzerLimit {
+    /// The video took longer than [AnalyzerLimits::max_wall_time] to analyze.
+    WallTime,
+    /// More than [AnalyzerLimits::max_audio_duration] of audio was decoded.
+    AudioDuration,
+    /// More than [AnalyzerLimits::max_packets] packets were read.
+    Packets,
+}
+
+impl Display for AnalyzerLimit {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            AnalyzerLimit::WallTime => write!(f, "wall time limit"),
+            AnalyzerLimit::AudioDuration => write!(f, "audio duration limit"),
+            AnalyzerLimit::Packets => write!(f, "packet limit"),
+        }
+    }
+}
+
+/// Determines what happens to a video once one of the [AnalyzerLimits] is hit.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum LimitAction {
+    /// Keep the frame hashes computed so far and mark them as truncated (see [FrameHashes::truncated]).
+    Truncate,
+    /// Discard the video and record an [Error::AnalyzerLimitExceeded] error.
+    Skip,
+}
+
+impl Default for LimitAction {
+    fn default() -> Self {
+        Self::Truncate
+    }
+}
+
+/// Per-video limits applied by an [Analyzer].
+///
+/// Broken or unusual files (e.g., huge timestamp gaps or multi-day captures) can take a very long time
+/// to analyze. In a batch, a single such file can end up determining when the whole batch completes. These
+/// limits bound the amount of work done for each video. All limits are disabled by default.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct AnalyzerLimits {
+    /// Maximum wall-clock time to spend analyzing a single video.
+    pub max_wall_time: Option<Duration>,
+    /// Maximum duration of audio to decode for a single video.
+    pub max_audio_duration: Option<Duration>,
+    /// Maximum number of packets to read for a single video.
+    pub max_packets: Option<u64>,
+    /// What to do once a limit is hit.
+    pub action: LimitAction,
+}
+
+impl AnalyzerLimits {
+    /// Returns the first limit that has been exceeded, if any.
+    #[inline]
+    fn check(
+        &self,
+        started: Instant,
+        num_packets: u64,
+        audio_duration: Duration,
+    ) -> Option<AnalyzerLimit> {
+        if let Some(max_packets) = self.max_packets {
+            if num_packets > max_packets {
+                return Some(AnalyzerLimit::Packets);
+            }
+        }
+        if let Some(max_audio_duration) = self.max_audio_duration {
+            if audio_duration >= max_audio_duration {
+                return Some(AnalyzerLimit::AudioDuration);
+            }
+        }
+        if let Some(max_wall_time) = self.max_wall_time {
+            if started.elapsed() >= max_wall_time {
+                return Some(AnalyzerLimit::WallTime);
+            }
+        }
+        None
+    }
+}
+
+/// Summary of a batch run of an [Analyzer]. This is returned by [Analyzer::run_with_summary].
+#[derive(Debug, Default)]
+pub struct AnalyzerSummary {
+    /// Number of videos that have frame hash data at the end of the run (including truncated ones).
+    pub completed: usize,
+    /// Videos whose analysis was cut short, along with the limit that was hit.
+    pub truncated: Vec<(PathBuf, AnalyzerLimit)>,
+    /// Videos that were skipped, along with the error that caused them to be skipped.
+    pub failed: Vec<(PathBuf, Error)>,
+    /// Total wall-clock time taken by the run.
+    pub elapsed: Duration,
+    /// Time spent in each stage of analysis, per video (see [Analyzer::timings]).
+    pub stages: TimingSummary,
+}
+
+impl AnalyzerSummary {
+    /// Records the result of analyzing the video at `path`. Returns the frame hash data, if any.
+    ///
+    /// This is useful for building a summary from the results of [Analyzer::run_streaming].
+    pub fn record(&mut self, path: PathBuf, result: Result<FrameHashes>) -> Option<FrameHashes> {
+        match result {
+            Ok(frame_hashes) => {
+                if let Some(limit) = frame_hashes.truncated {
+                    self.truncated.push((path, limit));
+                }
+                self.completed += 1;
+                Some(frame_hashes)
+            }
+            Err(err) => {
+                self.failed.push((path, err));
+                None
+            }
+        }
+    }
+}
+
+impl Display for AnalyzerSummary {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        writeln!(
+            f,
+            "Analyzed {} videos in {} ({} truncated, {} skipped).",
+            self.completed,
+            crate::util::format_time(self.elapsed),
+            self.truncated.len(),
+            self.failed.len(),
+        )?;
+        for (path, limit) in &self.truncated {
+            writeln!(f, "* Truncated - {} ({})", path.display(), limit)?;
+        }
+        for (path, err) in &self.failed {
+            writeln!(f, "* Skipped - {} ({})", path.display(), err)?;
+        }
+        if !self.stages.is_empty() {
+            write!(f, "\n{}", self.stages)?;
+        }
+        Ok(())
+    }
+}
+
+/// Order in which [Analyzer::run_streaming] yields results.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum OutputOrder {
+    /// Yield each result as soon as its video has been analyzed.
+    Completion,
+    /// Yield results in the same order as [Analyzer::videos].
+    ///
+    /// Workers do not start on a video more than `window` places ahead of the next result to be
+    /// yielded, so at most `window` results are ever held back for reordering.
+    Input { window: usize },
+}
+
+impl Default for OutputOrder {
+    fn default() -> Self {
+        Self::Completion
+    }
+}
+
+#[derive(Default)]
+struct ReorderState {
+    // Index of the next result to be yielded.
+    next: usize,
+    stopped: bool,
+}
+
+// Keeps workers from running too far ahead of the next result to be yielded in input order.
+struct ReorderGate {
+    window: Option<usize>,
+    state: Mutex<ReorderState>,
+    cond: Condvar,
+}
+
+impl ReorderGate {
+    fn new(order: OutputOrder) -> Self {
+        let window = match order {
+            OutputOrder::Completion => None,
+            OutputOrder::Input { window } => Some(usize::max(window, 1)),
+        };
+        Self {
+            window,
+            state: Default::default(),
+            cond: Condvar::new(),
+        }
+    }
+
+    // Blocks until the video at `idx` is within the reordering window.
+    //
+    // Videos are handed out to workers in order, so the video at `next` is always either in
+    // progress or done. This means that waiting here can never deadlock.
+    fn wait(&self, idx: usize) {
+        let window = match self.window {
+            Some(window) => window,
+            None => return,
+        };
+        let mut state = self.state.lock().unwrap();
+        while !state.stopped && idx >= state.next + window {
+            state = self.cond.wait(state).unwrap();
+        }
+    }
+
+    fn advance(&self, next: usize) {
+        self.state.lock().unwrap().next = next;
+        self.cond.notify_all();
+    }
+
+    fn stop(&self) {
+        self.state.lock().unwrap().stopped = true;
+        self.cond.notify_all();
+    }
+}
+
+// Releases any waiting workers when dropped (e.g., if the result callback panics).
+struct ReorderGuard<'a>(&'a ReorderGate);
+
+impl<'a> Drop for ReorderGuard<'a> {
+    fn drop(&mut self) {
+        self.0.stop();
+    }
+}
+
 /// Analyzes one or more videos and converts them into [FrameHashes].
 ///
 /// If `threaded_decoding` is set to `true`, video files will be distributed across multiple threads
@@ -142,6 +946,20 @@ pub struct Analyzer<P: AsRef<Path>> {
     pub(crate) videos: Vec<P>,
     threaded_decoding: bool,
     force: bool,
+    limits: AnalyzerLimits,
+    background: Option<BackgroundConfig>,
+    prefetch: bool,
+    sparse_reads: bool,
+    audio_tracks: usize,
+    template: Option<AnalysisTemplate>,
+    subtitle_hints: bool,
+    chapters: bool,
+    music_prescreen: bool,
+    engine: FingerprintEngine,
+    fast_decode: bool,
+    pcm_cache: Option<PcmCache>,
+    // Per-stage timings of all videos analyzed so far.
+    timings: Mutex<TimingSummary>,
 }
 
 impl<P: AsRef<Path>> Default for Analyzer<P> {
@@ -150,6 +968,19 @@ impl<P: AsRef<Path>> Default for Analyzer<P> {
             videos: Default::default(),
             threaded_decoding: false,
             force: false,
+            limits: Default::default(),
+            background: None,
+            prefetch: true,
+            sparse_reads: false,
+            audio_tracks: 1,
+            template: None,
+            subtitle_hints: false,
+            chapters: false,
+            music_prescreen: false,
+            engine: FingerprintEngine::Chromaprint,
+            fast_decode: false,
+            pcm_cache: None,
+            timings: Default::default(),
         }
     }
 }
@@ -161,6 +992,19 @@ impl<P: AsRef<Path>> Analyzer<P> {
             videos: videos.into(),
             threaded_decoding,
             force,
+            limits: Default::default(),
+            background: None,
+            prefetch: true,
+            sparse_reads: false,
+            audio_tracks: 1,
+            template: None,
+            subtitle_hints: false,
+            chapters: false,
+            music_prescreen: false,
+            engine: FingerprintEngine::Chromaprint,
+            fast_decode: false,
+            pcm_cache: None,
+            timings: Default::default(),
         }
     }
 
@@ -169,6 +1013,12 @@ impl<P: AsRef<Path>> Analyzer<P> {
         &self.videos
     }
 
+    /// Returns the time spent in each stage of analysis for every video analyzed by this analyzer
+    /// so far. Videos with up-to-date frame hash data on disk are not included.
+    pub fn timings(&self) -> TimingSummary {
+        self.timings.lock().unwrap().clone()
+    }
+
     /// Returns a new [Analyzer] with `force` set to the provided value.
     pub fn with_force(mut self, force: bool) -> Self {
         self.force = force;
@@ -181,120 +1031,581 @@ impl<P: AsRef<Path>> Analyzer<P> {
         self
     }
 
-    fn find_best_audio_stream(
-        input: &ffmpeg_next::format::context::Input,
-    ) -> ffmpeg_next::format::stream::Stream {
-        input
-            .streams()
-            .best(ffmpeg_next::media::Type::Audio)
-            .expect("unable to find an audio stream")
+    /// Returns a new [Analyzer] with the provided per-video `limits`.
+    pub fn with_limits(mut self, limits: AnalyzerLimits) -> Self {
+        self.limits = limits;
+        self
     }
 
-    // Given an audio stream, computes the fingerprint for raw audio for the given duration.
-    //
-    // `count` can be used to limit the number of frames to process.
-    fn process_frames(
-        ctx: &mut ffmpeg_next::format::context::Input,
-        stream_idx: usize,
-        hash_duration: Duration,
-        hash_period: Duration,
-        threaded: bool,
-    ) -> Result<Vec<(u32, Duration)>> {
-        let span = tracing::span!(tracing::Level::TRACE, "process_frames");
-        let _enter = span.enter();
+    /// Returns a new [Analyzer] that runs in background mode using the provided config. Passing
+    /// in `None` disables background mode.
+    ///
+    /// Videos are analyzed on dedicated worker threads, never on the calling thread: up to
+    /// [BackgroundConfig::max_workers] when threading is enabled, and a single one otherwise. On
+    /// Linux, the CPU and I/O priority of these threads is lowered. On other platforms, workers are
+    /// only paced.
+    pub fn with_background(mut self, background: Option<BackgroundConfig>) -> Self {
+        self.background = background;
+        self
+    }
 
-        let stream = ctx.stream(stream_idx).unwrap();
-        let mut decoder = Decoder::from_stream(stream, threaded).unwrap();
+    /// Returns a new [Analyzer] with `prefetch` set to the provided value.
+    ///
+    /// If set (the default), upcoming videos are read ahead and opened on a separate thread while
+    /// the current ones are being analyzed.
+    pub fn with_prefetch(mut self, prefetch: bool) -> Self {
+        self.prefetch = prefetch;
+        self
+    }
 
-        let mut hashes = Vec::new();
-        let mut frame = ffmpeg_next::frame::Audio::empty();
-        let mut frame_resampled = ffmpeg_next::frame::Audio::empty();
+    /// Returns a new [Analyzer] with `sparse_reads` set to the provided value.
+    ///
+    /// If set, audio packets are read directly from the file using the container's sample index,
+    /// which skips over the (much larger) video data. This is currently only supported for MP4/MOV
+    /// files; other containers are demuxed as usual.
+    pub fn with_sparse_reads(mut self, sparse_reads: bool) -> Self {
+        self.sparse_reads = sparse_reads;
+        self
+    }
 
-        // Setup the audio fingerprinter
-        let n = f32::ceil(hash_duration.as_secs_f32() / hash_period.as_secs_f32()) as usize;
-        let mut fingerprinter =
-            chromaprint::DelayedFingerprinter::new(n, hash_duration, hash_period, None, 2, None);
+    /// Returns a new [Analyzer] that fingerprints up to `audio_tracks` audio streams per video.
+    ///
+    /// The best audio stream is always analyzed; it is stored as the primary track of the
+    /// resulting [FrameHashes]. Other audio streams (e.g., a dub in another language) are analyzed
+    /// in the same pass over the file and stored as additional tracks. Commentary tracks are
+    /// ignored. The default is to only analyze the best audio stream.
+    pub fn with_audio_tracks(mut self, audio_tracks: usize) -> Self {
+        self.audio_tracks = usize::max(audio_tracks, 1);
+        self
+    }
 
-        // Setup the audio resampler
-        let target_sample_rate = fingerprinter.sample_rate();
-        let mut resampler = decoder
-            .decoder
-            .resampler(
-                ffmpeg_next::format::Sample::I16(ffmpeg_next::format::sample::Type::Packed),
-                ffmpeg_next::ChannelLayout::STEREO,
-                target_sample_rate,
-            )
-            .unwrap();
+    /// Returns a new [Analyzer] that uses the provided [AnalysisTemplate] to skip over most of each
+    /// video. Passing in `None` (the default) analyzes the whole video.
+    ///
+    /// While decoding the start of a video, hashes are matched against the template's opening. Once
+    /// the opening has been matched (or the opening search window has been passed), the analyzer
+    /// seeks to the ending search window and does the same for the ending. The resulting
+    /// [FrameHashes] are marked with the parts of the video that were analyzed (see
+    /// [FrameHashes::coverage]). Sparse reads are not used when a template is set.
+    pub fn with_template(mut self, template: Option<AnalysisTemplate>) -> Self {
+        self.template = template;
+        self
+    }
 
-        // Build an iterator over packets in the stream.
-        let audio_packets = ctx
-            .packets()
-            .filter(|(s, _)| s.index() == stream_idx)
-            .map(|(_, p)| p);
-
-        for p in audio_packets {
-            decoder.send_packet(&p).unwrap();
-            while decoder.receive_frame(&mut frame).is_ok() {
-                // Resample the frame to S16 stereo and return the frame delay.
-                let mut delay = match resampler.run(&frame, &mut frame_resampled) {
-                    Ok(v) => v,
-                    // If resampling fails due to changed input, construct a new local resampler for this frame
-                    // and swap out the global resampler.
-                    Err(ffmpeg_next::Error::InputChanged) => {
-                        let mut local_resampler = frame
-                            .resampler(
-                                ffmpeg_next::format::Sample::I16(
-                                    ffmpeg_next::format::sample::Type::Packed,
-                                ),
-                                ffmpeg_next::ChannelLayout::STEREO,
-                                target_sample_rate,
-                            )
-                            .unwrap();
-                        let delay = local_resampler
-                            .run(&frame, &mut frame_resampled)
-                            .expect("failed to resample frame");
-
-                        resampler = local_resampler;
-
-                        delay
-                    }
-                    // We don't expect any other errors to occur.
-                    Err(_) => panic!("unexpected error"),
-                };
+    /// Returns a new [Analyzer] with `subtitle_hints` set to the provided value.
+    ///
+    /// If set, the ASS/SSA subtitle track of each video (if any) is read before its audio. Lines
+    /// typeset as the opening or ending, or karaoke lines near the start or end of the video, are
+    /// turned into [SubtitleHints]. Songs whose lines are explicitly labelled (see
+    /// [HintConfidence::High](super::HintConfidence::High)) are only decoded around their lines
+    /// (plus a margin), while the other song is searched for in its whole search window. Videos
+    /// without a confident hint are analyzed in full. The hints are stored in the resulting
+    /// [FrameHashes] (see [FrameHashes::subtitle_hints]). A template takes precedence over
+    /// subtitle hints.
+    pub fn with_subtitle_hints(mut self, subtitle_hints: bool) -> Self {
+        self.subtitle_hints = subtitle_hints;
+        self
+    }
 
-                loop {
-                    // Obtain a slice of raw bytes in interleaved format.
-                    // We have two channels, so the bytes look like this: c1, c1, c2, c2, c1, c1, c2, c2, ...
-                    //
-                    // Note that `data` is a fixed-size buffer. To get the _actual_ sample bytes, we need to use:
-                    // a) sample count, b) channel count, and c) number of bytes per S16 sample.
-                    let raw_samples = &frame_resampled.data(0)
-                        [..frame_resampled.samples() * frame_resampled.channels() as usize * 2];
-
-                    // Transmute the raw byte slice into a slice of i16 samples.
-                    // This looks like: c1, c2, c1, c2, ...
-                    //
-                    // SAFETY: We know for a fact that the returned buffer contains i16 samples
-                    // because we explicitly told the resampler to return S16 samples (see above).
-                    let (_, samples, _) = unsafe { raw_samples.align_to() };
-
-                    // Feed the i16 samples to Chromaprint. Since we are using the default sampling rate,
-                    // Chromaprint will _not_ do any resampling internally.
-                    for (raw_fingerprint, ts) in fingerprinter.feed(samples).unwrap() {
-                        let hash = chromaprint::simhash::simhash32(raw_fingerprint.get());
-                        hashes.push((hash, ts));
-                    }
+    /// Returns a new [Analyzer] with `chapters` set to the provided value.
+    ///
+    /// If set, videos with chapters named after both the opening and the ending (e.g., "Opening"
+    /// and "Credits") are not decoded at all: the resulting [FrameHashes] hold no hashes, and the
+    /// chapters are used as the result by a [Comparator](super::Comparator) with chapters enabled.
+    /// Chapters are stored in the [FrameHashes] of every video either way (see
+    /// [FrameHashes::chapters]).
+    pub fn with_chapters(mut self, chapters: bool) -> Self {
+        self.chapters = chapters;
+        self
+    }
 
-                    if delay.is_none() {
-                        break;
-                    } else {
-                        delay = resampler.flush(&mut frame_resampled).unwrap();
+    /// Returns a new [Analyzer] with `music_prescreen` set to the provided value.
+    ///
+    /// If set, a cheap classifier runs over the decoded audio and only music-like regions (plus a
+    /// margin on either side) are fingerprinted. Openings and endings are music, so dialogue rarely
+    /// contributes useful matches. The fingerprinted regions are stored in the resulting
+    /// [FrameHashes] (see [FrameHashes::music_regions]).
+    pub fn with_music_prescreen(mut self, music_prescreen: bool) -> Self {
+        self.music_prescreen = music_prescreen;
+        self
+    }
+
+    /// Returns a new [Analyzer] that uses the provided [FingerprintEngine] to compute hashes. The
+    /// default is [FingerprintEngine::Chromaprint].
+    pub fn with_fingerprint_engine(mut self, engine: FingerprintEngine) -> Self {
+        self.engine = engine;
+        self
+    }
+
+    /// Returns a new [Analyzer] with `fast_decode` set to the provided value.
+    ///
+    /// If set, audio decoders are configured for fingerprint-grade output: multichannel codecs
+    /// downmix to stereo internally, and quality-only work (dynamic range compression, lossless
+    /// extensions, parametric stereo) is skipped where the codec supports it. The resulting hashes
+    /// are nearly identical to those of a full decode.
+    pub fn with_fast_decode(mut self, fast_decode: bool) -> Self {
+        self.fast_decode = fast_decode;
+        self
+    }
+
+    /// Returns a new [Analyzer] that uses the provided [PcmCache]. Passing in `None` (the default)
+    /// disables the cache.
+    ///
+    /// Decoded audio of the primary track of each fully analyzed video is added to the cache. When
+    /// a video has to be analyzed again (e.g., with a different hash period or engine), its hashes
+    /// are rebuilt from the cache instead of decoding the video. The cache is not used when
+    /// analyzing multiple audio tracks or when a template is set.
+    pub fn with_pcm_cache(mut self, pcm_cache: Option<PcmCache>) -> Self {
+        self.pcm_cache = pcm_cache;
+        self
+    }
+
+    fn find_best_audio_stream(
+        input: &ffmpeg_next::format::context::Input,
+    ) -> ffmpeg_next::format::stream::Stream {
+        input
+            .streams()
+            .best(ffmpeg_next::media::Type::Audio)
+            .expect("unable to find an audio stream")
+    }
+
+    // Returns the indices of the audio streams to analyze, starting with the best one.
+    fn find_audio_streams(&self, input: &ffmpeg_next::format::context::Input) -> Vec<usize> {
+        let best = Self::find_best_audio_stream(input).index();
+        let mut streams = vec![best];
+        streams.extend(
+            input
+                .streams()
+                .filter(|s| s.index() != best)
+                .filter(|s| s.parameters().medium() == ffmpeg_next::media::Type::Audio)
+                .filter(|s| {
+                    !s.disposition()
+                        .contains(ffmpeg_next::format::stream::Disposition::COMMENT)
+                })
+                .map(|s| s.index())
+                .take(self.audio_tracks - 1),
+        );
+        streams
+    }
+
+    // Reads the chapters of a video from its container.
+    fn read_chapters(ctx: &ffmpeg_next::format::context::Input) -> Vec<Chapter> {
+        ctx.chapters()
+            .map(|chapter| {
+                let time_base = f64::from(chapter.time_base());
+                let to_duration =
+                    |ts: i64| Duration::from_secs_f64(i64::max(ts, 0) as f64 * time_base);
+                Chapter {
+                    start: to_duration(chapter.start()),
+                    end: to_duration(chapter.end()),
+                    title: chapter
+                        .metadata()
+                        .get("title")
+                        .map(|title| title.to_owned()),
+                }
+            })
+            .collect()
+    }
+
+    fn stream_language(stream: &ffmpeg_next::format::stream::Stream) -> Option<String> {
+        stream
+            .metadata()
+            .get("language")
+            .filter(|language| *language != "und")
+            .map(|language| language.to_owned())
+    }
+
+    // Marks all streams other than the provided ones as discarded.
+    fn discard_other_streams(ctx: &mut ffmpeg_next::format::context::Input, keep: &[usize]) {
+        for idx in 0..ctx.nb_streams() as usize {
+            if keep.contains(&idx) {
+                continue;
+            }
+            if let Some(mut stream) = ctx.stream_mut(idx) {
+                // SAFETY: The stream is owned by the input context, which outlives this call.
+                unsafe {
+                    (*stream.as_mut_ptr()).discard = ffmpeg_next::ffi::AVDiscard::AVDISCARD_ALL;
+                }
+            }
+        }
+    }
+
+    // Computes the content MD5 of the best audio stream of a video (see `ContentHasher`). The
+    // whole stream is demuxed, but nothing is decoded. This is only needed to check whether a
+    // video with a new header can reuse existing data; otherwise, the hash is computed while the
+    // audio is analyzed.
+    fn compute_content_md5sum(path: &Path) -> Result<String> {
+        let mut ctx = ffmpeg_next::format::input(&path)?;
+        let stream = Self::find_best_audio_stream(&ctx);
+        let stream_idx = stream.index();
+        let mut hasher = ContentHasher::new(&stream);
+        Self::discard_other_streams(&mut ctx, &[stream_idx]);
+
+        let mut packet = ffmpeg_next::Packet::empty();
+        loop {
+            match Self::read_packet(&mut ctx, &mut packet) {
+                Ok(()) => (),
+                Err(ffmpeg_next::Error::Eof) => break,
+                Err(_) => continue,
+            }
+            if packet.stream() == stream_idx {
+                hasher.consume(&packet);
+            }
+        }
+
+        Ok(hasher.finish())
+    }
+
+    // Reads the events of the ASS/SSA subtitle stream of a video and derives opening and ending
+    // hints from them. Only the subtitle stream is demuxed, so no audio is decoded. Returns `None`
+    // if the video has no such stream, or if it has no usable hints.
+    fn extract_subtitle_hints(path: &Path, duration: Duration) -> Result<Option<SubtitleHints>> {
+        let mut ctx = ffmpeg_next::format::input(&path)?;
+        // Prefer the default subtitle stream.
+        let stream = ctx
+            .streams()
+            .filter(|s| {
+                matches!(
+                    s.parameters().id(),
+                    ffmpeg_next::codec::Id::ASS | ffmpeg_next::codec::Id::SSA
+                )
+            })
+            .min_by_key(|s| {
+                !s.disposition()
+                    .contains(ffmpeg_next::format::stream::Disposition::DEFAULT)
+            })
+            .map(|s| (s.index(), f64::from(s.time_base())));
+        let (stream_idx, time_base) = match stream {
+            Some(stream) => stream,
+            None => return Ok(None),
+        };
+        Self::discard_other_streams(&mut ctx, &[stream_idx]);
+
+        let to_duration = |ts: i64| Duration::from_secs_f64(i64::max(ts, 0) as f64 * time_base);
+        let mut events = Vec::new();
+        let mut packet = ffmpeg_next::Packet::empty();
+        loop {
+            match Self::read_packet(&mut ctx, &mut packet) {
+                Ok(()) => (),
+                Err(ffmpeg_next::Error::Eof) => break,
+                Err(_) => continue,
+            }
+            if packet.stream() != stream_idx {
+                continue;
+            }
+            if let (Some(pts), Some(data)) = (packet.pts(), packet.data()) {
+                let (start, end) = (to_duration(pts), to_duration(pts + packet.duration()));
+                events.extend(SubtitleEvent::parse(data, start, end));
+            }
+        }
+
+        Ok(SubtitleHints::from_events(&events, duration))
+    }
+
+    // Reads the next packet from the input into the provided packet, reusing its allocation.
+    fn read_packet(
+        ctx: &mut ffmpeg_next::format::context::Input,
+        packet: &mut ffmpeg_next::Packet,
+    ) -> std::result::Result<(), ffmpeg_next::Error> {
+        // SAFETY: `av_read_frame` expects a blank packet, so any data from the previous read
+        // needs to be released first.
+        unsafe {
+            ffmpeg_next::ffi::av_packet_unref(packet.as_mut_ptr());
+        }
+        packet.read(ctx)
+    }
+
+    // Given one or more audio streams, computes the fingerprint for raw audio for the given
+    // duration. Hashes are returned per stream, in the same order as `stream_indices`. All streams
+    // are decoded from a single pass over the input.
+    //
+    // Processing stops early if any of the provided `limits` is hit. In that case, the limit is
+    // returned alongside the hashes computed so far. If a template or subtitle `hints` are set,
+    // only the parts of the video that they ask for are decoded; the resulting coverage is returned
+    // as well. The content MD5 of the primary stream is only returned if all of it was read.
+    fn process_frames(
+        &self,
+        path: &Path,
+        ctx: &mut ffmpeg_next::format::context::Input,
+        stream_indices: &[usize],
+        hints: Option<&SubtitleHints>,
+        hash_duration: Duration,
+        hash_period: Duration,
+    ) -> Result<ProcessedAudio> {
+        let span = tracing::span!(tracing::Level::TRACE, "process_frames");
+        let _enter = span.enter();
+
+        let decoder_config = DecoderConfig {
+            threaded: self.threaded_decoding,
+            fast: self.fast_decode,
+        };
+        let mut tracks = stream_indices
+            .iter()
+            .map(|&stream_idx| {
+                TrackFingerprinter::new(
+                    ctx,
+                    stream_idx,
+                    decoder_config,
+                    self.music_prescreen,
+                    self.engine,
+                    hash_duration,
+                    hash_period,
+                )
+            })
+            .collect::<Result<Vec<_>>>()?;
+
+        // Keep track of the work done so far to enforce limits.
+        let started = Instant::now();
+        let mut num_packets = 0u64;
+        let mut audio_duration = Duration::ZERO;
+        let mut truncated = None;
+        let mut demux_time = Duration::ZERO;
+
+        // In background mode, workers periodically back off to limit their impact.
+        let mut pacer = self.background.map(Pacer::new);
+
+        // The template or the subtitle hints decide which parts of the video to decode. This
+        // requires knowing how long the video is.
+        let duration = Duration::from_micros(u64::try_from(ctx.duration()).unwrap_or(0));
+        let mut guide = match (&self.template, hints) {
+            (Some(template), _) => template
+                .guide(
+                    duration,
+                    hash_period.as_secs_f32(),
+                    hash_duration.as_secs_f32(),
+                    self.engine,
+                )
+                .map(Guide::Template),
+            (None, Some(hints)) => hints.guide(duration, hash_duration).map(Guide::Hints),
+            (None, None) => None,
+        };
+        let mut action = match &mut guide {
+            Some(guide) => guide.start(),
+            None => GuideAction::Continue,
+        };
+        // Number of primary track hashes that have been passed to the guide.
+        let mut observed = 0;
+
+        // Cached audio has to cover the whole video, so only record it if nothing is skipped.
+        if self.pcm_cache.is_some() && guide.is_none() {
+            tracks[0].record_pcm();
+        }
+
+        // If possible, read audio packets directly from the file instead of demuxing it. The
+        // sparse reader only handles a single stream and cannot seek.
+        let mut sparse_reader = if self.sparse_reads && stream_indices.len() == 1 && guide.is_none()
+        {
+            SparseAudioReader::new(path, ctx, stream_indices[0])
+        } else {
+            None
+        };
+
+        // Ask the demuxer to drop all other streams. Demuxers that honor this can skip parsing and
+        // allocating packets for video, subtitle, and attachment streams altogether.
+        Self::discard_other_streams(ctx, stream_indices);
+
+        // A single packet is reused for the whole demux loop.
+        let mut packet = ffmpeg_next::Packet::empty();
+
+        // Packets of the primary stream are hashed as they are demuxed. The hash is dropped as soon
+        // as any part of the stream is skipped.
+        let mut content = ctx
+            .stream(stream_indices[0])
+            .map(|s| ContentHasher::new(&s));
+
+        loop {
+            match std::mem::replace(&mut action, GuideAction::Continue) {
+                GuideAction::Continue => (),
+                GuideAction::Stop => {
+                    content = None;
+                    break;
+                }
+                GuideAction::Seek(to) => {
+                    content = None;
+                    tracing::debug!(?to, "seeking to the ending of {}", path.display());
+                    let ts = to.as_micros() as i64;
+                    // If seeking fails, decoding simply continues from the current position.
+                    match ctx.seek(ts, ..ts) {
+                        Ok(()) => {
+                            for track in &mut tracks {
+                                track.reset(ctx)?;
+                            }
+                        }
+                        Err(err) => tracing::warn!("failed to seek in {}: {}", path.display(), err),
                     }
                 }
             }
+
+            num_packets += 1;
+            if let Some(limit) = self.limits.check(started, num_packets, audio_duration) {
+                truncated = Some(limit);
+                content = None;
+                break;
+            }
+
+            if let Some(pacer) = &mut pacer {
+                pacer.pace();
+            }
+
+            let read_started = Instant::now();
+            match &mut sparse_reader {
+                Some(reader) => match reader.next_packet()? {
+                    Some(p) => packet = p,
+                    None => break,
+                },
+                None => match Self::read_packet(ctx, &mut packet) {
+                    Ok(()) => (),
+                    Err(ffmpeg_next::Error::Eof) => break,
+                    // Like FFmpeg's packet iterator, skip over packets that fail to be read.
+                    Err(_) => continue,
+                },
+            }
+            demux_time += read_started.elapsed();
+
+            // Demuxers that do not honor discard flags still return packets for other streams.
+            let track = match tracks
+                .iter_mut()
+                .find(|track| track.stream_idx == packet.stream())
+            {
+                Some(track) => track,
+                None => continue,
+            };
+
+            // A packet that cannot be decoded (e.g., because the file is corrupt) fails the
+            // whole video, which is reported along with the other videos of the run.
+            let decoded = track.process_packet(&packet)?;
+
+            // Limits and the template are based on the primary track.
+            if track.stream_idx == stream_indices[0] {
+                if let Some(content) = &mut content {
+                    content.consume(&packet);
+                }
+                audio_duration += decoded;
+                if let Some(guide) = &mut guide {
+                    action = guide.observe(&track.hashes[observed..]);
+                    observed = track.hashes.len();
+                }
+            }
         }
 
-        Ok(hashes)
+        if let Some(reader) = &sparse_reader {
+            tracing::debug!(
+                bytes_read = reader.bytes_read(),
+                "completed sparse reads for {}",
+                path.display()
+            );
+        }
+
+        let music_regions = self.music_prescreen.then(|| tracks[0].music_regions());
+        let pcm = tracks[0].take_pcm().filter(|_| truncated.is_none());
+        let mut times = StageTimes::default();
+        times.add(Stage::Demux, demux_time);
+        for track in &tracks {
+            times.merge(&track.times);
+        }
+        let hashes = tracks.into_iter().map(|track| track.hashes).collect();
+        let coverage = guide.and_then(|guide| guide.coverage());
+
+        Ok(ProcessedAudio {
+            hashes,
+            truncated,
+            coverage,
+            music_regions,
+            pcm,
+            content_md5: content.map(ContentHasher::finish),
+            times,
+        })
+    }
+
+    // Computes the hashes of the primary audio stream from audio in the PCM cache.
+    fn process_cached(
+        &self,
+        ctx: &ffmpeg_next::format::context::Input,
+        stream_idx: usize,
+        entry: &PcmEntry,
+        hash_duration: Duration,
+        hash_period: Duration,
+    ) -> Result<ProcessedAudio> {
+        let span = tracing::span!(tracing::Level::TRACE, "process_cached");
+        let _enter = span.enter();
+
+        let decoder_config = DecoderConfig {
+            threaded: false,
+            fast: self.fast_decode,
+        };
+        let mut track = TrackFingerprinter::new(
+            ctx,
+            stream_idx,
+            decoder_config,
+            self.music_prescreen,
+            self.engine,
+            hash_duration,
+            hash_period,
+        )?;
+        track.process_cached(entry)?;
+
+        let music_regions = self.music_prescreen.then(|| track.music_regions());
+        Ok(ProcessedAudio {
+            hashes: vec![track.hashes],
+            truncated: None,
+            coverage: None,
+            music_regions,
+            pcm: None,
+            content_md5: None,
+            times: track.times,
+        })
+    }
+
+    // Returns true if existing frame hash data with at least `num_tracks` tracks, computed with the
+    // given `hash_period` and `hash_duration`, can be used as is.
+    // Data that only covers part of the video is only good enough when analyzing the same way it
+    // was produced (e.g., data without any hashes from a run that used chapters is no good for a
+    // run that only uses subtitle hints), and likewise for data that only covers music. Data that
+    // was truncated by a limit is always analyzed again, since limits may differ between runs.
+    fn can_reuse(
+        &self,
+        data: &FrameHashes,
+        hash_period: f32,
+        hash_duration: f32,
+        num_tracks: usize,
+    ) -> bool {
+        let same_coverage = match data.coverage.as_ref().map(|coverage| coverage.source) {
+            None => true,
+            Some(CoverageSource::Chapters) => self.chapters,
+            Some(CoverageSource::Template) => self.template.is_some(),
+            // A template takes precedence over subtitle hints.
+            Some(CoverageSource::SubtitleHints) => self.subtitle_hints && self.template.is_none(),
+        };
+        data.truncated.is_none()
+            && same_period(data.hash_period, hash_period)
+            && same_period(data.hash_duration, hash_duration)
+            && data.tracks.len() + 1 >= num_tracks
+            && data.engine == self.engine
+            && same_coverage
+            && (data.music_regions.is_none() || self.music_prescreen)
+    }
+
+    // Updates frame hash data that is reused for a video whose metadata changed (e.g., because it
+    // was remuxed), so that the next run can match it using the metadata alone. `md5` is the new
+    // header MD5 of the video, if it was computed.
+    fn refresh_identity(
+        mut data: FrameHashes,
+        identity: FileIdentity,
+        md5: Option<String>,
+        frame_hash_path: &Path,
+        persist: bool,
+    ) -> Result<FrameHashes> {
+        if data.identity == identity {
+            return Ok(data);
+        }
+        data.identity = identity;
+        if let Some(md5) = md5 {
+            data.md5 = md5;
+        }
+        if persist {
+            data.to_path(frame_hash_path)?;
+        }
+        Ok(data)
     }
 
     pub(crate) fn run_single(
@@ -303,6 +1614,19 @@ impl<P: AsRef<Path>> Analyzer<P> {
         hash_period: f32,
         hash_duration: f32,
         persist: bool,
+    ) -> Result<FrameHashes> {
+        self.run_single_with_input(path, None, hash_period, hash_duration, persist)
+    }
+
+    // Same as `run_single`, but uses the provided `input` if it was already opened (e.g., by
+    // the prefetcher).
+    fn run_single_with_input(
+        &self,
+        path: impl AsRef<Path>,
+        input: Option<ffmpeg_next::format::context::Input>,
+        hash_period: f32,
+        hash_duration: f32,
+        persist: bool,
     ) -> Result<FrameHashes> {
         let span = tracing::span!(tracing::Level::TRACE, "run");
         let _enter = span.enter();
@@ -310,56 +1634,238 @@ impl<P: AsRef<Path>> Analyzer<P> {
         let path = path.as_ref();
         let frame_hash_path = path.with_extension(super::FRAME_HASH_DATA_FILE_EXT);
 
-        // Check if we've already analyzed this video by comparing MD5 hashes.
-        let md5 = crate::util::compute_header_md5sum(path)?;
+        // Check if we've already analyzed this video. If the file's metadata is unchanged, there
+        // is no need to read it; otherwise, compare MD5 hashes of the header and, if that
+        // changed, of the audio itself.
+        let identity = FileIdentity::from_path(path)?;
+        let mut existing = None;
+        let mut md5 = None;
+        let mut content_md5 = None;
         if !self.force {
-            if let Ok(f) = std::fs::File::open(&frame_hash_path) {
-                let data: FrameHashes = bincode::deserialize_from(&f).unwrap();
-                if data.md5 == md5 {
-                    println!("Skipping analysis for {}...", path.display());
-                    return Ok(data);
+            // Frame hash data that can't be decoded (e.g., because it is corrupt or was written
+            // by a newer version) is treated the same as stale data.
+            if let Ok(data) = FrameHashes::from_path(&frame_hash_path) {
+                if data.identity == identity {
+                    existing = Some(data);
+                } else {
+                    let video_md5 = crate::util::compute_header_md5sum(path)?;
+                    if data.md5 == video_md5 {
+                        existing = Some(data);
+                    } else {
+                        // Remuxing a video or editing its tags changes the header, but not the
+                        // audio.
+                        let video_content_md5 = Self::compute_content_md5sum(path)?;
+                        if data.content_md5 == video_content_md5 {
+                            existing = Some(data);
+                        }
+                        content_md5 = Some(video_content_md5);
+                    }
+                    md5 = Some(video_md5);
                 }
             }
         }
+        if existing.as_ref().map_or(false, |data| {
+            self.can_reuse(data, hash_period, hash_duration, self.audio_tracks)
+        }) {
+            println!("Skipping analysis for {}...", path.display());
+            return Self::refresh_identity(
+                existing.unwrap(),
+                identity,
+                md5,
+                &frame_hash_path,
+                persist,
+            );
+        }
 
-        let mut ctx = ffmpeg_next::format::input(&path)?;
-        let stream = Self::find_best_audio_stream(&ctx);
-        let stream_idx = stream.index();
-        let threaded = self.threaded_decoding;
+        let mut times = StageTimes::default();
+        let open_started = Instant::now();
+        let mut ctx = match input {
+            Some(ctx) => ctx,
+            None => ffmpeg_next::format::input(&path)?,
+        };
+        let stream_indices = self.find_audio_streams(&ctx);
+        times.add(Stage::Open, open_started.elapsed());
 
-        tracing::debug!("starting frame processing for {}", path.display());
-        let frame_hashes = Self::process_frames(
-            &mut ctx,
-            stream_idx,
-            Duration::from_secs_f32(hash_duration),
-            Duration::from_secs_f32(hash_period),
-            threaded,
-        )?;
+        // More tracks were requested than were stored, but the existing data is still good if
+        // the video does not have any more tracks.
+        if existing.as_ref().map_or(false, |data| {
+            self.can_reuse(data, hash_period, hash_duration, stream_indices.len())
+        }) {
+            println!("Skipping analysis for {}...", path.display());
+            return Self::refresh_identity(
+                existing.unwrap(),
+                identity,
+                md5,
+                &frame_hash_path,
+                persist,
+            );
+        }
+
+        let languages: Vec<Option<String>> = stream_indices
+            .iter()
+            .map(|&idx| Self::stream_language(&ctx.stream(idx).unwrap()))
+            .collect();
+
+        // Chapters named after the opening and ending are used as-is, so there is no need to
+        // decode any audio.
+        let duration = Duration::from_micros(u64::try_from(ctx.duration()).unwrap_or(0));
+        let chapters = Self::read_chapters(&ctx);
+        let resolved = self.chapters
+            && chapters::named(&chapters, Song::Opening).is_some()
+            && chapters::named(&chapters, Song::Ending).is_some();
+
+        // Subtitles are much cheaper to read than audio, so they are read first. Videos without
+        // usable hints are analyzed in full.
+        let subtitle_hints = if self.subtitle_hints && self.template.is_none() && !resolved {
+            times
+                .time(Stage::Open, || Self::extract_subtitle_hints(path, duration))
+                .unwrap_or_else(|err| {
+                    tracing::warn!("failed to read subtitles of {}: {}", path.display(), err);
+                    None
+                })
+        } else {
+            None
+        };
+
+        // The PCM cache is keyed by the contents of the video.
+        let pcm_cache_key = match &self.pcm_cache {
+            Some(_) => {
+                let video_md5 = match &md5 {
+                    Some(md5) => md5.clone(),
+                    None => times.time(Stage::Open, || crate::util::compute_header_md5sum(path))?,
+                };
+                let key = PcmCache::key(&video_md5, identity.size, stream_indices[0]);
+                md5 = Some(video_md5);
+                Some(key)
+            }
+            None => None,
+        };
+        let cached = match (&self.pcm_cache, &pcm_cache_key) {
+            (Some(cache), Some(key))
+                if stream_indices.len() == 1 && self.template.is_none() && !resolved =>
+            {
+                cache.load(key)
+            }
+            _ => None,
+        };
+
+        tracing::debug!(
+            num_tracks = stream_indices.len(),
+            cached = cached.is_some(),
+            "starting frame processing for {}",
+            path.display()
+        );
+        let processed = match &cached {
+            _ if resolved => ProcessedAudio {
+                hashes: vec![Vec::new(); stream_indices.len()],
+                truncated: None,
+                coverage: Some(Coverage {
+                    duration,
+                    ranges: Vec::new(),
+                    source: CoverageSource::Chapters,
+                }),
+                music_regions: None,
+                pcm: None,
+                content_md5: None,
+                times: StageTimes::default(),
+            },
+            Some(entry) => self.process_cached(
+                &ctx,
+                stream_indices[0],
+                entry,
+                Duration::from_secs_f32(hash_duration),
+                Duration::from_secs_f32(hash_period),
+            )?,
+            None => self.process_frames(
+                path,
+                &mut ctx,
+                &stream_indices,
+                subtitle_hints.as_ref(),
+                Duration::from_secs_f32(hash_duration),
+                Duration::from_secs_f32(hash_period),
+            )?,
+        };
+        let ProcessedAudio {
+            hashes: track_hashes,
+            truncated,
+            coverage,
+            music_regions,
+            pcm,
+            content_md5: processed_content_md5,
+            times: processing_times,
+        } = processed;
+        times.merge(&processing_times);
         tracing::debug!(
-            num_hashes = frame_hashes.len(),
+            num_hashes = track_hashes[0].len(),
             "completed frame processing for {}",
             path.display(),
         );
 
+        // Failing to update the cache does not affect the results.
+        if let (Some(cache), Some(key), Some(pcm)) = (&self.pcm_cache, &pcm_cache_key, &pcm) {
+            if let Err(err) = cache.store(key, pcm) {
+                tracing::warn!("failed to cache audio for {}: {}", path.display(), err);
+            }
+        }
+
+        if let Some(limit) = truncated {
+            tracing::warn!("hit {} while analyzing {}", limit, path.display());
+            if self.limits.action == LimitAction::Skip {
+                return Err(Error::AnalyzerLimitExceeded(path.to_owned(), limit));
+            }
+        }
+
+        let mut tracks = stream_indices
+            .into_iter()
+            .zip(languages)
+            .zip(track_hashes)
+            .map(|((stream_index, language), data)| AudioTrackHashes {
+                stream_index,
+                language,
+                data,
+            });
+        let primary = tracks.next().unwrap();
+
+        let md5 = match md5 {
+            Some(md5) => md5,
+            None => times.time(Stage::Open, || crate::util::compute_header_md5sum(path))?,
+        };
+        // Audio that was not read in full (e.g., from the PCM cache) has no content MD5, so it
+        // is only ever reused based on its header.
+        let content_md5 = content_md5.or(processed_content_md5).unwrap_or_default();
         let frame_hashes = FrameHashes {
             hash_period,
             hash_duration,
-            data: frame_hashes,
+            data: primary.data,
             md5,
+            content_md5,
+            truncated,
+            language: primary.language,
+            tracks: tracks.collect(),
+            identity,
+            coverage,
+            music_regions,
+            engine: self.engine,
+            subtitle_hints,
+            chapters,
         };
 
         // Write results to disk.
         if persist {
-            let mut f = std::fs::File::create(&frame_hash_path)?;
-            bincode::serialize_into(&mut f, &frame_hashes)?;
+            times.time(Stage::HashWrite, || frame_hashes.to_path(&frame_hash_path))?;
         }
 
+        self.timings.lock().unwrap().record_times(&times);
+
         Ok(frame_hashes)
     }
 }
 
 impl<P: AsRef<Path> + Sync> Analyzer<P> {
     /// Runs this analyzer.
+    ///
+    /// If any video fails to be analyzed (e.g., it was skipped due to a limit), the first such error
+    /// is returned. Use [Self::run_with_summary] to get partial results instead.
     pub fn run(
         &self,
         hash_period: f32,
@@ -367,32 +1873,182 @@ impl<P: AsRef<Path> + Sync> Analyzer<P> {
         persist: bool,
         threading: bool,
     ) -> Result<Vec<FrameHashes>> {
+        let (data, mut summary) =
+            self.run_with_summary(hash_period, hash_duration, persist, threading)?;
+
+        if let Some((_, err)) = summary.failed.drain(..).next() {
+            return Err(err);
+        }
+
+        Ok(data.into_iter().map(|d| d.unwrap()).collect())
+    }
+
+    /// Runs this analyzer and returns a summary of the run.
+    ///
+    /// The returned list contains one entry per video, in the same order as [Self::videos]. Videos
+    /// that failed to be analyzed have no frame hash data; the reason is recorded in the summary.
+    pub fn run_with_summary(
+        &self,
+        hash_period: f32,
+        hash_duration: f32,
+        persist: bool,
+        threading: bool,
+    ) -> Result<(Vec<Option<FrameHashes>>, AnalyzerSummary)> {
+        let started = Instant::now();
+
+        let mut summary = AnalyzerSummary::default();
+        let mut data = Vec::with_capacity(self.videos.len());
+
+        // All results are kept anyway, so there is no need to hold workers back.
+        let order = OutputOrder::Input {
+            window: self.videos.len(),
+        };
+        self.run_streaming(
+            hash_period,
+            hash_duration,
+            persist,
+            threading,
+            order,
+            |idx, result| {
+                let path = self.videos[idx].as_ref().to_owned();
+                data.push(summary.record(path, result));
+            },
+        )?;
+
+        summary.elapsed = started.elapsed();
+        summary.stages = self.timings();
+
+        Ok((data, summary))
+    }
+
+    /// Runs this analyzer and passes each video's result to `on_result` as soon as it is available.
+    ///
+    /// `on_result` is called on the calling thread with the index of the video in [Self::videos]
+    /// and its result. Unlike [Self::run], results are not collected, so memory usage does not grow
+    /// with the number of videos. `order` controls the order in which results are passed in.
+    pub fn run_streaming<F>(
+        &self,
+        hash_period: f32,
+        hash_duration: f32,
+        persist: bool,
+        threading: bool,
+        order: OutputOrder,
+        mut on_result: F,
+    ) -> Result<()>
+    where
+        F: FnMut(usize, Result<FrameHashes>),
+    {
         if self.videos.len() == 0 {
             return Err(Error::AnalyzerMissingPaths.into());
         }
 
-        let mut data = Vec::new();
+        // While a worker analyzes a video, the prefetcher prepares the next videos in the
+        // schedule. Videos are handed out to workers in order so that the prefetcher stays
+        // just ahead of them.
+        let prefetcher = Prefetcher::new(self.num_workers(threading));
+        let gate = ReorderGate::new(order);
+
+        // Workers send results back to the calling thread. The sender is owned by `analyze`, so
+        // the channel closes once all workers are done.
+        let (tx, rx) = std::sync::mpsc::channel();
+        let tx = Mutex::new(tx);
+        let (prefetcher_ref, gate_ref) = (&prefetcher, &gate);
+        let analyze = move |(idx, path): (usize, &P)| {
+            gate_ref.wait(idx);
+            prefetcher_ref.claim(idx);
+            let input = prefetcher_ref.take(idx);
+            let result =
+                self.run_single_with_input(path, input, hash_period, hash_duration, persist);
+            // The receiver is only gone if `on_result` panicked.
+            let _ = tx.lock().unwrap().send((idx, result));
+        };
+
+        std::thread::scope(|s| {
+            let _prefetcher_guard = StopGuard(&prefetcher);
+            let _gate_guard = ReorderGuard(&gate);
+
+            if self.prefetch && self.videos.len() > 1 {
+                s.spawn(|| {
+                    if self.background.is_some() {
+                        crate::background::lower_current_thread_priority();
+                    }
+                    // There is no need to open videos that will likely be skipped.
+                    prefetcher.run(&self.videos[..], |path| {
+                        self.force
+                            || !path
+                                .with_extension(super::FRAME_HASH_DATA_FILE_EXT)
+                                .exists()
+                    });
+                });
+            }
+
+            s.spawn(move || self.run_all(analyze, threading));
+
+            let mut pending = BTreeMap::new();
+            let mut next = 0;
+            for (idx, result) in rx {
+                if gate.window.is_none() {
+                    on_result(idx, result);
+                    continue;
+                }
+                pending.insert(idx, result);
+                while let Some(result) = pending.remove(&next) {
+                    on_result(next, result);
+                    next += 1;
+                }
+                gate.advance(next);
+            }
+        });
+
+        Ok(())
+    }
+
+    // Returns the number of workers that will analyze videos in parallel.
+    fn num_workers(&self, threading: bool) -> usize {
+        match self.background {
+            Some(background) if threading => background.max_workers,
+            Some(_) => 1,
+            #[cfg(feature = "rayon")]
+            None if threading => rayon::current_num_threads(),
+            None => 1,
+        }
+    }
 
-        if cfg!(feature = "rayon") && threading {
+    // Runs `analyze` on each video, handing out videos to workers in order.
+    fn run_all<F>(&self, analyze: F, threading: bool)
+    where
+        F: Fn((usize, &P)) + Sync + Send,
+    {
+        if cfg!(feature = "rayon") && (threading || self.background.is_some()) {
             #[cfg(feature = "rayon")]
             {
-                data = self
-                    .videos
-                    .par_iter()
-                    .map(|path| {
-                        self.run_single(path, hash_period, hash_duration, persist)
-                            .unwrap()
-                    })
-                    .collect::<Vec<_>>();
+                let run = || {
+                    self.videos
+                        .iter()
+                        .enumerate()
+                        .par_bridge()
+                        .for_each(&analyze)
+                };
+
+                match self.background {
+                    // Use a dedicated pool so that lowering thread priorities does not affect
+                    // the global pool.
+                    Some(_) => rayon::ThreadPoolBuilder::new()
+                        .num_threads(self.num_workers(threading))
+                        .start_handler(|_| crate::background::lower_current_thread_priority())
+                        .build()
+                        .expect("unable to build background thread pool")
+                        .install(run),
+                    None => run(),
+                }
             }
         } else {
-            data.extend(self.videos.iter().map(|path| {
-                self.run_single(path, hash_period, hash_duration, persist)
-                    .unwrap()
-            }));
-        }
+            if self.background.is_some() {
+                crate::background::lower_current_thread_priority();
+            }
 
-        Ok(data)
+            self.videos.iter().enumerate().for_each(&analyze);
+        }
     }
 }
 
@@ -410,11 +2066,399 @@ mod test {
         ]
     }
 
+    // Asserts that at least 90% of the hashes in `data` match those at the same position in
+    // `expected`.
+    fn assert_hashes_close(data: &FrameHashes, expected: &FrameHashes) {
+        let num_matches = data
+            .data
+            .iter()
+            .zip(expected.data.iter())
+            .filter(|((h1, _), (h2, _))| {
+                u32::count_ones(h1 ^ h2) <= super::super::DEFAULT_HASH_MATCH_THRESHOLD as u32
+            })
+            .count();
+        assert!(num_matches * 10 >= expected.data.len() * 9);
+    }
+
     #[test]
     fn test_analyzer() {
         let paths = get_sample_paths();
         let analyzer = Analyzer::from_files(paths.clone(), false, false);
-        let data = analyzer.run(0.3, 3.0, false, false).unwrap();
+        let mut data = analyzer.run(0.3, 3.0, false, false).unwrap();
+        // Modification times depend on the checkout.
+        for d in &mut data {
+            d.identity.modified = None;
+        }
         insta::assert_debug_snapshot!(data);
     }
+
+    #[test]
+    fn test_analyzer_background() {
+        let paths = get_sample_paths();
+        let analyzer = Analyzer::from_files(paths.clone(), false, false);
+        let expected = analyzer.run(0.3, 3.0, false, true).unwrap();
+
+        let analyzer = Analyzer::from_files(paths, false, false)
+            .with_background(Some(BackgroundConfig::default()));
+        let data = analyzer.run(0.3, 3.0, false, true).unwrap();
+
+        for (d, e) in data.iter().zip(expected.iter()) {
+            assert_eq!(d.data, e.data);
+        }
+    }
+
+    #[test]
+    fn test_analyzer_sparse_reads() {
+        let paths = get_sample_paths();
+        let analyzer = Analyzer::from_files(paths.clone(), false, false);
+        let expected = analyzer.run(0.3, 3.0, false, false).unwrap();
+
+        let analyzer = Analyzer::from_files(paths, false, false).with_sparse_reads(true);
+        let data = analyzer.run(0.3, 3.0, false, false).unwrap();
+
+        // Packets are identical, but the demuxer may trim a few priming samples that the sparse
+        // reader does not, so allow for small differences.
+        for (d, e) in data.iter().zip(expected.iter()) {
+            assert!((d.data.len() as i64 - e.data.len() as i64).abs() <= 1);
+            assert_hashes_close(d, e);
+        }
+    }
+
+    #[test]
+    fn test_analyzer_streaming() {
+        let paths = get_sample_paths();
+        let analyzer = Analyzer::from_files(paths, false, false);
+        let expected = analyzer.run(0.3, 3.0, false, true).unwrap();
+
+        let mut indices = Vec::new();
+        let order = OutputOrder::Input { window: 1 };
+        analyzer
+            .run_streaming(0.3, 3.0, false, true, order, |idx, result| {
+                assert_eq!(result.unwrap().data, expected[idx].data);
+                indices.push(idx);
+            })
+            .unwrap();
+        assert_eq!(indices, vec![0, 1]);
+
+        let mut indices = Vec::new();
+        let order = OutputOrder::Completion;
+        analyzer
+            .run_streaming(0.3, 3.0, false, true, order, |idx, result| {
+                assert_eq!(result.unwrap().data, expected[idx].data);
+                indices.push(idx);
+            })
+            .unwrap();
+        indices.sort();
+        assert_eq!(indices, vec![0, 1]);
+    }
+
+    #[test]
+    fn test_analyzer_audio_tracks() {
+        let paths = get_sample_paths();
+        let analyzer = Analyzer::from_files(paths.clone(), false, false);
+        let expected = analyzer.run(0.3, 3.0, false, false).unwrap();
+
+        // The samples only have a single audio track, so the extra track request is a no-op.
+        let analyzer = Analyzer::from_files(paths, false, false).with_audio_tracks(2);
+        let data = analyzer.run(0.3, 3.0, false, false).unwrap();
+        for (d, e) in data.iter().zip(expected.iter()) {
+            assert_eq!(d.data, e.data);
+            assert_eq!(d.language(), Some("eng"));
+            assert!(d.tracks().is_empty());
+        }
+    }
+
+    #[test]
+    fn test_analyzer_fingerprint_engine() {
+        let paths = get_sample_paths();
+        let analyzer = Analyzer::from_files(paths, false, false)
+            .with_fingerprint_engine(FingerprintEngine::BandEnergy);
+        let data = analyzer.run(0.3, 3.0, false, false).unwrap();
+        for d in &data {
+            assert_eq!(d.engine(), FingerprintEngine::BandEnergy);
+            assert!(!d.data.is_empty());
+        }
+    }
+
+    #[test]
+    fn test_analyzer_fast_decode() {
+        let paths = get_sample_paths();
+        let analyzer = Analyzer::from_files(paths.clone(), false, false);
+        let expected = analyzer.run(0.3, 3.0, false, false).unwrap();
+
+        let analyzer = Analyzer::from_files(paths, false, false).with_fast_decode(true);
+        let data = analyzer.run(0.3, 3.0, false, false).unwrap();
+
+        // The fast path is not bit-exact, but the hashes should be nearly the same as for a full
+        // decode.
+        for (d, e) in data.iter().zip(expected.iter()) {
+            assert_eq!(d.data.len(), e.data.len());
+            assert_hashes_close(d, e);
+        }
+    }
+
+    #[test]
+    fn test_analyzer_timings() {
+        let paths = get_sample_paths();
+        let analyzer = Analyzer::from_files(paths.clone(), false, false);
+        let (_, summary) = analyzer.run_with_summary(0.3, 3.0, false, false).unwrap();
+        for stage in [Stage::Open, Stage::Demux, Stage::Decode, Stage::Fingerprint] {
+            assert_eq!(summary.stages.count(stage), paths.len());
+        }
+        // Nothing was written to disk.
+        assert_eq!(summary.stages.count(Stage::HashWrite), 0);
+    }
+
+    #[test]
+    fn test_analyzer_pcm_cache() {
+        let dir = crate::util::test_temp_path("analyzer-pcm-cache");
+        let _ = std::fs::remove_dir_all(&dir);
+        let cache = PcmCache::new(&dir, 1 << 30).unwrap();
+        let paths = get_sample_paths();
+
+        // The first run fills the cache.
+        let analyzer =
+            Analyzer::from_files(paths.clone(), false, false).with_pcm_cache(Some(cache.clone()));
+        analyzer.run(0.3, 3.0, false, false).unwrap();
+        assert_eq!(std::fs::read_dir(&dir).unwrap().count(), paths.len());
+
+        // Hashes for a different period are rebuilt from the cache, and are close to those of a
+        // full decode.
+        let expected = Analyzer::from_files(paths.clone(), false, false)
+            .run(0.5, 3.0, false, false)
+            .unwrap();
+        let data = Analyzer::from_files(paths, false, false)
+            .with_pcm_cache(Some(cache))
+            .run(0.5, 3.0, false, false)
+            .unwrap();
+        for (d, e) in data.iter().zip(expected.iter()) {
+            assert!((d.data.len() as i64 - e.data.len() as i64).abs() <= 1);
+            assert_hashes_close(d, e);
+        }
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_analyzer_template() {
+        let paths = get_sample_paths();
+        let analyzer = Analyzer::from_files(paths.clone(), false, false);
+        let expected = analyzer.run(0.3, 3.0, false, false).unwrap();
+
+        // Use the first few hashes of the video as its "opening". Like in skip files, the opening
+        // ends where the audio covered by its last hash starts. Without an ending, analysis stops
+        // as soon as the opening is matched.
+        let hash_duration = Duration::from_secs(3);
+        let opening = (expected[0].data[0].1, expected[0].data[2].1 - hash_duration);
+        let template = AnalysisTemplate::new(&expected[0], Some(opening), None);
+        let analyzer =
+            Analyzer::from_files(paths[..1].to_vec(), false, false).with_template(Some(template));
+        let data = analyzer.run(0.3, 3.0, false, false).unwrap();
+
+        let n = data[0].data.len();
+        assert!(n < expected[0].data.len());
+        assert_eq!(data[0].data[..], expected[0].data[..n]);
+        let coverage = data[0].coverage().unwrap();
+        assert_eq!(coverage.ranges().len(), 1);
+    }
+
+    #[test]
+    fn test_frame_hashes_legacy_layout() {
+        let path = crate::util::test_temp_path("legacy-layout").with_extension("needle.bin");
+        let legacy = LegacyFrameHashes {
+            hash_period: 0.3,
+            hash_duration: 3.0,
+            data: vec![(1, Duration::ZERO), (2, Duration::from_millis(300))],
+            md5: "legacy".to_owned(),
+        };
+        std::fs::write(&path, bincode::serialize(&legacy).unwrap()).unwrap();
+
+        // Data written before the format was versioned is migrated.
+        let data = FrameHashes::from_path(&path).unwrap();
+        assert_eq!(data.data, legacy.data);
+        assert_eq!(data.md5, legacy.md5);
+        assert_eq!(data.engine, FingerprintEngine::Chromaprint);
+        assert!(data.coverage.is_none());
+
+        // Migrated data is written back using the current layout.
+        data.to_path(&path).unwrap();
+        assert_eq!(FrameHashes::from_path(&path).unwrap().data, legacy.data);
+
+        // Data written by a newer version is rejected instead of being misread.
+        let mut bytes = FRAME_HASH_DATA_MAGIC.to_vec();
+        bytes.extend(bincode::serialize(&(FRAME_HASH_DATA_VERSION + 1)).unwrap());
+        std::fs::write(&path, bytes).unwrap();
+        assert!(matches!(
+            FrameHashes::from_path(&path),
+            Err(Error::FrameHashDataUnsupported(_, v)) if v == FRAME_HASH_DATA_VERSION + 1
+        ));
+
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn test_can_reuse_partial_coverage() {
+        let mut data: FrameHashes = LegacyFrameHashes {
+            hash_period: 0.3,
+            hash_duration: 3.0,
+            data: Vec::new(),
+            md5: String::new(),
+        }
+        .into();
+        let analyzer = || Analyzer::<PathBuf>::default();
+
+        // Data resolved using chapters has no hashes, so it is only good for runs that use them.
+        data.coverage = Some(Coverage {
+            duration: Duration::from_secs(1440),
+            ranges: Vec::new(),
+            source: CoverageSource::Chapters,
+        });
+        assert!(!analyzer().can_reuse(&data, 0.3, 3.0, 1));
+        assert!(!analyzer()
+            .with_subtitle_hints(true)
+            .can_reuse(&data, 0.3, 3.0, 1));
+        assert!(analyzer().with_chapters(true).can_reuse(&data, 0.3, 3.0, 1));
+
+        data.coverage.as_mut().unwrap().source = CoverageSource::SubtitleHints;
+        assert!(analyzer()
+            .with_subtitle_hints(true)
+            .can_reuse(&data, 0.3, 3.0, 1));
+        assert!(!analyzer().with_chapters(true).can_reuse(&data, 0.3, 3.0, 1));
+    }
+
+    #[test]
+    fn test_content_md5_reuse() {
+        let dir = crate::util::test_temp_path("content-md5-reuse");
+        std::fs::create_dir_all(&dir).unwrap();
+        let video = dir.join("sample-5s.mp4");
+        std::fs::copy(&get_sample_paths()[0], &video).unwrap();
+
+        let analyzer = Analyzer::from_files(vec![video.clone()], false, true);
+        let expected = analyzer.run(0.3, 3.0, true, false).unwrap();
+        // The hash computed during analysis matches the one computed by demuxing alone.
+        assert_eq!(
+            expected[0].content_md5,
+            Analyzer::<PathBuf>::compute_content_md5sum(&video).unwrap()
+        );
+
+        // Make the stored data look like it was written before the video was remuxed: both the
+        // metadata and the header differ, but the audio does not.
+        let frame_hash_path = video.with_extension(crate::audio::FRAME_HASH_DATA_FILE_EXT);
+        let mut stale = FrameHashes::from_path(&frame_hash_path).unwrap();
+        stale.identity.size += 1;
+        stale.md5 = "stale".to_owned();
+        stale.data.truncate(1);
+        stale.to_path(&frame_hash_path).unwrap();
+
+        // The stale data is reused as-is, and is updated to match the new header.
+        let data = analyzer.run(0.3, 3.0, true, false).unwrap();
+        assert_eq!(data[0].data.len(), 1);
+        assert_eq!(data[0].md5, expected[0].md5);
+        assert_eq!(data[0].content_md5, expected[0].content_md5);
+        assert!(FrameHashes::from_video_if_current(&video).is_some());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_frame_hashes_if_current() {
+        let dir = crate::util::test_temp_path("frame-hashes-if-current");
+        std::fs::create_dir_all(&dir).unwrap();
+        let video = dir.join("sample-5s.mp4");
+        std::fs::copy(&get_sample_paths()[0], &video).unwrap();
+
+        let analyzer = Analyzer::from_files(vec![video.clone()], false, true);
+        let expected = analyzer.run(0.3, 3.0, true, false).unwrap();
+        let data = FrameHashes::from_video_if_current(&video).unwrap();
+        assert_eq!(data.data, expected[0].data);
+
+        // Any change to the video invalidates the frame hash data.
+        let mut f = std::fs::OpenOptions::new()
+            .append(true)
+            .open(&video)
+            .unwrap();
+        f.write_all(&[0; 16]).unwrap();
+        drop(f);
+        assert!(FrameHashes::from_video_if_current(&video).is_none());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_analyzer_limits() {
+        let paths = get_sample_paths();
+        let limits = AnalyzerLimits {
+            max_packets: Some(10),
+            ..Default::default()
+        };
+
+        let analyzer = Analyzer::from_files(paths.clone(), false, false).with_limits(limits);
+        let (data, summary) = analyzer.run_with_summary(0.3, 3.0, false, false).unwrap();
+        assert_eq!(summary.completed, 2);
+        assert_eq!(summary.truncated.len(), 2);
+        assert!(data
+            .iter()
+            .all(|d| d.as_ref().unwrap().truncated() == Some(AnalyzerLimit::Packets)));
+
+        let limits = AnalyzerLimits {
+            action: LimitAction::Skip,
+            ..limits
+        };
+        let analyzer = Analyzer::from_files(paths, false, false).with_limits(limits);
+        let (data, summary) = analyzer.run_with_summary(0.3, 3.0, false, false).unwrap();
+        assert_eq!(summary.completed, 0);
+        assert_eq!(summary.failed.len(), 2);
+        assert!(data.iter().all(|d| d.is_none()));
+        assert!(analyzer.run(0.3, 3.0, false, false).is_err());
+    }
+
+    #[test]
+    fn test_analyzer_reanalyze_hash_period() {
+        let dir = crate::util::test_temp_path("analyzer-reanalyze-hash-period");
+        std::fs::create_dir_all(&dir).unwrap();
+        let video = dir.join("sample-5s.mp4");
+        std::fs::copy(&get_sample_paths()[0], &video).unwrap();
+
+        let analyzer = Analyzer::from_files(vec![video.clone()], false, false);
+        analyzer.run(0.3, 3.0, true, false).unwrap();
+
+        // The persisted data was computed with other settings, so it is not reused.
+        let data = analyzer.run(0.5, 3.0, true, false).unwrap();
+        assert_eq!(data[0].hash_period, 0.5);
+        let data = analyzer.run(0.5, 2.0, true, false).unwrap();
+        assert_eq!(data[0].hash_duration, 2.0);
+        let data =
+            FrameHashes::from_path(video.with_extension(crate::audio::FRAME_HASH_DATA_FILE_EXT))
+                .unwrap();
+        assert_eq!((data.hash_period, data.hash_duration), (0.5, 2.0));
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_analyzer_limits_reanalyze() {
+        let dir = crate::util::test_temp_path("analyzer-limits-reanalyze");
+        std::fs::create_dir_all(&dir).unwrap();
+        let video = dir.join("sample-5s.mp4");
+        std::fs::copy(&get_sample_paths()[0], &video).unwrap();
+
+        let limits = AnalyzerLimits {
+            max_packets: Some(10),
+            ..Default::default()
+        };
+        let truncated = Analyzer::from_files(vec![video.clone()], false, false)
+            .with_limits(limits)
+            .run(0.3, 3.0, true, false)
+            .unwrap();
+        assert_eq!(truncated[0].truncated(), Some(AnalyzerLimit::Packets));
+
+        // The persisted data is incomplete, so a run without limits analyzes the video again.
+        let data = Analyzer::from_files(vec![video.clone()], false, false)
+            .run(0.3, 3.0, true, false)
+            .unwrap();
+        assert_eq!(data[0].truncated(), None);
+        assert!(data[0].data.len() > truncated[0].data.len());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
 }
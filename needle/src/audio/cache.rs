@@ -0,0 +1,246 @@
+use std::path::{Path, PathBuf};
+use std::time::{Duration, SystemTime};
+
+use serde::{Deserialize, Serialize};
+
+use crate::Result;
+
+/// Sample rate of cached audio. This is the rate Chromaprint works at; the other engines use
+/// lower rates, so cached audio can be used to rebuild hashes for any of them.
+pub(crate) const PCM_SAMPLE_RATE: u32 = 11025;
+
+/// Extension of cache entries.
+const PCM_CACHE_FILE_EXT: &str = "needle.pcm";
+
+/// Decoded audio of the primary track of a video, as low rate mono PCM.
+#[derive(Debug, Deserialize, Serialize)]
+pub(crate) struct PcmEntry {
+    pub(crate) sample_rate: u32,
+    // Timestamp of the first sample in the video.
+    pub(crate) offset: Duration,
+    pub(crate) samples: Vec<i16>,
+}
+
+/// An on-disk cache of decoded audio, used to rebuild frame hashes without decoding videos again.
+///
+/// Decoding is by far the most expensive part of analysis. With a cache in place, changing the
+/// hash period, hash duration, or [super::FingerprintEngine] only requires hashing the cached audio.
+/// Audio is stored as 11025 Hz mono PCM, which takes up about 80 MB per hour of video.
+///
+/// Entries are keyed by the contents of the video, so renamed or moved videos still hit the cache.
+/// Once the cache grows past its size budget, the least recently used entries are evicted.
+#[derive(Clone, Debug)]
+pub struct PcmCache {
+    dir: PathBuf,
+    budget: u64,
+}
+
+impl PcmCache {
+    /// Creates a cache that stores its entries in `dir` and keeps them under `budget` bytes in
+    /// total. The directory is created if it does not exist.
+    pub fn new(dir: impl Into<PathBuf>, budget: u64) -> Result<Self> {
+        let dir = dir.into();
+        std::fs::create_dir_all(&dir)?;
+        Ok(Self { dir, budget })
+    }
+
+    /// Returns the directory that holds the cache entries.
+    pub fn dir(&self) -> &Path {
+        &self.dir
+    }
+
+    /// Returns the size budget of the cache, in bytes.
+    pub fn budget(&self) -> u64 {
+        self.budget
+    }
+
+    /// Builds the cache key for the given audio stream of a video.
+    pub(crate) fn key(md5: &str, size: u64, stream_idx: usize) -> String {
+        format!("{}-{}-{}", md5, size, stream_idx)
+    }
+
+    fn entry_path(&self, key: &str) -> PathBuf {
+        self.dir.join(key).with_extension(PCM_CACHE_FILE_EXT)
+    }
+
+    /// Loads the entry for `key`, if any. Entries that cannot be decoded are treated as missing.
+    pub(crate) fn load(&self, key: &str) -> Option<PcmEntry> {
+        let path = self.entry_path(key);
+        let f = std::fs::File::open(&path).ok()?;
+        let entry: PcmEntry = bincode::deserialize_from(std::io::BufReader::new(f)).ok()?;
+        // Mark the entry as recently used. This needs write access, which a shared or read-only
+        // cache may not grant, and failing to do so only affects eviction order.
+        if let Ok(f) = std::fs::File::options().write(true).open(&path) {
+            let _ = f.set_modified(SystemTime::now());
+        }
+        Some(entry)
+    }
+
+    /// Stores `entry` under `key`, then evicts the least recently used entries until the cache is
+    /// back under its budget. Entries that are larger than the whole budget are not stored.
+    pub(crate) fn store(&self, key: &str, entry: &PcmEntry) -> Result<()> {
+        let size = bincode::serialized_size(entry)?;
+        if size > self.budget {
+            tracing::debug!(size, "audio for {} does not fit in the PCM cache", key);
+            return Ok(());
+        }
+
+        // Write to a temporary file first so that concurrent readers never see partial entries.
+        let path = self.entry_path(key);
+        let tmp_path = path.with_extension("tmp");
+        {
+            let mut f = std::io::BufWriter::new(std::fs::File::create(&tmp_path)?);
+            bincode::serialize_into(&mut f, entry)?;
+            std::io::Write::flush(&mut f)?;
+        }
+        std::fs::rename(&tmp_path, &path)?;
+
+        self.evict(&path)
+    }
+
+    // Removes the least recently used entries (other than `keep`) until the cache fits its budget.
+    fn evict(&self, keep: &Path) -> Result<()> {
+        let mut entries = Vec::new();
+        for dir_entry in std::fs::read_dir(&self.dir)? {
+            let path = dir_entry?.path();
+            if !path.to_string_lossy().ends_with(PCM_CACHE_FILE_EXT) {
+                continue;
+            }
+            // Entries may be evicted by another process at any time.
+            let metadata = match std::fs::metadata(&path) {
+                Ok(metadata) => metadata,
+                Err(err) if err.kind() == std::io::ErrorKind::NotFound => continue,
+                Err(err) => return Err(err.into()),
+            };
+            let used = metadata.modified().unwrap_or(SystemTime::UNIX_EPOCH);
+            entries.push((used, metadata.len(), path));
+        }
+
+        let mut total: u64 = entries.iter().map(|(_, size, _)| size).sum();
+        entries.sort();
+        for (_, size, path) in entries {
+            if total <= self.budget {
+                break;
+            }
+            if path == keep {
+                continue;
+            }
+            tracing::debug!("evicting {} from the PCM cache", path.display());
+            match std::fs::remove_file(&path) {
+                Ok(()) => (),
+                Err(err) if err.kind() == std::io::ErrorKind::NotFound => (),
+                Err(err) => return Err(err.into()),
+            }
+            total -= size;
+        }
+
+        Ok(())
+    }
+}
+
+/// Captures decoded audio as [PCM_SAMPLE_RATE] mono samples for the [PcmCache].
+pub(crate) struct PcmRecorder {
+    resampler: Option<ffmpeg_next::software::resampling::Context>,
+    frame: ffmpeg_next::frame::Audio,
+    samples: Vec<i16>,
+}
+
+impl PcmRecorder {
+    pub(crate) fn new() -> Self {
+        Self {
+            resampler: None,
+            frame: ffmpeg_next::frame::Audio::empty(),
+            samples: Vec::new(),
+        }
+    }
+
+    fn build_resampler(
+        frame: &ffmpeg_next::frame::Audio,
+    ) -> Result<ffmpeg_next::software::resampling::Context> {
+        Ok(frame.resampler(
+            ffmpeg_next::format::Sample::I16(ffmpeg_next::format::sample::Type::Packed),
+            ffmpeg_next::ChannelLayout::MONO,
+            PCM_SAMPLE_RATE,
+        )?)
+    }
+
+    /// Resamples and appends a decoded frame.
+    pub(crate) fn record(&mut self, frame: &ffmpeg_next::frame::Audio) -> Result<()> {
+        if self.resampler.is_none() {
+            self.resampler = Some(Self::build_resampler(frame)?);
+        }
+        let resampler = self.resampler.as_mut().unwrap();
+        let mut delay = match resampler.run(frame, &mut self.frame) {
+            Ok(delay) => delay,
+            Err(ffmpeg_next::Error::InputChanged) => {
+                let resampler = self.resampler.insert(Self::build_resampler(frame)?);
+                resampler.run(frame, &mut self.frame)?
+            }
+            Err(err) => return Err(err.into()),
+        };
+
+        loop {
+            let raw_samples = &self.frame.data(0)[..self.frame.samples() * 2];
+            // SAFETY: The resampler was asked to output packed S16 samples.
+            let (_, samples, _) = unsafe { raw_samples.align_to::<i16>() };
+            self.samples.extend_from_slice(samples);
+
+            if delay.is_none() {
+                break;
+            }
+            delay = self.resampler.as_mut().unwrap().flush(&mut self.frame)?;
+        }
+
+        Ok(())
+    }
+
+    /// Returns the recorded audio, starting at `offset` in the video.
+    pub(crate) fn finish(self, offset: Duration) -> PcmEntry {
+        PcmEntry {
+            sample_rate: PCM_SAMPLE_RATE,
+            offset,
+            samples: self.samples,
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn entry(num_samples: usize) -> PcmEntry {
+        PcmEntry {
+            sample_rate: PCM_SAMPLE_RATE,
+            offset: Duration::ZERO,
+            samples: vec![1; num_samples],
+        }
+    }
+
+    #[test]
+    fn test_pcm_cache() {
+        let dir = crate::util::test_temp_path("pcm-cache");
+        let _ = std::fs::remove_dir_all(&dir);
+        let entry_size = bincode::serialized_size(&entry(1000)).unwrap();
+        let cache = PcmCache::new(&dir, 2 * entry_size).unwrap();
+
+        cache.store("a", &entry(1000)).unwrap();
+        cache.store("b", &entry(1000)).unwrap();
+        assert_eq!(cache.load("a").unwrap().samples.len(), 1000);
+
+        // Adding a third entry evicts one of the others, but never the new one.
+        cache.store("c", &entry(1000)).unwrap();
+        assert!(cache.load("c").is_some());
+        let num_entries = ["a", "b"]
+            .iter()
+            .filter(|key| cache.load(key).is_some())
+            .count();
+        assert_eq!(num_entries, 1);
+
+        // Entries that don't fit at all are not stored.
+        cache.store("d", &entry(10000)).unwrap();
+        assert!(cache.load("d").is_none());
+        assert!(cache.load("missing").is_none());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
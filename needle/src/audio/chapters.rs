@@ -0,0 +1,203 @@
+use std::time::Duration;
+
+use serde::{Deserialize, Serialize};
+
+use super::subtitles::Song;
+
+/// Named chapters that are shorter or longer than this are unlikely to be an opening or ending.
+const MIN_SONG_DURATION: Duration = Duration::from_secs(super::DEFAULT_MIN_OPENING_DURATION as u64);
+const MAX_SONG_DURATION: Duration = Duration::from_secs(300);
+
+/// Times that are at most this far from a chapter boundary are moved onto it.
+const SNAP_TOLERANCE: Duration = Duration::from_secs(3);
+
+/// A chapter of a video, as stored in its container.
+#[derive(Clone, Debug, PartialEq, Eq, Deserialize, Serialize)]
+pub struct Chapter {
+    pub(crate) start: Duration,
+    pub(crate) end: Duration,
+    pub(crate) title: Option<String>,
+}
+
+impl Chapter {
+    /// Returns the start of the chapter.
+    pub fn start(&self) -> Duration {
+        self.start
+    }
+
+    /// Returns the end of the chapter.
+    pub fn end(&self) -> Duration {
+        self.end
+    }
+
+    /// Returns the title of the chapter, if any.
+    pub fn title(&self) -> Option<&str> {
+        self.title.as_deref()
+    }
+
+    // Returns the song this chapter is named after, e.g., "Opening", "OP2" or "End Credits".
+    fn song(&self) -> Option<Song> {
+        let tokens: Vec<String> = self
+            .title
+            .as_deref()?
+            .split(|c: char| !c.is_ascii_alphanumeric())
+            .map(|token| {
+                token
+                    .to_ascii_lowercase()
+                    .trim_end_matches(|c: char| c.is_ascii_digit())
+                    .to_owned()
+            })
+            .collect();
+        let has = |names: &[&str]| tokens.iter().any(|token| names.contains(&token.as_str()));
+        // "Opening Credits" is an opening.
+        if has(&["op", "opening", "intro"]) {
+            Some(Song::Opening)
+        } else if has(&["ed", "ending", "credits", "outro"]) {
+            Some(Song::Ending)
+        } else {
+            None
+        }
+    }
+}
+
+/// Returns the first chapter that is named after `song` and has a plausible length.
+pub(crate) fn named(chapters: &[Chapter], song: Song) -> Option<(Duration, Duration)> {
+    chapters
+        .iter()
+        .filter(|chapter| chapter.song() == Some(song))
+        .map(|chapter| (chapter.start, chapter.end))
+        .find(|(start, end)| {
+            (MIN_SONG_DURATION..=MAX_SONG_DURATION).contains(&end.saturating_sub(*start))
+        })
+}
+
+/// Returns the chapter boundary closest to `t` if it is close enough, or `t` otherwise.
+pub(crate) fn snap(chapters: &[Chapter], t: Duration) -> Duration {
+    let distance = |boundary: &Duration| {
+        if *boundary > t {
+            *boundary - t
+        } else {
+            t - *boundary
+        }
+    };
+    chapters
+        .iter()
+        .flat_map(|chapter| [chapter.start, chapter.end])
+        .min_by_key(distance)
+        .filter(|boundary| distance(boundary) <= SNAP_TOLERANCE)
+        .unwrap_or(t)
+}
+
+/// Narrows the opening and ending search limits of a video to chapter boundaries. Openings and
+/// endings of well-authored videos are chapters of their own, so the chapters that only partly fall
+/// into a search window do not need to be searched.
+///
+/// The opening limit is moved back to the last chapter boundary before `max_opening_time`, but only
+/// if the part that is cut off is too short to hold an opening (`min_opening_duration`) and the
+/// window that is left is not. Otherwise, the opening may be at the start of the cut-off chapter
+/// (e.g., at the start of "Part A" after a cold open), and the limit is left as-is. The same goes
+/// for the ending limit, which is moved forward to the first boundary after `min_ending_time`.
+pub(crate) fn search_limits(
+    chapters: &[Chapter],
+    max_opening_time: Duration,
+    min_ending_time: Duration,
+    min_opening_duration: Duration,
+    min_ending_duration: Duration,
+) -> (Duration, Duration) {
+    // The start of the first chapter and the end of the last one are not boundaries.
+    let boundaries = || chapters.iter().skip(1).map(|chapter| chapter.start);
+    let end = chapters
+        .last()
+        .map(|chapter| chapter.end)
+        .unwrap_or_default();
+
+    let opening = boundaries()
+        .filter(|b| *b <= max_opening_time)
+        .max()
+        .filter(|b| max_opening_time - *b < min_opening_duration && *b >= min_opening_duration)
+        .unwrap_or(max_opening_time);
+    let ending = boundaries()
+        .filter(|b| *b >= min_ending_time)
+        .min()
+        .filter(|b| {
+            *b - min_ending_time < min_ending_duration
+                && end.saturating_sub(*b) >= min_ending_duration
+        })
+        .unwrap_or(min_ending_time);
+    (opening, ending)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn chapter(start: u64, end: u64, title: &str) -> Chapter {
+        Chapter {
+            start: Duration::from_secs(start),
+            end: Duration::from_secs(end),
+            title: (!title.is_empty()).then(|| title.to_owned()),
+        }
+    }
+
+    #[test]
+    fn test_chapters() {
+        let secs = Duration::from_secs;
+        let chapters = vec![
+            chapter(0, 95, "Prologue"),
+            chapter(95, 185, "Opening Credits"),
+            chapter(185, 700, ""),
+            chapter(700, 1290, "Chapter 4"),
+            chapter(1290, 1380, "ED2"),
+            chapter(1380, 1420, "Preview"),
+        ];
+        assert_eq!(named(&chapters, Song::Opening), Some((secs(95), secs(185))));
+        assert_eq!(
+            named(&chapters, Song::Ending),
+            Some((secs(1290), secs(1380)))
+        );
+        assert_eq!(named(&chapters[2..4], Song::Opening), None);
+
+        assert_eq!(snap(&chapters, secs(183)), secs(185));
+        assert_eq!(snap(&chapters, secs(180)), secs(180));
+
+        // Only slivers of chapters that cannot hold a song are cut off.
+        let min = secs(20);
+        assert_eq!(
+            search_limits(&chapters, secs(710), secs(1280), min, min),
+            (secs(700), secs(1290))
+        );
+        assert_eq!(
+            search_limits(&chapters, secs(730), secs(1065), min, min),
+            (secs(730), secs(1065))
+        );
+        assert_eq!(
+            search_limits(&[], secs(710), secs(1065), min, min),
+            (secs(710), secs(1065))
+        );
+
+        // The opening is at the start of "Part A", after a cold open.
+        let chapters = vec![
+            chapter(0, 95, "Avant"),
+            chapter(95, 800, "Part A"),
+            chapter(800, 1330, "Part B"),
+            chapter(1330, 1420, ""),
+        ];
+        assert_eq!(
+            search_limits(&chapters, secs(710), secs(1065), min, min),
+            (secs(710), secs(1065))
+        );
+
+        // A short logo chapter does not shrink the search window to itself.
+        let chapters = vec![chapter(0, 10, "Logo"), chapter(10, 1420, "")];
+        assert_eq!(
+            search_limits(&chapters, secs(25), secs(1065), min, min),
+            (secs(25), secs(1065))
+        );
+        // Nor does a short preview at the end of the video.
+        let chapters = vec![chapter(0, 1405, ""), chapter(1405, 1420, "Preview")];
+        assert_eq!(
+            search_limits(&chapters, secs(710), secs(1390), min, min),
+            (secs(710), secs(1390))
+        );
+    }
+}
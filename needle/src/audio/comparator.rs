@@ -1,19 +1,27 @@
-extern crate chromaprint_rust;
 #[cfg(feature = "rayon")]
 extern crate rayon;
 
+use std::borrow::Cow;
 use std::collections::{BinaryHeap, HashMap, HashSet};
 use std::fmt::Display;
 use std::path::Path;
-use std::time::Duration;
+use std::sync::{Mutex, OnceLock};
+use std::time::{Duration, Instant};
 
-use chromaprint_rust as chromaprint;
 #[cfg(feature = "rayon")]
 use rayon::prelude::*;
 
+use crate::timing::{Stage, TimingSummary};
 use crate::util;
 use crate::Result;
 
+use super::chapters::{self, Chapter};
+use super::counters;
+use super::dedup::{Alignment, Duplicate, DuplicateDetector};
+use super::planner::{ComparatorEngine, ComparatorPlan, PairingStrategy};
+use super::simhash::SimhashIndex;
+use super::subtitles::{HintConfidence, Song};
+use super::template::Coverage;
 use super::{Analyzer, FrameHashes};
 
 #[derive(serde::Deserialize, serde::Serialize)]
@@ -50,7 +58,47 @@ impl Display for ComparatorHeapEntry {
     }
 }
 
-#[derive(Debug)]
+// Limits used to classify runs found by the LCS search as openings or endings.
+#[derive(Clone, Copy, Debug)]
+struct MatchBounds {
+    src_max_opening_time: Duration,
+    src_min_ending_time: Duration,
+    dst_max_opening_time: Duration,
+    dst_min_ending_time: Duration,
+    src_hash_duration: Duration,
+    dst_hash_duration: Duration,
+    // Consecutive hashes further apart than this are not contiguous (e.g., due to the music
+    // pre-screen), so runs of matching hashes cannot span them.
+    max_gap: Duration,
+}
+
+/// Hash data of one side of a comparison, along with its [SimhashIndex].
+struct HashTrack<'a> {
+    data: &'a [(u32, Duration)],
+    simhash: &'a SimhashIndex,
+}
+
+impl<'a> std::ops::Deref for HashTrack<'a> {
+    type Target = [(u32, Duration)];
+
+    fn deref(&self) -> &Self::Target {
+        self.data
+    }
+}
+
+/// Hashes more than this many hash periods apart are not considered to be contiguous.
+const MAX_GAP_PERIODS: u32 = 3;
+
+// Returns whether each hash starts after a gap in the data.
+fn find_gaps(data: &[(u32, Duration)], max_gap: Duration) -> Vec<bool> {
+    let mut gaps = vec![false; data.len()];
+    for i in 1..data.len() {
+        gaps[i] = data[i].1.saturating_sub(data[i - 1].1) > max_gap;
+    }
+    gaps
+}
+
+#[derive(Debug, Default)]
 struct OpeningAndEndingInfo {
     src_openings: Vec<ComparatorHeapEntry>,
     dst_openings: Vec<ComparatorHeapEntry>,
@@ -70,8 +118,48 @@ impl OpeningAndEndingInfo {
 /// Represents a single result for a video file. This is output by [Comparator::run].
 #[derive(Copy, Clone, Debug, Default)]
 pub struct SearchResult {
-    opening: Option<(Duration, Duration)>,
-    ending: Option<(Duration, Duration)>,
+    pub(crate) opening: Option<(Duration, Duration)>,
+    pub(crate) ending: Option<(Duration, Duration)>,
+}
+
+impl SearchResult {
+    /// Maps this result, found for a reference video, onto another release of the same video.
+    /// Returns `None` if neither the opening nor the ending occur in the other release.
+    pub fn transfer(&self, alignment: &Alignment) -> Option<SearchResult> {
+        let map = |(start, end): (Duration, Duration)| {
+            Some((alignment.map_time(start)?, alignment.map_time(end)?))
+        };
+        let result = SearchResult {
+            opening: self.opening.and_then(map),
+            ending: self.ending.and_then(map),
+        };
+        (result.opening.is_some() || result.ending.is_some()).then(|| result)
+    }
+}
+
+/// Loads the opening and ending stored in the skip file for `video`. Returns `None` if there is no
+/// skip file or if it was written for a different version of the video.
+pub(crate) fn load_skip_file(video: impl AsRef<Path>, md5: &str) -> Result<Option<SearchResult>> {
+    let skip_file = video
+        .as_ref()
+        .to_owned()
+        .with_extension(super::SKIP_FILE_EXT);
+    if !skip_file.exists() {
+        return Ok(None);
+    }
+
+    let f = std::io::BufReader::new(std::fs::File::open(&skip_file)?);
+    let skip_file: SkipFile = serde_json::from_reader(f)?;
+    if skip_file.md5 != md5 {
+        return Ok(None);
+    }
+
+    let to_duration =
+        |(start, end): (f32, f32)| (Duration::from_secs_f32(start), Duration::from_secs_f32(end));
+    Ok(Some(SearchResult {
+        opening: skip_file.opening.map(to_duration),
+        ending: skip_file.ending.map(to_duration),
+    }))
 }
 
 /// Compares two or more video files using either existing [FrameHashes](super::FrameHashes) or by running an
@@ -86,6 +174,14 @@ pub struct Comparator<P: AsRef<Path>> {
     min_opening_duration: Duration,
     min_ending_duration: Duration,
     time_padding: Duration,
+    engine: Option<ComparatorEngine>,
+    pairing: Option<PairingStrategy>,
+    explain_plan: bool,
+    duplicate_detection: bool,
+    subtitle_hints: bool,
+    chapters: bool,
+    // Per-stage timings of all searches run so far.
+    timings: Mutex<TimingSummary>,
 }
 
 impl<P: AsRef<Path>> Default for Comparator<P> {
@@ -99,6 +195,13 @@ impl<P: AsRef<Path>> Default for Comparator<P> {
             min_opening_duration: Duration::from_secs(super::DEFAULT_MIN_OPENING_DURATION as u64),
             min_ending_duration: Duration::from_secs(super::DEFAULT_MIN_ENDING_DURATION as u64),
             time_padding: Duration::ZERO,
+            engine: None,
+            pairing: None,
+            explain_plan: false,
+            duplicate_detection: false,
+            subtitle_hints: false,
+            chapters: false,
+            timings: Default::default(),
         }
     }
 }
@@ -121,6 +224,12 @@ impl<P: AsRef<Path>> Comparator<P> {
         comparator
     }
 
+    /// Returns the time spent in each stage of search so far. Pair searches are timed per pair of
+    /// videos, and all other stages per video.
+    pub fn timings(&self) -> TimingSummary {
+        self.timings.lock().unwrap().clone()
+    }
+
     /// Returns the video paths used by this comparator.
     pub fn videos(&self) -> &[P] {
         &self.videos
@@ -168,34 +277,136 @@ impl<P: AsRef<Path>> Comparator<P> {
         self
     }
 
-    #[inline]
-    fn compute_hash_for_match(hashes: &[(u32, Duration)], (start, end): (usize, usize)) -> u32 {
-        let hashes: Vec<u32> = hashes.iter().map(|t| t.0).collect();
-        chromaprint::simhash::simhash32(&hashes[start..end + 1])
+    /// Returns a new [Comparator] that always uses the provided `engine`. By default, the engine
+    /// is picked by the planner for each pair of videos.
+    pub fn with_engine(mut self, engine: Option<ComparatorEngine>) -> Self {
+        self.engine = engine;
+        self
     }
 
-    /// Runs a LCS (longest common substring) search between the two sets of hashes. This runs in
-    /// O(n * m) time.
+    /// Returns a new [Comparator] that always uses the provided `pairing`. By default, the pairing
+    /// strategy is picked by the planner.
+    pub fn with_pairing(mut self, pairing: Option<PairingStrategy>) -> Self {
+        self.pairing = pairing;
+        self
+    }
+
+    /// Returns a new [Comparator] with the provided `explain_plan`. If set, the [ComparatorPlan]
+    /// is printed to stdout before the search starts.
+    pub fn with_explain_plan(mut self, explain_plan: bool) -> Self {
+        self.explain_plan = explain_plan;
+        self
+    }
+
+    /// Returns a new [Comparator] with the provided `duplicate_detection`. If set, near-duplicate
+    /// videos (e.g., two releases of the same episode) are detected before the search using a
+    /// [DuplicateDetector]. Only the reference video of each group is searched, and its result is
+    /// mapped onto the other videos in the group.
+    pub fn with_duplicate_detection(mut self, duplicate_detection: bool) -> Self {
+        self.duplicate_detection = duplicate_detection;
+        self
+    }
+
+    /// Returns a new [Comparator] with the provided `subtitle_hints`. If set, videos whose
+    /// [SubtitleHints](super::SubtitleHints) have high confidence for the opening (and for the
+    /// ending, unless only openings are searched) take their result from the hints and are not
+    /// searched. See [Analyzer::with_subtitle_hints](super::Analyzer::with_subtitle_hints).
+    pub fn with_subtitle_hints(mut self, subtitle_hints: bool) -> Self {
+        self.subtitle_hints = subtitle_hints;
+        self
+    }
+
+    /// Returns a new [Comparator] with the provided `chapters`. If set, the chapters of each video
+    /// (see [FrameHashes::chapters]) are used in three ways:
+    ///
+    /// * Videos with chapters named after the opening (and the ending, unless only openings are
+    ///   searched) take their result from those chapters and are not searched.
+    /// * The opening and ending search windows are narrowed to nearby chapter boundaries, as long as
+    ///   the part that is cut off is too short to hold a song.
+    /// * Reported times that are close to a chapter boundary are moved onto it.
+    pub fn with_chapters(mut self, chapters: bool) -> Self {
+        self.chapters = chapters;
+        self
+    }
+
+    /// Builds a [ComparatorPlan] for the provided [FrameHashes].
+    ///
+    /// The plan is based on the number of hashes in each video as well as the available memory
+    /// and cores. It is used by [Self::run] to decide how to search the videos.
+    pub fn plan(&self, frame_hashes: &[FrameHashes], threading: bool) -> ComparatorPlan {
+        let videos: Vec<usize> = (0..frame_hashes.len()).collect();
+        self.plan_videos(frame_hashes, &videos, threading)
+    }
+
+    // Same as [Self::plan], but only pairs up the given videos, which are indices into
+    // `frame_hashes`.
+    fn plan_videos(
+        &self,
+        frame_hashes: &[FrameHashes],
+        videos: &[usize],
+        threading: bool,
+    ) -> ComparatorPlan {
+        let hash_counts: Vec<usize> = videos.iter().map(|&i| frame_hashes[i].data.len()).collect();
+        let max_threads = if threading {
+            std::thread::available_parallelism()
+                .map(|n| n.get())
+                .unwrap_or(1)
+        } else {
+            1
+        };
+        let mut plan = ComparatorPlan::new(
+            &hash_counts,
+            max_threads,
+            util::available_memory(),
+            self.pairing,
+            self.engine,
+        );
+        for pair in &mut plan.pairs {
+            pair.src = videos[pair.src];
+            pair.dst = videos[pair.dst];
+        }
+        plan
+    }
+
+    /// Runs a LCS (longest common substring) search between the two sets of hashes using the
+    /// provided engine.
     fn longest_common_hash_match(
         &self,
-        src: &[(u32, Duration)],
-        dst: &[(u32, Duration)],
-        src_max_opening_time: Duration,
-        src_min_ending_time: Duration,
-        dst_max_opening_time: Duration,
-        dst_min_ending_time: Duration,
-        src_hash_duration: Duration,
-        dst_hash_duration: Duration,
+        src: &HashTrack,
+        dst: &HashTrack,
+        bounds: &MatchBounds,
+        engine: ComparatorEngine,
+    ) -> Vec<ComparatorHeapEntry> {
+        match engine {
+            ComparatorEngine::Exact => self.exact_hash_match(src, dst, bounds),
+            ComparatorEngine::Streaming => self.streaming_hash_match(src, dst, bounds),
+        }
+    }
+
+    /// Runs a LCS (longest common substring) search between the two sets of hashes. This runs in
+    /// O(n * m) time and space.
+    fn exact_hash_match(
+        &self,
+        src: &HashTrack,
+        dst: &HashTrack,
+        bounds: &MatchBounds,
     ) -> Vec<ComparatorHeapEntry> {
         // Heap to keep track of best hash matches in order of length.
         let mut heap: ComparatorHeap = BinaryHeap::new();
 
-        // Build the DP table of substrings.
+        let (src_gaps, dst_gaps) = (
+            find_gaps(src, bounds.max_gap),
+            find_gaps(dst, bounds.max_gap),
+        );
+
+        // Build the DP table of substrings. Hashes right after a gap are never part of a run.
         let mut table: Vec<Vec<usize>> = vec![vec![0; dst.len() + 1]; src.len() + 1];
+        let mut cells = 0;
         for i in 0..src.len() {
+            cells += dst.len();
             for j in 0..dst.len() {
                 let (src_hash, dst_hash) = (src[i].0, dst[j].0);
-                if i == 0 || j == 0 {
+                if i == 0 || j == 0 || src_gaps[i] || dst_gaps[j] {
                     table[i][j] = 0;
                 } else if u32::count_ones(src_hash ^ dst_hash) <= self.hash_match_threshold {
                     table[i][j] = table[i - 1][j - 1] + 1;
@@ -221,114 +432,293 @@ impl<P: AsRef<Path>> Comparator<P> {
                     continue;
                 }
 
-                // Figure out whether this is an opening or an ending.
-                //
-                // If the sequence _ends_ before the maximum opening time, it is an opening.
-                // If the sequence _starts_ after the maximum ending time, it is an ending.
-                let (src_start_idx, src_end_idx) = (i - table[i][j], i);
-                let (dst_start_idx, dst_end_idx) = (j - table[i][j], j);
-                let (src_start, src_end) = (src[src_start_idx].1, src[src_end_idx].1);
-                let (dst_start, dst_end) = (dst[dst_start_idx].1, dst[dst_end_idx].1);
-                let (is_src_opening, is_src_ending) = (
-                    src_end < src_max_opening_time,
-                    src_start > src_min_ending_time,
-                );
-                let (is_dst_opening, is_dst_ending) = (
-                    dst_end < dst_max_opening_time,
-                    dst_start > dst_min_ending_time,
-                );
-
-                // A LCS result is only valid iff it is a valid opening or ending in the source _and_ the dest.
-                let is_src_valid = (is_src_opening
-                    && (src_end - src_start) >= self.min_opening_duration)
-                    || (is_src_ending && (src_end - src_start) >= self.min_ending_duration);
-                let is_dst_valid = (is_dst_opening
-                    && (dst_end - dst_start) >= self.min_opening_duration)
-                    || (is_dst_ending && (dst_end - dst_start) >= self.min_ending_duration);
-                let is_valid = is_src_valid && is_dst_valid;
-
-                // Skip invalid sequences.
-                if !is_valid {
-                    j -= 1;
-                    continue;
+                if let Some(entry) = self.build_heap_entry(src, dst, (i, j), table[i][j], bounds) {
+                    heap.push(entry);
                 }
 
-                // If we do not need endings, skip them now.
-                let is_ending = (is_src_ending
-                    && (src_end - src_start) >= self.min_ending_duration)
-                    || (is_dst_ending && (dst_end - dst_start) >= self.min_ending_duration);
-                if is_ending && self.openings_only {
-                    j -= 1;
-                    continue;
-                }
+                j -= 1;
+            }
+
+            i -= 1;
+        }
+
+        counters::add(|c| {
+            c.cells += cells as u64;
+            c.heap_pushes += heap.len() as u64;
+        });
+        heap.into()
+    }
+
+    /// Same as [Self::exact_hash_match], but only keeps two rows of the DP table in memory. This
+    /// runs in O(n * m) time and O(m) space.
+    fn streaming_hash_match(
+        &self,
+        src: &HashTrack,
+        dst: &HashTrack,
+        bounds: &MatchBounds,
+    ) -> Vec<ComparatorHeapEntry> {
+        let mut prev: Vec<usize> = vec![0; dst.len() + 1];
+        let mut curr: Vec<usize> = vec![0; dst.len() + 1];
+
+        let (src_gaps, dst_gaps) = (
+            find_gaps(src, bounds.max_gap),
+            find_gaps(dst, bounds.max_gap),
+        );
+
+        // Ends of substrings, as (i, j, length).
+        let mut run_ends = Vec::new();
 
-                // We have a valid entry at this point.
-                let src_match_hash =
-                    Self::compute_hash_for_match(src, (src_start_idx, src_end_idx));
-                let dst_match_hash =
-                    Self::compute_hash_for_match(dst, (dst_start_idx, dst_end_idx));
-
-                let entry = ComparatorHeapEntry {
-                    score: table[i][j],
-                    src_longest_run: (src_start, src_end),
-                    dst_longest_run: (dst_start, dst_end),
-                    src_match_hash,
-                    dst_match_hash,
-                    is_src_opening,
-                    is_src_ending,
-                    is_dst_opening,
-                    is_dst_ending,
-                    src_hash_duration,
-                    dst_hash_duration,
+        let mut cells = 0;
+        for i in 0..src.len() {
+            cells += dst.len();
+            for j in 0..dst.len() {
+                let (src_hash, dst_hash) = (src[i].0, dst[j].0);
+                curr[j] = if i == 0 || j == 0 || src_gaps[i] || dst_gaps[j] {
+                    0
+                } else if u32::count_ones(src_hash ^ dst_hash) <= self.hash_match_threshold {
+                    prev[j - 1] + 1
+                } else {
+                    0
                 };
+            }
 
-                heap.push(entry);
+            // Now that this row is known, we can find the substrings that end in the previous
+            // row. The first row never contains any.
+            if i > 1 {
+                for j in 1..dst.len() {
+                    if prev[j] != 0 && (j == dst.len() - 1 || curr[j + 1] == 0) {
+                        run_ends.push((i - 1, j, prev[j]));
+                    }
+                }
+            }
 
-                j -= 1;
+            std::mem::swap(&mut prev, &mut curr);
+        }
+
+        // Every substring that reaches the last row ends there.
+        if src.len() > 1 {
+            for j in 1..dst.len() {
+                if prev[j] != 0 {
+                    run_ends.push((src.len() - 1, j, prev[j]));
+                }
             }
+        }
 
-            i -= 1;
+        // Insert entries in the same order as the exact engine so that both return identical
+        // results.
+        let mut heap: ComparatorHeap = BinaryHeap::new();
+        for (i, j, len) in run_ends.into_iter().rev() {
+            if let Some(entry) = self.build_heap_entry(src, dst, (i, j), len, bounds) {
+                heap.push(entry);
+            }
         }
 
+        counters::add(|c| {
+            c.cells += cells as u64;
+            c.heap_pushes += heap.len() as u64;
+        });
         heap.into()
     }
 
+    /// Builds a heap entry for the substring of length `len` that ends at `(i, j)`. Returns `None`
+    /// if the substring is not a valid opening or ending.
+    fn build_heap_entry(
+        &self,
+        src: &HashTrack,
+        dst: &HashTrack,
+        (i, j): (usize, usize),
+        len: usize,
+        bounds: &MatchBounds,
+    ) -> Option<ComparatorHeapEntry> {
+        // Figure out whether this is an opening or an ending.
+        //
+        // If the sequence _ends_ before the maximum opening time, it is an opening.
+        // If the sequence _starts_ after the maximum ending time, it is an ending.
+        let (src_start_idx, src_end_idx) = (i - len, i);
+        let (dst_start_idx, dst_end_idx) = (j - len, j);
+        let (src_start, src_end) = (src[src_start_idx].1, src[src_end_idx].1);
+        let (dst_start, dst_end) = (dst[dst_start_idx].1, dst[dst_end_idx].1);
+        let (is_src_opening, is_src_ending) = (
+            src_end < bounds.src_max_opening_time,
+            src_start > bounds.src_min_ending_time,
+        );
+        let (is_dst_opening, is_dst_ending) = (
+            dst_end < bounds.dst_max_opening_time,
+            dst_start > bounds.dst_min_ending_time,
+        );
+
+        // A LCS result is only valid iff it is a valid opening or ending in the source _and_ the dest.
+        let is_src_valid = (is_src_opening && (src_end - src_start) >= self.min_opening_duration)
+            || (is_src_ending && (src_end - src_start) >= self.min_ending_duration);
+        let is_dst_valid = (is_dst_opening && (dst_end - dst_start) >= self.min_opening_duration)
+            || (is_dst_ending && (dst_end - dst_start) >= self.min_ending_duration);
+        let is_valid = is_src_valid && is_dst_valid;
+
+        // Skip invalid sequences.
+        if !is_valid {
+            return None;
+        }
+
+        // If we do not need endings, skip them now.
+        let is_ending = (is_src_ending && (src_end - src_start) >= self.min_ending_duration)
+            || (is_dst_ending && (dst_end - dst_start) >= self.min_ending_duration);
+        if is_ending && self.openings_only {
+            return None;
+        }
+
+        // We have a valid entry at this point.
+        let src_match_hash = src.simhash.simhash(src_start_idx, src_end_idx);
+        let dst_match_hash = dst.simhash.simhash(dst_start_idx, dst_end_idx);
+
+        Some(ComparatorHeapEntry {
+            score: len,
+            src_longest_run: (src_start, src_end),
+            dst_longest_run: (dst_start, dst_end),
+            src_match_hash,
+            dst_match_hash,
+            is_src_opening,
+            is_src_ending,
+            is_dst_opening,
+            is_dst_ending,
+            src_hash_duration: bounds.src_hash_duration,
+            dst_hash_duration: bounds.dst_hash_duration,
+        })
+    }
+
+    /// Picks the audio tracks to compare between two videos. Tracks are identified by their
+    /// position in [FrameHashes::all_tracks].
+    ///
+    /// If both videos have a track in the same language, those tracks are compared, with the primary
+    /// tracks taking precedence. Otherwise, the primary tracks are compared.
+    fn select_tracks(src: &FrameHashes, dst: &FrameHashes) -> (usize, usize) {
+        for (src_idx, (src_language, _)) in src.all_tracks().enumerate() {
+            for (dst_idx, (dst_language, _)) in dst.all_tracks().enumerate() {
+                if src_language.is_some() && src_language == dst_language {
+                    return (src_idx, dst_idx);
+                }
+            }
+        }
+        (0, 0)
+    }
+
+    /// Returns the [SimhashIndex] of `data`, which is either track `track` of a video or hash
+    /// data derived from it. Indexes of tracks are built once and shared by all pairs that
+    /// include the video.
+    fn simhash_index<'a>(
+        data: &Cow<[(u32, Duration)]>,
+        simhashes: &'a [OnceLock<SimhashIndex>],
+        track: usize,
+    ) -> Cow<'a, SimhashIndex> {
+        let index = match data {
+            Cow::Borrowed(data) => {
+                Cow::Borrowed(simhashes[track].get_or_init(|| SimhashIndex::new(data)))
+            }
+            // Resampled data needs an index of its own.
+            Cow::Owned(data) => Cow::Owned(SimhashIndex::new(data)),
+        };
+        debug_assert_eq!(index.len(), data.len());
+        index
+    }
+
+    /// Returns the latest time an opening can end at and the earliest time an ending can start at.
+    ///
+    /// Hash data that only covers part of the video (see [FrameHashes::coverage]) has gaps, so the
+    /// limits are based on the duration of the full video instead of on the hash indices.
+    ///
+    /// If chapters are enabled, the limits are narrowed to nearby chapter boundaries (see
+    /// [Self::with_chapters]).
+    fn search_times(
+        &self,
+        hash_data: &[(u32, Duration)],
+        coverage: Option<&Coverage>,
+        chapters: &[Chapter],
+    ) -> (Duration, Duration) {
+        let (max_opening_time, min_ending_time) = if let Some(coverage) = coverage {
+            (
+                coverage.duration.mul_f32(self.opening_search_percentage),
+                coverage
+                    .duration
+                    .mul_f32(1.0 - self.ending_search_percentage),
+            )
+        } else {
+            let opening_search_idx =
+                ((hash_data.len() - 1) as f32 * self.opening_search_percentage) as usize;
+            let ending_search_idx =
+                ((hash_data.len() - 1) as f32 * (1.0 - self.ending_search_percentage)) as usize;
+            (
+                hash_data[opening_search_idx].1,
+                hash_data[ending_search_idx].1,
+            )
+        };
+        if self.chapters {
+            chapters::search_limits(
+                chapters,
+                max_opening_time,
+                min_ending_time,
+                self.min_opening_duration,
+                self.min_ending_duration,
+            )
+        } else {
+            (max_opening_time, min_ending_time)
+        }
+    }
+
+    // `src_simhashes` and `dst_simhashes` hold the lazily built [SimhashIndex] of each track of
+    // the source and destination video.
     fn find_opening_and_ending(
         &self,
         src_hashes: &super::analyzer::FrameHashes,
         dst_hashes: &super::analyzer::FrameHashes,
+        src_simhashes: &[OnceLock<SimhashIndex>],
+        dst_simhashes: &[OnceLock<SimhashIndex>],
+        engine: ComparatorEngine,
     ) -> OpeningAndEndingInfo {
         let _g = tracing::span!(tracing::Level::TRACE, "find_opening_and_ending");
 
-        let src_hash_data = &src_hashes.data;
-        let dst_hash_data = &dst_hashes.data;
+        let (src_track, dst_track) = Self::select_tracks(src_hashes, dst_hashes);
+        let (src_hash_data, dst_hash_data) = super::rehash::align_periods(
+            src_hashes.all_tracks().nth(src_track).unwrap().1,
+            src_hashes.hash_period,
+            dst_hashes.all_tracks().nth(dst_track).unwrap().1,
+            dst_hashes.hash_period,
+        );
+        let src_simhash = Self::simhash_index(&src_hash_data, src_simhashes, src_track);
+        let dst_simhash = Self::simhash_index(&dst_hash_data, dst_simhashes, dst_track);
         let src_hash_duration = Duration::from_secs_f32(src_hashes.hash_duration);
         let dst_hash_duration = Duration::from_secs_f32(dst_hashes.hash_duration);
 
         // Figure out the duration limits for opening and endings.
-        let src_opening_search_idx =
-            ((src_hash_data.len() - 1) as f32 * self.opening_search_percentage) as usize;
-        let src_ending_search_idx =
-            ((src_hash_data.len() - 1) as f32 * (1.0 - self.ending_search_percentage)) as usize;
-        let dst_opening_search_idx =
-            ((dst_hash_data.len() - 1) as f32 * self.opening_search_percentage) as usize;
-        let dst_ending_search_idx =
-            ((dst_hash_data.len() - 1) as f32 * (1.0 - self.ending_search_percentage)) as usize;
-        let src_max_opening_time = src_hash_data[src_opening_search_idx].1;
-        let src_min_ending_time = src_hash_data[src_ending_search_idx].1;
-        let dst_max_opening_time = dst_hash_data[dst_opening_search_idx].1;
-        let dst_min_ending_time = dst_hash_data[dst_ending_search_idx].1;
-
-        let entries = self.longest_common_hash_match(
-            src_hash_data,
-            dst_hash_data,
+        let (src_max_opening_time, src_min_ending_time) = self.search_times(
+            &src_hash_data,
+            src_hashes.coverage.as_ref(),
+            &src_hashes.chapters,
+        );
+        let (dst_max_opening_time, dst_min_ending_time) = self.search_times(
+            &dst_hash_data,
+            dst_hashes.coverage.as_ref(),
+            &dst_hashes.chapters,
+        );
+        let bounds = MatchBounds {
             src_max_opening_time,
             src_min_ending_time,
             dst_max_opening_time,
             dst_min_ending_time,
             src_hash_duration,
             dst_hash_duration,
-        );
+            max_gap: Duration::from_secs_f32(
+                f32::max(src_hashes.hash_period, dst_hashes.hash_period) * MAX_GAP_PERIODS as f32,
+            ),
+        };
+
+        let src = HashTrack {
+            data: &src_hash_data,
+            simhash: &src_simhash,
+        };
+        let dst = HashTrack {
+            data: &dst_hash_data,
+            simhash: &dst_simhash,
+        };
+        let entries = self.longest_common_hash_match(&src, &dst, &bounds, engine);
 
         tracing::debug!(
             num_matches = entries.len(),
@@ -362,7 +752,9 @@ impl<P: AsRef<Path>> Comparator<P> {
         }
     }
 
-    fn check_skip_file(video: impl AsRef<Path>) -> Result<bool> {
+    // `md5` is the MD5 hash of the video header, as stored in its frame hash data. This avoids
+    // reading the video itself.
+    fn check_skip_file(video: impl AsRef<Path>, md5: &str) -> Result<bool> {
         let skip_file = video
             .as_ref()
             .to_owned()
@@ -371,9 +763,6 @@ impl<P: AsRef<Path>> Comparator<P> {
             return Ok(false);
         }
 
-        // Compute MD5 hash of the video header.
-        let md5 = crate::util::compute_header_md5sum(video)?;
-
         // Read existing skip file and compare MD5 hashes.
         let f = std::fs::File::open(&skip_file)?;
         let skip_file: SkipFile = serde_json::from_reader(&f).unwrap();
@@ -381,7 +770,12 @@ impl<P: AsRef<Path>> Comparator<P> {
         Ok(skip_file.md5 == md5)
     }
 
-    fn create_skip_file(&self, video: impl AsRef<Path>, result: SearchResult) -> Result<()> {
+    fn create_skip_file(
+        &self,
+        video: impl AsRef<Path>,
+        md5: &str,
+        result: SearchResult,
+    ) -> Result<()> {
         let opening = result
             .opening
             .map(|(start, end)| (start.as_secs_f32(), end.as_secs_f32()));
@@ -392,7 +786,6 @@ impl<P: AsRef<Path>> Comparator<P> {
             return Ok(());
         }
 
-        let md5 = crate::util::compute_header_md5sum(&video)?;
         let skip_file = video
             .as_ref()
             .to_owned()
@@ -401,7 +794,7 @@ impl<P: AsRef<Path>> Comparator<P> {
         let data = SkipFile {
             opening,
             ending,
-            md5,
+            md5: md5.to_owned(),
         };
         serde_json::to_writer(&mut skip_file, &data)?;
 
@@ -435,19 +828,130 @@ impl<P: AsRef<Path>> Comparator<P> {
         }
     }
 
+    // Returns the result suggested by the chapters or subtitle hints of a video if they can be
+    // trusted without searching the video, along with where it came from.
+    fn known_result(&self, frame_hashes: &FrameHashes) -> Option<(SearchResult, &'static str)> {
+        let from_chapters = || {
+            self.known_songs(|song| chapters::named(&frame_hashes.chapters, song))
+                .map(|result| (result, "chapters"))
+        };
+        let from_hints = || {
+            let hints = frame_hashes.subtitle_hints.as_ref()?;
+            self.known_songs(|song| {
+                match song {
+                    Song::Opening => hints.opening(),
+                    Song::Ending => hints.ending(),
+                }
+                .filter(|hint| hint.confidence == HintConfidence::High)
+                .map(|hint| (hint.start, hint.end))
+            })
+            .map(|result| (result, "subtitle hints"))
+        };
+        self.chapters
+            .then(from_chapters)
+            .flatten()
+            .or_else(|| self.subtitle_hints.then(from_hints).flatten())
+    }
+
+    // Builds a result from the known times of the opening and ending of a video. Returns `None`
+    // if one that is needed is not known.
+    fn known_songs(
+        &self,
+        find: impl Fn(Song) -> Option<(Duration, Duration)>,
+    ) -> Option<SearchResult> {
+        let pad = |(start, end): (Duration, Duration)| {
+            (
+                start + self.time_padding,
+                end.saturating_sub(self.time_padding),
+            )
+        };
+        let opening = find(Song::Opening).map(pad)?;
+        let ending = if self.openings_only {
+            None
+        } else {
+            Some(find(Song::Ending).map(pad)?)
+        };
+        Some(SearchResult {
+            opening: Some(opening),
+            ending,
+        })
+    }
+
+    // Moves the times of a search result onto nearby chapter boundaries of the video, if chapters
+    // are enabled.
+    fn snap_to_chapters(&self, result: SearchResult, chapters: &[Chapter]) -> SearchResult {
+        if !self.chapters {
+            return result;
+        }
+        let snap = |(start, end): (Duration, Duration)| {
+            (
+                chapters::snap(chapters, start),
+                chapters::snap(chapters, end),
+            )
+        };
+        SearchResult {
+            opening: result.opening.map(snap),
+            ending: result.ending.map(snap),
+        }
+    }
+
+    fn record_time(&self, stage: Stage, started: Instant) {
+        let elapsed = started.elapsed();
+        self.timings.lock().unwrap().record(stage, elapsed);
+    }
+
     fn search(
         &self,
         src_idx: usize,
         dst_idx: usize,
+        engine: ComparatorEngine,
         frame_hash_map: &[FrameHashes],
+        simhashes: &[Vec<OnceLock<SimhashIndex>>],
     ) -> Result<OpeningAndEndingInfo> {
         tracing::debug!("started audio comparator");
 
         let (src_frame_hashes, dst_frame_hashes) =
             (&frame_hash_map[src_idx], &frame_hash_map[dst_idx]);
 
-        tracing::debug!("starting search for opening and ending");
-        let info = self.find_opening_and_ending(src_frame_hashes, dst_frame_hashes);
+        // Hashes computed over different durations of audio never match, so there is no point in
+        // comparing them. Differing hash periods are handled during the search.
+        if !super::rehash::same_period(
+            src_frame_hashes.hash_duration,
+            dst_frame_hashes.hash_duration,
+        ) {
+            tracing::warn!(
+                src_hash_duration = src_frame_hashes.hash_duration,
+                dst_hash_duration = dst_frame_hashes.hash_duration,
+                "skipping comparison of videos analyzed with different hash durations"
+            );
+            return Ok(Default::default());
+        }
+
+        // Likewise for hashes computed by different fingerprint engines.
+        if src_frame_hashes.engine != dst_frame_hashes.engine {
+            tracing::warn!(
+                src_engine = %src_frame_hashes.engine,
+                dst_engine = %dst_frame_hashes.engine,
+                "skipping comparison of videos analyzed with different fingerprint engines"
+            );
+            return Ok(Default::default());
+        }
+
+        // Videos that were resolved without decoding any audio (e.g., using their chapters) have
+        // no hashes to compare.
+        if src_frame_hashes.data.is_empty() || dst_frame_hashes.data.is_empty() {
+            tracing::debug!("skipping comparison of videos without frame hash data");
+            return Ok(Default::default());
+        }
+
+        tracing::debug!(%engine, "starting search for opening and ending");
+        let info = self.find_opening_and_ending(
+            src_frame_hashes,
+            dst_frame_hashes,
+            &simhashes[src_idx],
+            &simhashes[dst_idx],
+            engine,
+        );
         tracing::debug!("finished search for opening and ending");
 
         Ok(info)
@@ -488,8 +992,10 @@ impl<P: AsRef<Path>> Comparator<P> {
 
         let mut distinct_matches: HashMap<usize, HashSet<usize>> = HashMap::new();
 
+        let mut comparisons = 0;
         for (i, (c, _)) in candidates.iter().enumerate() {
             for (j, (other, _)) in candidates.iter().enumerate() {
+                comparisons += 1;
                 let dist = u32::count_ones(c.2 ^ other.2);
 
                 // Add a small bias to the hash match threshold when comparing sequence hashes.
@@ -507,6 +1013,7 @@ impl<P: AsRef<Path>> Comparator<P> {
                     .insert(i);
             }
         }
+        counters::add(|c| c.clustering_comparisons += comparisons);
 
         let mut best: SearchResult = Default::default();
 
@@ -584,50 +1091,83 @@ impl<P: AsRef<Path> + Sync> Comparator<P> {
         write_skip_files: bool,
         threading: bool,
     ) -> Result<Vec<SearchResult>> {
-        // Build a list of video pairs for actual search. Pairs should only appear once.
-        // Given N videos, this will result in: (N * (N-1)) / 2 pairs
-        let mut pairs = Vec::new();
-        let mut processed_videos = vec![false; self.videos.len()];
-
-        for i in 0..self.videos.len() {
-            for j in 0..self.videos.len() {
-                if i == j || processed_videos[j] {
-                    continue;
+        // Duplicates share the result of the reference video of their group, so they are not
+        // searched at all.
+        let mut duplicates: Vec<Option<(usize, Duplicate)>> =
+            (0..frame_hashes.len()).map(|_| None).collect();
+        if self.duplicate_detection {
+            let detector =
+                DuplicateDetector::default().with_hash_match_threshold(self.hash_match_threshold);
+            for group in detector.run(&frame_hashes) {
+                for duplicate in group.duplicates {
+                    duplicates[duplicate.video] = Some((group.reference, duplicate));
                 }
-                pairs.push((i, j));
             }
-            processed_videos[i] = true;
+        }
+        // Likewise for videos whose result is known from their chapters or subtitles, unless they
+        // are needed as partners.
+        let known: Vec<Option<(SearchResult, &str)>> =
+            frame_hashes.iter().map(|f| self.known_result(f)).collect();
+        let mut searched: Vec<usize> = (0..frame_hashes.len())
+            .filter(|&i| duplicates[i].is_none() && known[i].is_none())
+            .collect();
+        if searched.len() == 1 {
+            searched = (0..frame_hashes.len())
+                .filter(|&i| duplicates[i].is_none())
+                .collect();
+        }
+
+        // Decide which pairs to search, how to search each one, and how many to search at once.
+        let plan = self.plan_videos(&frame_hashes, &searched, threading);
+        if self.explain_plan {
+            println!("{}", plan);
         }
 
+        // Simhash indexes of each track of each video. A video takes part in many pairs, so its
+        // indexes are built the first time they are needed and reused afterwards.
+        let simhashes: Vec<Vec<OnceLock<SimhashIndex>>> = frame_hashes
+            .iter()
+            .map(|f| f.all_tracks().map(|_| OnceLock::new()).collect())
+            .collect();
+
+        let search = |p: &super::planner::PlannedPair| {
+            let started = Instant::now();
+            let info = self
+                .search(p.src, p.dst, p.engine, &frame_hashes, &simhashes)
+                .unwrap();
+            self.record_time(Stage::PairSearch, started);
+            (p.src, p.dst, info)
+        };
+
         let mut data = Vec::new();
 
-        if cfg!(feature = "rayon") && threading {
+        if cfg!(feature = "rayon") && plan.threads > 1 {
             // Perform the search in parallel for all pairs.
             #[cfg(feature = "rayon")]
             {
-                data = pairs
-                    .par_iter()
-                    .map(|(src_idx, dst_idx)| {
-                        (
-                            *src_idx,
-                            *dst_idx,
-                            self.search(*src_idx, *dst_idx, &frame_hashes).unwrap(),
-                        )
-                    })
-                    .filter(|(_, _, info)| !info.is_empty())
-                    .collect::<Vec<_>>();
+                let run = || {
+                    plan.pairs
+                        .par_iter()
+                        .map(&search)
+                        .filter(|(_, _, info)| !info.is_empty())
+                        .collect::<Vec<_>>()
+                };
+
+                data = if plan.threads == rayon::current_num_threads() {
+                    run()
+                } else {
+                    rayon::ThreadPoolBuilder::new()
+                        .num_threads(plan.threads)
+                        .build()
+                        .expect("unable to build comparator thread pool")
+                        .install(run)
+                };
             }
         } else {
             data.extend(
-                pairs
+                plan.pairs
                     .iter()
-                    .map(|(src_idx, dst_idx)| {
-                        (
-                            *src_idx,
-                            *dst_idx,
-                            self.search(*src_idx, *dst_idx, &frame_hashes).unwrap(),
-                        )
-                    })
+                    .map(&search)
                     .filter(|(_, _, info)| !info.is_empty()),
             );
         }
@@ -645,21 +1185,49 @@ impl<P: AsRef<Path> + Sync> Comparator<P> {
         // For each path, find the best opening and ending candidate among the list
         // of other videos. If required, display the result and write a skip file to disk.
         let mut results = Vec::new();
-        for (idx, matches) in info_map.into_iter().enumerate() {
+        for (idx, matches) in info_map.iter().enumerate() {
             let path = self.videos[idx].as_ref().to_owned();
+            let md5 = &frame_hashes[idx].md5;
             if display {
                 println!("\n{}\n", path.display());
             }
 
             // Skip match selection for this video if it already has a skip file on disk.
-            if use_skip_files && Self::check_skip_file(&path)? {
+            if use_skip_files && Self::check_skip_file(&path, md5)? {
                 if display {
                     println!("Skipping due to existing skip file...");
                 }
                 continue;
             }
 
-            let result = self.find_best_match(&matches);
+            let started = Instant::now();
+            let result = match &duplicates[idx] {
+                Some((reference, duplicate)) => {
+                    if display {
+                        println!(
+                            "Duplicate of {} ({:.0}% coverage)",
+                            self.videos[*reference].as_ref().display(),
+                            duplicate.alignment.coverage * 100.0
+                        );
+                    }
+                    known[*reference]
+                        .map(|(result, _)| result)
+                        .or_else(|| self.find_best_match(&info_map[*reference]))
+                        .and_then(|result| result.transfer(&duplicate.alignment))
+                }
+                None => match known[idx] {
+                    Some((result, source)) => {
+                        if display {
+                            println!("Using {}", source);
+                        }
+                        Some(result)
+                    }
+                    None => self
+                        .find_best_match(matches)
+                        .map(|result| self.snap_to_chapters(result, &frame_hashes[idx].chapters)),
+                },
+            };
+            self.record_time(Stage::CandidateSelection, started);
             if result.is_none() {
                 if display {
                     if self.openings_only {
@@ -675,7 +1243,9 @@ impl<P: AsRef<Path> + Sync> Comparator<P> {
                 self.display_opening_ending_info(result);
             }
             if write_skip_files {
-                self.create_skip_file(&path, result)?;
+                let started = Instant::now();
+                self.create_skip_file(&path, md5, result)?;
+                self.record_time(Stage::SkipFileWrite, started);
             }
             results.push(result);
         }
@@ -704,7 +1274,11 @@ impl<P: AsRef<Path> + Sync> Comparator<P> {
 
         for video in &self.videos {
             let video = video.as_ref();
+            let started = Instant::now();
             let f = FrameHashes::from_video(video, analyze)?;
+            if !analyze {
+                self.record_time(Stage::HashLoad, started);
+            }
             frame_hashes.push(f);
         }
 
@@ -716,12 +1290,98 @@ impl<P: AsRef<Path> + Sync> Comparator<P> {
             threading,
         )
     }
+
+    /// Exactly the same as [Self::run_transfer], but uses the provided [FrameHashes] for the
+    /// videos of this comparator instead of reading them from disk.
+    pub fn run_transfer_with_frame_hashes(
+        &self,
+        reference: impl AsRef<Path>,
+        frame_hashes: Vec<FrameHashes>,
+        display: bool,
+        write_skip_files: bool,
+    ) -> Result<Vec<Option<SearchResult>>> {
+        let reference = reference.as_ref();
+        let reference_hashes = FrameHashes::from_video(reference, false)?;
+        let reference_result = load_skip_file(reference, &reference_hashes.md5)?
+            .ok_or_else(|| crate::Error::TransferSourceUnavailable(reference.to_owned()))?;
+
+        let detector =
+            DuplicateDetector::default().with_hash_match_threshold(self.hash_match_threshold);
+        let mut results = Vec::with_capacity(frame_hashes.len());
+        for (video, hashes) in self.videos.iter().zip(&frame_hashes) {
+            let path = video.as_ref();
+            if display {
+                println!("\n{}\n", path.display());
+            }
+
+            let started = Instant::now();
+            let alignment = detector.align(&reference_hashes, hashes);
+            let result = alignment
+                .as_ref()
+                .and_then(|alignment| reference_result.transfer(alignment));
+            self.record_time(Stage::CandidateSelection, started);
+            if display {
+                match &alignment {
+                    Some(alignment) => println!(
+                        "Aligned at {:.4}x speed ({:.0}% coverage)",
+                        alignment.speed,
+                        alignment.coverage * 100.0
+                    ),
+                    None => println!("Could not align with {}", reference.display()),
+                }
+            }
+
+            if let Some(result) = result {
+                if display {
+                    self.display_opening_ending_info(result);
+                }
+                if write_skip_files {
+                    let started = Instant::now();
+                    self.create_skip_file(path, &hashes.md5, result)?;
+                    self.record_time(Stage::SkipFileWrite, started);
+                }
+            } else if display && alignment.is_some() {
+                println!("Opening and ending do not occur in this release.");
+            }
+            results.push(result);
+        }
+
+        Ok(results)
+    }
+
+    /// Transfers the search result of `reference` to the videos of this comparator instead of
+    /// searching them.
+    ///
+    /// Each video must be another release of `reference` (e.g., an extended cut, or a PAL release),
+    /// and `reference` must have a skip file. The audio of each video is aligned with the
+    /// reference, allowing for cuts and a constant difference in speed, and the opening and ending
+    /// of the reference are mapped through that alignment. Videos that cannot be aligned get no
+    /// result.
+    ///
+    /// Frame hash data is read from disk for all videos, including `reference`.
+    pub fn run_transfer(
+        &self,
+        reference: impl AsRef<Path>,
+        display: bool,
+        write_skip_files: bool,
+    ) -> Result<Vec<Option<SearchResult>>> {
+        let mut frame_hashes = Vec::with_capacity(self.videos.len());
+        for video in &self.videos {
+            let started = Instant::now();
+            frame_hashes.push(FrameHashes::from_video(video, false)?);
+            self.record_time(Stage::HashLoad, started);
+        }
+
+        self.run_transfer_with_frame_hashes(reference, frame_hashes, display, write_skip_files)
+    }
 }
 
 #[cfg(test)]
 mod test {
     use super::*;
 
+    use crate::audio::AudioTrackHashes;
+
     use std::path::PathBuf;
 
     fn get_sample_paths() -> Vec<PathBuf> {
@@ -743,4 +1403,204 @@ mod test {
         let data = comparator.run(true, true, false, false, false).unwrap();
         assert_eq!(data.len(), 2);
     }
+
+    #[test]
+    fn test_select_tracks() {
+        let hashes = |language: Option<&str>, tracks: Vec<(&str, u32)>| FrameHashes {
+            hash_period: 0.3,
+            hash_duration: 3.0,
+            data: vec![(0, Duration::ZERO)],
+            md5: String::new(),
+            content_md5: String::new(),
+            truncated: None,
+            language: language.map(|l| l.to_owned()),
+            tracks: tracks
+                .into_iter()
+                .enumerate()
+                .map(|(i, (language, hash))| AudioTrackHashes {
+                    stream_index: i + 2,
+                    language: Some(language.to_owned()),
+                    data: vec![(hash, Duration::ZERO)],
+                })
+                .collect(),
+            identity: Default::default(),
+            coverage: None,
+            music_regions: None,
+            engine: Default::default(),
+            subtitle_hints: None,
+            chapters: Vec::new(),
+        };
+        let select = |src: &FrameHashes, dst: &FrameHashes| {
+            let (s, d) = Comparator::<PathBuf>::select_tracks(src, dst);
+            let first_hash =
+                |f: &FrameHashes, track: usize| f.all_tracks().nth(track).unwrap().1[0].0;
+            (first_hash(src, s), first_hash(dst, d))
+        };
+
+        // Dual audio (JP primary + EN) vs. a single EN track.
+        let dual = hashes(Some("jpn"), vec![("eng", 1)]);
+        let dub = hashes(Some("eng"), vec![]);
+        assert_eq!(select(&dual, &dub), (1, 0));
+        assert_eq!(select(&dub, &dual), (0, 1));
+
+        // Matching primary tracks take precedence.
+        let dual2 = hashes(Some("jpn"), vec![("eng", 2)]);
+        assert_eq!(select(&dual, &dual2), (0, 0));
+
+        // No common language: fall back to the primary tracks.
+        let unknown = hashes(None, vec![]);
+        assert_eq!(select(&dual, &unknown), (0, 0));
+    }
+
+    // Two "videos" that share a run of 40 hashes, plus a few shorter runs.
+    fn synthetic_hashes() -> (Vec<(u32, Duration)>, Vec<(u32, Duration)>) {
+        let hash = |i: u32| i.wrapping_mul(2654435761);
+        let src = (0..100)
+            .map(|i| (hash(i), Duration::from_secs(i as u64)))
+            .collect();
+        let dst = (0..120)
+            .map(|i| {
+                let h = match i {
+                    10..=49 => hash(i - 5),
+                    80..=84 => hash(i + 10),
+                    _ => hash(i + 1000),
+                };
+                (h, Duration::from_secs(i as u64))
+            })
+            .collect();
+        (src, dst)
+    }
+
+    fn synthetic_comparator() -> (Comparator<PathBuf>, MatchBounds) {
+        let comparator = Comparator::<PathBuf>::default()
+            .with_min_opening_duration(Duration::from_secs(3))
+            .with_min_ending_duration(Duration::from_secs(3));
+        let bounds = MatchBounds {
+            src_max_opening_time: Duration::from_secs(60),
+            src_min_ending_time: Duration::from_secs(70),
+            dst_max_opening_time: Duration::from_secs(60),
+            dst_min_ending_time: Duration::from_secs(70),
+            src_hash_duration: Duration::from_secs(3),
+            dst_hash_duration: Duration::from_secs(3),
+            max_gap: Duration::from_secs(3),
+        };
+        (comparator, bounds)
+    }
+
+    fn track<'a>(data: &'a [(u32, Duration)], simhash: &'a SimhashIndex) -> HashTrack<'a> {
+        HashTrack { data, simhash }
+    }
+
+    #[test]
+    fn test_streaming_engine() {
+        let (src, dst) = synthetic_hashes();
+        let (comparator, bounds) = synthetic_comparator();
+        let (src_simhash, dst_simhash) = (SimhashIndex::new(&src), SimhashIndex::new(&dst));
+        let dst_track = track(&dst, &dst_simhash);
+
+        let exact = comparator.longest_common_hash_match(
+            &track(&src, &src_simhash),
+            &dst_track,
+            &bounds,
+            ComparatorEngine::Exact,
+        );
+        let streaming = comparator.longest_common_hash_match(
+            &track(&src, &src_simhash),
+            &dst_track,
+            &bounds,
+            ComparatorEngine::Streaming,
+        );
+        assert!(!exact.is_empty());
+        assert_eq!(exact, streaming);
+
+        // A gap in the source (e.g., dialogue skipped by the music pre-screen) splits the run.
+        let src: Vec<(u32, Duration)> = src
+            .into_iter()
+            .map(|(h, ts)| match ts.as_secs() {
+                0..=29 => (h, ts),
+                _ => (h, ts + Duration::from_secs(60)),
+            })
+            .collect();
+        let exact = comparator.longest_common_hash_match(
+            &track(&src, &src_simhash),
+            &dst_track,
+            &bounds,
+            ComparatorEngine::Exact,
+        );
+        let streaming = comparator.longest_common_hash_match(
+            &track(&src, &src_simhash),
+            &dst_track,
+            &bounds,
+            ComparatorEngine::Streaming,
+        );
+        assert_eq!(exact.iter().map(|e| e.score).max(), Some(25));
+        assert_eq!(exact, streaming);
+    }
+
+    #[test]
+    fn test_op_counts() {
+        let (src, dst) = synthetic_hashes();
+        let (comparator, bounds) = synthetic_comparator();
+        let (src_simhash, dst_simhash) = (SimhashIndex::new(&src), SimhashIndex::new(&dst));
+        let (src_track, dst_track) = (track(&src, &src_simhash), track(&dst, &dst_simhash));
+
+        let mut counts = Vec::new();
+        let mut results = Vec::new();
+        for engine in [ComparatorEngine::Exact, ComparatorEngine::Streaming] {
+            let ((entries, allocations), ops) = counters::measure(|| {
+                counters::alloc::measure(|| {
+                    comparator.longest_common_hash_match(&src_track, &dst_track, &bounds, engine)
+                })
+            });
+            counts.push(ops);
+            results.push((engine, entries, allocations));
+        }
+
+        // The exact engine allocates a row per source hash, while the streaming engine only keeps
+        // two rows around.
+        let (_, entries, exact_allocations) = &results[0];
+        let (_, _, streaming_allocations) = &results[1];
+        assert!(*exact_allocations > src.len() as u64);
+        assert!(*streaming_allocations < 64);
+
+        let info = OpeningAndEndingInfo {
+            src_openings: entries.clone(),
+            ..Default::default()
+        };
+        let (_, ops) = counters::measure(|| comparator.find_best_match(&[(&info, true)]));
+        counts.push(ops);
+
+        insta::assert_debug_snapshot!(counts);
+    }
+
+    #[test]
+    fn test_frame_hashes_bytes_read() {
+        let path =
+            crate::util::test_temp_path("frame-hashes-bytes-read").with_extension("needle.bin");
+        let (src, _) = synthetic_hashes();
+        let frame_hashes = FrameHashes {
+            hash_period: 1.0,
+            hash_duration: 3.0,
+            data: src,
+            md5: String::new(),
+            content_md5: String::new(),
+            truncated: None,
+            language: None,
+            tracks: Vec::new(),
+            identity: Default::default(),
+            coverage: None,
+            music_regions: None,
+            engine: Default::default(),
+            subtitle_hints: None,
+            chapters: Vec::new(),
+        };
+        frame_hashes.to_path(&path).unwrap();
+
+        // Frame hash data is read exactly once.
+        let (data, ops) = counters::measure(|| FrameHashes::from_path(&path).unwrap());
+        assert_eq!(data.data.len(), frame_hashes.data.len());
+        assert_eq!(ops.bytes_read, std::fs::metadata(&path).unwrap().len());
+
+        std::fs::remove_file(&path).unwrap();
+    }
 }
@@ -0,0 +1,115 @@
+use std::cell::Cell;
+use std::io::Read;
+
+/// Counts of the operations done by the comparator and frame hash loading.
+///
+/// Wall-clock benchmarks are too noisy to catch algorithmic regressions on shared machines, so hot
+/// paths count the work they do instead. Counts are kept per thread and are updated at most once
+/// per row or call, so keeping them enabled costs next to nothing.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub(crate) struct OpCounts {
+    /// LCS table cells evaluated.
+    pub(crate) cells: u64,
+    /// Entries pushed onto a comparator heap.
+    pub(crate) heap_pushes: u64,
+    /// Candidate pairs compared while clustering matches.
+    pub(crate) clustering_comparisons: u64,
+    /// Bytes read from frame hash data files.
+    pub(crate) bytes_read: u64,
+}
+
+impl OpCounts {
+    #[cfg(test)]
+    fn since(self, start: OpCounts) -> OpCounts {
+        OpCounts {
+            cells: self.cells - start.cells,
+            heap_pushes: self.heap_pushes - start.heap_pushes,
+            clustering_comparisons: self.clustering_comparisons - start.clustering_comparisons,
+            bytes_read: self.bytes_read - start.bytes_read,
+        }
+    }
+}
+
+thread_local! {
+    static COUNTS: Cell<OpCounts> = Cell::new(OpCounts::default());
+}
+
+/// Updates the counts of the current thread.
+pub(crate) fn add(f: impl FnOnce(&mut OpCounts)) {
+    COUNTS.with(|counts| {
+        let mut c = counts.get();
+        f(&mut c);
+        counts.set(c);
+    });
+}
+
+/// Runs `f` and returns the operations it did on the current thread.
+#[cfg(test)]
+pub(crate) fn measure<T>(f: impl FnOnce() -> T) -> (T, OpCounts) {
+    let start = COUNTS.with(|counts| counts.get());
+    let result = f();
+    let end = COUNTS.with(|counts| counts.get());
+    (result, end.since(start))
+}
+
+/// Wraps a reader and counts the bytes read through it (see [OpCounts::bytes_read]).
+pub(crate) struct CountingReader<R> {
+    inner: R,
+}
+
+impl<R> CountingReader<R> {
+    pub(crate) fn new(inner: R) -> Self {
+        Self { inner }
+    }
+}
+
+impl<R: Read> Read for CountingReader<R> {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        let n = self.inner.read(buf)?;
+        add(|c| c.bytes_read += n as u64);
+        Ok(n)
+    }
+}
+
+/// Counts heap allocations per thread in test builds.
+#[cfg(test)]
+pub(crate) mod alloc {
+    use std::alloc::{GlobalAlloc, Layout, System};
+    use std::cell::Cell;
+
+    struct CountingAllocator;
+
+    thread_local! {
+        static ALLOCATIONS: Cell<u64> = const { Cell::new(0) };
+    }
+
+    // SAFETY: All allocations are forwarded to the system allocator.
+    unsafe impl GlobalAlloc for CountingAllocator {
+        unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+            // The counter may already be gone while a thread shuts down.
+            let _ = ALLOCATIONS.try_with(|n| n.set(n.get() + 1));
+            System.alloc(layout)
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+            System.dealloc(ptr, layout)
+        }
+
+        unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+            let _ = ALLOCATIONS.try_with(|n| n.set(n.get() + 1));
+            System.realloc(ptr, layout, new_size)
+        }
+    }
+
+    #[global_allocator]
+    static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+    /// Runs `f` and returns the number of allocations (including reallocations) it did on the
+    /// current thread.
+    pub(crate) fn measure<T>(f: impl FnOnce() -> T) -> (T, u64) {
+        let start = ALLOCATIONS.with(|n| n.get());
+        let result = f();
+        let end = ALLOCATIONS.with(|n| n.get());
+        (result, end - start)
+    }
+}
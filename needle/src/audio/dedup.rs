@@ -0,0 +1,526 @@
+use std::borrow::Cow;
+use std::collections::HashMap;
+use std::time::Duration;
+
+use super::analyzer::FrameHashes;
+use super::library::{band_keys, windows};
+use super::rehash::{abs_diff, same_period};
+
+/// Number of MinHash values in the sketch of a video.
+const SKETCH_LEN: usize = 64;
+
+/// Pairs of videos whose sketches agree on fewer than this fraction of values are not verified.
+/// Episodes of the same show only share their opening and ending, which is well below this.
+const MIN_SKETCH_SIMILARITY: f32 = 0.2;
+
+/// Windows of a video that occur more often than this are silence or other featureless audio, and
+/// do not help to align two videos.
+const MAX_BUCKET_LEN: usize = 64;
+
+/// Minimum number of window hits for an alignment to be verified.
+const MIN_VOTES: u32 = 4;
+
+/// Maximum number of alignments verified per pair of videos. Cuts (e.g., removed commercials) split
+/// duplicates into a few segments, each with its own alignment.
+const MAX_ALIGNMENTS: usize = 16;
+
+/// Runs of matching hashes shorter than this are ignored.
+const MIN_RUN_LEN: usize = 10;
+
+/// Up to this many hashes in a row may fail to match within a run.
+const MAX_RUN_GAP: usize = 3;
+
+/// Times that are at most this far outside of an [AlignedSegment] are mapped using that segment.
+const MAP_TOLERANCE: Duration = Duration::from_secs(2);
+
+/// Speeds tried when aligning two releases of a video: the same speed, PAL speedup of 23.976 fps
+/// film to 25 fps (and back), and 24 fps to 25 fps (and back).
+const SPEEDS: [f64; 5] = [1.0, 25.0 / 23.976, 23.976 / 25.0, 25.0 / 24.0, 24.0 / 25.0];
+
+/// A stretch of audio that two aligned videos have in common (see [Alignment]).
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct AlignedSegment {
+    /// Start of the segment in the reference video.
+    pub reference_start: Duration,
+    /// Start of the segment in the other video.
+    pub other_start: Duration,
+    /// Length of the segment in the reference video.
+    pub duration: Duration,
+}
+
+/// Maps times in a reference video to times in another release of the same video.
+#[derive(Clone, Debug)]
+pub struct Alignment {
+    /// Speed of the other video relative to the reference video. For example, a PAL release of a
+    /// film plays at 25 / 23.976 times the speed of the original.
+    pub speed: f64,
+    /// Fraction of both videos covered by the aligned segments, from 0 to 1. This is the lower of
+    /// the two.
+    pub coverage: f32,
+    /// Segments the two videos have in common, in order. Each segment has its own offset, so cuts
+    /// (e.g., removed commercials or extended scenes) are handled.
+    pub segments: Vec<AlignedSegment>,
+}
+
+impl Alignment {
+    /// Maps a time in the reference video to the same point in the other video. Returns `None` if
+    /// that part of the reference video does not occur in the other video.
+    pub fn map_time(&self, t: Duration) -> Option<Duration> {
+        let distance = |s: &AlignedSegment| {
+            if t < s.reference_start {
+                s.reference_start - t
+            } else {
+                t.saturating_sub(s.reference_start + s.duration)
+            }
+        };
+        let segment = self
+            .segments
+            .iter()
+            .min_by_key(|s| distance(s))
+            .filter(|s| distance(s) <= MAP_TOLERANCE)?;
+        if t >= segment.reference_start {
+            Some(segment.other_start + unscale(t - segment.reference_start, self.speed))
+        } else {
+            segment
+                .other_start
+                .checked_sub(unscale(segment.reference_start - t, self.speed))
+        }
+    }
+}
+
+/// A video that is a near-duplicate of the reference video of a [DuplicateGroup].
+#[derive(Clone, Debug)]
+pub struct Duplicate {
+    /// Index of the video.
+    pub video: usize,
+    /// Alignment of the reference video with this video.
+    pub alignment: Alignment,
+}
+
+/// A group of videos with the same content, such as two releases of the same episode.
+#[derive(Clone, Debug)]
+pub struct DuplicateGroup {
+    /// Index of the reference video of the group.
+    pub reference: usize,
+    /// Other videos in the group, each aligned with the reference video.
+    pub duplicates: Vec<Duplicate>,
+}
+
+/// A whole-video summary of the audio windows in a video, used to find likely duplicates without
+/// aligning videos. The fraction of values two sketches share estimates the fraction of windows
+/// the two videos share (MinHash).
+#[derive(Clone, Debug)]
+struct Sketch([u32; SKETCH_LEN]);
+
+impl Sketch {
+    fn new(data: &[(u32, Duration)], hash_period: Duration) -> Option<Self> {
+        let windows = windows(data, hash_period, 1);
+        if windows.is_empty() {
+            return None;
+        }
+        let mut mins = [u32::MAX; SKETCH_LEN];
+        for (_, simhash) in windows {
+            for key in band_keys(simhash) {
+                for (seed, min) in mins.iter_mut().enumerate() {
+                    *min = u32::min(*min, mix(key, seed as u32));
+                }
+            }
+        }
+        Some(Self(mins))
+    }
+
+    fn similarity(&self, other: &Sketch) -> f32 {
+        let same = self.0.iter().zip(&other.0).filter(|(a, b)| a == b).count();
+        same as f32 / SKETCH_LEN as f32
+    }
+}
+
+// Murmur3 finalizer of `key`, salted with `seed`.
+fn mix(key: u32, seed: u32) -> u32 {
+    let mut h = key ^ seed.wrapping_mul(0x9E3779B9);
+    h ^= h >> 16;
+    h = h.wrapping_mul(0x85EBCA6B);
+    h ^= h >> 13;
+    h = h.wrapping_mul(0xC2B2AE35);
+    h ^ (h >> 16)
+}
+
+/// Finds videos with the same content, such as a TV rip and a Blu-ray release of an episode.
+///
+/// Near-duplicates would otherwise be compared with each other like any other pair of videos,
+/// where the whole video looks like an opening. Instead, duplicates can share the result of their
+/// reference video (see [Comparator::with_duplicate_detection](super::Comparator::with_duplicate_detection)).
+///
+/// Candidates are found by comparing a small sketch of each video. Each candidate pair is then
+/// verified by aligning the two videos and measuring how much of each is covered by matching
+/// hashes. Only videos analyzed with the same settings are compared.
+#[derive(Clone, Debug)]
+pub struct DuplicateDetector {
+    hash_match_threshold: u32,
+    min_coverage: f32,
+}
+
+impl Default for DuplicateDetector {
+    fn default() -> Self {
+        Self {
+            hash_match_threshold: super::DEFAULT_HASH_MATCH_THRESHOLD as u32,
+            min_coverage: super::DEFAULT_DUPLICATE_COVERAGE,
+        }
+    }
+}
+
+impl DuplicateDetector {
+    /// Returns a new [DuplicateDetector] with the provided `hash_match_threshold`.
+    pub fn with_hash_match_threshold(mut self, hash_match_threshold: u32) -> Self {
+        self.hash_match_threshold = hash_match_threshold;
+        self
+    }
+
+    /// Returns a new [DuplicateDetector] with the provided `min_coverage`. Two videos are
+    /// duplicates if at least this fraction of each is covered by aligned segments.
+    pub fn with_min_coverage(mut self, min_coverage: f32) -> Self {
+        self.min_coverage = min_coverage;
+        self
+    }
+
+    /// Finds groups of duplicates among the given videos. Videos are referred to by their index
+    /// in `frame_hashes`, and the reference of each group is its first video.
+    ///
+    /// Videos that have no duplicates are not part of any group.
+    pub fn run(&self, frame_hashes: &[FrameHashes]) -> Vec<DuplicateGroup> {
+        let sketches: Vec<Option<Sketch>> = frame_hashes
+            .iter()
+            .map(|f| Sketch::new(&f.data, Duration::from_secs_f32(f.hash_period)))
+            .collect();
+
+        let mut grouped = vec![false; frame_hashes.len()];
+        let mut groups = Vec::new();
+        for (reference, sketch) in sketches.iter().enumerate() {
+            let sketch = match sketch {
+                Some(sketch) if !grouped[reference] => sketch,
+                _ => continue,
+            };
+            let mut duplicates = Vec::new();
+            for video in reference + 1..frame_hashes.len() {
+                let (src, dst) = (&frame_hashes[reference], &frame_hashes[video]);
+                let is_candidate = !grouped[video]
+                    && src.engine == dst.engine
+                    && same_period(src.hash_duration, dst.hash_duration)
+                    && same_period(src.hash_period, dst.hash_period)
+                    && sketches[video].as_ref().map_or(false, |other| {
+                        sketch.similarity(other) >= MIN_SKETCH_SIMILARITY
+                    });
+                if !is_candidate {
+                    continue;
+                }
+                let hash_period = Duration::from_secs_f32(src.hash_period);
+                let alignment = self.align_tracks(&src.data, &dst.data, hash_period, 1.0);
+                if alignment.coverage >= self.min_coverage {
+                    grouped[video] = true;
+                    duplicates.push(Duplicate { video, alignment });
+                }
+            }
+            if !duplicates.is_empty() {
+                grouped[reference] = true;
+                groups.push(DuplicateGroup {
+                    reference,
+                    duplicates,
+                });
+            }
+        }
+
+        groups
+    }
+
+    /// Aligns `other` with `reference`, where `other` is another release of the same video (e.g., a
+    /// director's cut, or a PAL release). Besides cuts, the two may differ in speed: a few common
+    /// speed factors are tried, and the one that aligns best is kept.
+    ///
+    /// Returns `None` if the alignment does not cover enough of both videos (see
+    /// [Self::with_min_coverage]).
+    pub fn align(&self, reference: &FrameHashes, other: &FrameHashes) -> Option<Alignment> {
+        if reference.engine != other.engine
+            || !same_period(reference.hash_duration, other.hash_duration)
+        {
+            return None;
+        }
+
+        let hash_period = Duration::from_secs_f32(reference.hash_period);
+        SPEEDS
+            .iter()
+            .map(|&speed| {
+                let data = if speed == 1.0 && same_period(reference.hash_period, other.hash_period)
+                {
+                    Cow::Borrowed(&other.data[..])
+                } else {
+                    Cow::Owned(rescale(&other.data, speed, hash_period))
+                };
+                self.align_tracks(&reference.data, &data, hash_period, speed)
+            })
+            // Keeps the first of equally good alignments, which prefers the original speed.
+            .min_by(|x, y| y.coverage.total_cmp(&x.coverage))
+            .filter(|alignment| alignment.coverage >= self.min_coverage)
+    }
+
+    // Aligns `b` with `a`. `b` is on the timeline of `a`, i.e., it was rescaled by `speed` if
+    // needed.
+    fn align_tracks(
+        &self,
+        a: &[(u32, Duration)],
+        b: &[(u32, Duration)],
+        hash_period: Duration,
+        speed: f64,
+    ) -> Alignment {
+        if a.is_empty() || b.is_empty() {
+            return Alignment {
+                speed,
+                coverage: 0.0,
+                segments: Vec::new(),
+            };
+        }
+
+        // Vote for alignments (position in `b` minus position in `a`) using the windows the two
+        // videos have in common.
+        let mut table: HashMap<u32, Vec<usize>> = HashMap::new();
+        for (j, simhash) in windows(b, hash_period, 1) {
+            for key in band_keys(simhash) {
+                table.entry(key).or_default().push(j);
+            }
+        }
+        let mut votes: HashMap<i64, u32> = HashMap::new();
+        for (i, simhash) in windows(a, hash_period, 1) {
+            for key in band_keys(simhash) {
+                match table.get(&key) {
+                    Some(positions) if positions.len() <= MAX_BUCKET_LEN => {
+                        for &j in positions {
+                            *votes.entry(j as i64 - i as i64).or_default() += 1;
+                        }
+                    }
+                    _ => (),
+                }
+            }
+        }
+        let mut alignments: Vec<(i64, u32)> = votes
+            .into_iter()
+            .filter(|(_, votes)| *votes >= MIN_VOTES)
+            .collect();
+        alignments.sort_by(|x, y| y.1.cmp(&x.1).then(x.0.cmp(&y.0)));
+        alignments.truncate(MAX_ALIGNMENTS);
+
+        // Find runs of matching hashes along each alignment, as (first, last, offset) where
+        // `first` and `last` are positions in `a`.
+        let mut runs = Vec::new();
+        for (offset, _) in alignments {
+            let mut run: Option<(usize, usize)> = None;
+            for i in 0..a.len() {
+                let j = i as i64 + offset;
+                if j < 0 || j >= b.len() as i64 {
+                    continue;
+                }
+                if u32::count_ones(a[i].0 ^ b[j as usize].0) > self.hash_match_threshold {
+                    continue;
+                }
+                run = match run {
+                    Some((first, last)) if i - last <= MAX_RUN_GAP + 1 => Some((first, i)),
+                    Some((first, last)) => {
+                        runs.push((first, last, offset));
+                        Some((i, i))
+                    }
+                    None => Some((i, i)),
+                };
+            }
+            if let Some((first, last)) = run {
+                runs.push((first, last, offset));
+            }
+        }
+
+        // Keep the longest runs that do not overlap in either video.
+        runs.retain(|(first, last, _)| last - first + 1 >= MIN_RUN_LEN);
+        runs.sort_by(|x, y| (y.1 - y.0).cmp(&(x.1 - x.0)).then(x.cmp(y)));
+        let mut kept: Vec<(usize, usize, i64)> = Vec::new();
+        for (first, last, offset) in runs {
+            let overlaps = kept.iter().any(|&(other_first, other_last, other_offset)| {
+                let in_a = first <= other_last && last >= other_first;
+                let in_b = first as i64 + offset <= other_last as i64 + other_offset
+                    && last as i64 + offset >= other_first as i64 + other_offset;
+                in_a || in_b
+            });
+            if !overlaps {
+                kept.push((first, last, offset));
+            }
+        }
+
+        let covered: usize = kept.iter().map(|(first, last, _)| last - first + 1).sum();
+        let coverage = f32::min(
+            covered as f32 / a.len() as f32,
+            covered as f32 / b.len() as f32,
+        );
+
+        kept.sort();
+        let segments = kept
+            .into_iter()
+            .map(|(first, last, offset)| AlignedSegment {
+                reference_start: a[first].1,
+                other_start: unscale(b[(first as i64 + offset) as usize].1, speed),
+                duration: a[last].1 - a[first].1,
+            })
+            .collect();
+        Alignment {
+            speed,
+            coverage,
+            segments,
+        }
+    }
+}
+
+// Samples `data` at every `hash_period` on the timeline of a video that plays `speed` times slower,
+// picking the closest hash for each point. The timestamps of the result are on that timeline.
+fn rescale(data: &[(u32, Duration)], speed: f64, hash_period: Duration) -> Vec<(u32, Duration)> {
+    let mut rescaled = Vec::new();
+    let (first, last) = match (data.first(), data.last()) {
+        (Some(first), Some(last)) => (first.1.mul_f64(speed), last.1.mul_f64(speed)),
+        _ => return rescaled,
+    };
+
+    let mut i = 0;
+    let mut target = first;
+    while target <= last {
+        while i + 1 < data.len()
+            && abs_diff(data[i + 1].1.mul_f64(speed), target)
+                <= abs_diff(data[i].1.mul_f64(speed), target)
+        {
+            i += 1;
+        }
+        rescaled.push((data[i].0, target));
+        target += hash_period;
+    }
+
+    rescaled
+}
+
+// Converts a duration on the timeline of the reference video to the timeline of a video that
+// plays `speed` times faster.
+fn unscale(t: Duration, speed: f64) -> Duration {
+    if speed == 1.0 {
+        t
+    } else {
+        t.div_f64(speed)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn frame_hashes(hashes: Vec<u32>) -> FrameHashes {
+        FrameHashes {
+            hash_period: 0.3,
+            hash_duration: 3.0,
+            data: hashes
+                .into_iter()
+                .enumerate()
+                .map(|(i, hash)| (hash, Duration::from_millis(300 * i as u64)))
+                .collect(),
+            md5: String::new(),
+            content_md5: String::new(),
+            truncated: None,
+            language: None,
+            tracks: Vec::new(),
+            identity: Default::default(),
+            coverage: None,
+            music_regions: None,
+            engine: Default::default(),
+            subtitle_hints: None,
+            chapters: Vec::new(),
+        }
+    }
+
+    fn unique_hashes(seed: u32, n: u32) -> Vec<u32> {
+        (0..n)
+            .map(|i| (i ^ (seed << 20)).wrapping_mul(0x9E3779B9) ^ 0xA5A5A5A5)
+            .collect()
+    }
+
+    #[test]
+    fn test_duplicate_detector() {
+        let episode = unique_hashes(1, 1000);
+
+        // Another release of the same episode: 20 extra hashes at the start, 50 hashes cut from
+        // the middle, and a bit flipped in every 4th hash.
+        let mut release = unique_hashes(2, 20);
+        release.extend(&episode[..500]);
+        release.extend(&episode[550..]);
+        let release = release
+            .into_iter()
+            .enumerate()
+            .map(|(i, hash)| {
+                if i % 4 == 0 {
+                    hash ^ (1 << (i % 32))
+                } else {
+                    hash
+                }
+            })
+            .collect();
+
+        // Another episode of the same show that shares its first 60 hashes.
+        let mut other = episode[..60].to_vec();
+        other.extend(unique_hashes(3, 940));
+
+        let videos = vec![
+            frame_hashes(episode),
+            frame_hashes(other),
+            frame_hashes(release),
+        ];
+        let groups = DuplicateDetector::default()
+            .with_hash_match_threshold(4)
+            .run(&videos);
+        assert_eq!(groups.len(), 1);
+        assert_eq!(groups[0].reference, 0);
+        assert_eq!(groups[0].duplicates.len(), 1);
+
+        let duplicate = &groups[0].duplicates[0];
+        assert_eq!(duplicate.video, 2);
+        let duplicate = &duplicate.alignment;
+        assert!(duplicate.coverage > 0.9);
+        assert_eq!(duplicate.segments.len(), 2);
+        // 10s into the episode is 6s (20 hashes) later in the release.
+        assert_eq!(
+            duplicate.map_time(Duration::from_secs(10)),
+            Some(Duration::from_secs(16))
+        );
+        // After the cut, the release is 9s (30 hashes) behind.
+        assert_eq!(
+            duplicate.map_time(Duration::from_secs(240)),
+            Some(Duration::from_secs(231))
+        );
+        // The part that was cut is not in the release at all.
+        assert_eq!(duplicate.map_time(Duration::from_secs(157)), None);
+    }
+
+    #[test]
+    fn test_align_speedup() {
+        // Consecutive hashes overlap in real audio, so they change gradually; here, every hash is
+        // repeated a few times.
+        let reference: Vec<u32> = unique_hashes(1, 250)
+            .into_iter()
+            .flat_map(|hash| [hash; 4])
+            .collect();
+
+        // A PAL release of the same video: the same audio, played 25 / 23.976 times faster.
+        let speed = 25.0 / 23.976;
+        let release = (0..)
+            .map(|k| (k as f64 * speed).round() as usize)
+            .take_while(|&i| i < reference.len())
+            .map(|i| reference[i])
+            .collect();
+
+        let alignment = DuplicateDetector::default()
+            .with_hash_match_threshold(4)
+            .align(&frame_hashes(reference), &frame_hashes(release))
+            .unwrap();
+        assert_eq!(alignment.speed, speed);
+        assert!(alignment.coverage > 0.9);
+        let t = alignment.map_time(Duration::from_secs(150)).unwrap();
+        assert!(abs_diff(t, Duration::from_secs(150).div_f64(speed)) < Duration::from_secs(1));
+    }
+}
@@ -0,0 +1,349 @@
+extern crate chromaprint_rust;
+
+use std::collections::VecDeque;
+use std::fmt::Display;
+use std::time::Duration;
+
+use chromaprint_rust as chromaprint;
+use serde::{Deserialize, Serialize};
+
+/// Sample rate used by the band energy engine. Only frequencies up to 2 kHz are used, so there is
+/// no need for more.
+const BAND_ENERGY_SAMPLE_RATE: u32 = 5512;
+
+/// FFT size used by the band energy engine (~186 ms at 5512 Hz).
+const BAND_ENERGY_FRAME_LEN: usize = 1024;
+
+/// Number of samples between successive FFT frames (~46 ms at 5512 Hz).
+const BAND_ENERGY_HOP_LEN: usize = 256;
+
+/// Range of frequencies covered by the energy bands, in Hz.
+const BAND_ENERGY_MIN_FREQ: f32 = 300.0;
+const BAND_ENERGY_MAX_FREQ: f32 = 2000.0;
+
+/// Algorithm used to turn decoded audio into frame hashes.
+///
+/// Hashes produced by different engines cannot be compared with each other, so the engine is
+/// recorded in [FrameHashes](super::FrameHashes).
+///
+/// All engines work on audio that was fully decoded and resampled by FFmpeg, which is where most of
+/// the time goes when analyzing compressed audio (e.g., AAC). The engine only replaces the
+/// fingerprinting step, so switching engines does not speed up analysis by much. An engine that
+/// works in the compressed domain (e.g., on AAC spectral coefficients) without decoding is not
+/// implemented.
+#[derive(Clone, Copy, Debug, Deserialize, Serialize, PartialEq, Eq)]
+pub enum FingerprintEngine {
+    /// Chromaprint fingerprints, reduced to a single hash per period. This is the most accurate
+    /// engine.
+    Chromaprint,
+    /// **Experimental.** Hashes built from the signs of energy differences between neighbouring
+    /// frequency bands, as in the Philips (Haitsma-Kalker) audio fingerprint, computed from a single
+    /// small FFT per frame on audio resampled to 5.5 kHz. This is an alternative to Chromaprint
+    /// that does less work per second of audio in the fingerprinting step, but is less accurate.
+    /// It has not been benchmarked against Chromaprint end to end.
+    BandEnergy,
+}
+
+impl Default for FingerprintEngine {
+    fn default() -> Self {
+        Self::Chromaprint
+    }
+}
+
+impl Display for FingerprintEngine {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            Self::Chromaprint => write!(f, "chromaprint"),
+            Self::BandEnergy => write!(f, "band energy"),
+        }
+    }
+}
+
+/// Computes hashes for a single track of interleaved stereo S16 audio using one of the
+/// [FingerprintEngine]s.
+pub(crate) enum Fingerprinter {
+    Chromaprint(chromaprint::DelayedFingerprinter),
+    BandEnergy(BandEnergyFingerprinter),
+}
+
+impl Fingerprinter {
+    pub(crate) fn new(
+        engine: FingerprintEngine,
+        hash_duration: Duration,
+        hash_period: Duration,
+    ) -> Self {
+        match engine {
+            FingerprintEngine::Chromaprint => {
+                let n = f32::ceil(hash_duration.as_secs_f32() / hash_period.as_secs_f32()) as usize;
+                Self::Chromaprint(chromaprint::DelayedFingerprinter::new(
+                    n,
+                    hash_duration,
+                    hash_period,
+                    None,
+                    2,
+                    None,
+                ))
+            }
+            FingerprintEngine::BandEnergy => {
+                Self::BandEnergy(BandEnergyFingerprinter::new(hash_duration, hash_period))
+            }
+        }
+    }
+
+    /// Sample rate that audio needs to be resampled to before it is fed in.
+    pub(crate) fn sample_rate(&self) -> u32 {
+        match self {
+            Self::Chromaprint(fingerprinter) => fingerprinter.sample_rate(),
+            Self::BandEnergy(_) => BAND_ENERGY_SAMPLE_RATE,
+        }
+    }
+
+    /// Feeds interleaved stereo samples and calls `on_hash` for each completed hash. Hash
+    /// timestamps mark the end of the audio they cover, relative to the first sample fed in.
+    pub(crate) fn feed(&mut self, samples: &[i16], mut on_hash: impl FnMut(u32, Duration)) {
+        match self {
+            Self::Chromaprint(fingerprinter) => {
+                for (raw_fingerprint, ts) in fingerprinter.feed(samples).unwrap() {
+                    on_hash(chromaprint::simhash::simhash32(raw_fingerprint.get()), ts);
+                }
+            }
+            Self::BandEnergy(fingerprinter) => fingerprinter.feed(samples, on_hash),
+        }
+    }
+}
+
+/// See [FingerprintEngine::BandEnergy].
+pub(crate) struct BandEnergyFingerprinter {
+    fft: Fft,
+    window: Vec<f32>,
+    // Band edges, as FFT bin indices. There is one more edge than there are bands.
+    band_edges: Vec<usize>,
+    // Mono samples that have not been consumed by a full frame yet.
+    samples: Vec<f32>,
+    // Number of mono samples consumed so far.
+    position: u64,
+    prev_energies: Option<Vec<f32>>,
+    // Sub-fingerprints (one per frame) that are still within `hash_duration` of the latest one,
+    // along with the position at which their frame ends.
+    sub_fingerprints: VecDeque<(u32, u64)>,
+    hash_duration: u64,
+    hash_period: u64,
+    next_hash: u64,
+}
+
+impl BandEnergyFingerprinter {
+    fn new(hash_duration: Duration, hash_period: Duration) -> Self {
+        let to_samples = |d: Duration| (d.as_secs_f64() * BAND_ENERGY_SAMPLE_RATE as f64) as u64;
+
+        let window = (0..BAND_ENERGY_FRAME_LEN)
+            .map(|i| {
+                let x = std::f32::consts::PI * 2.0 * i as f32 / BAND_ENERGY_FRAME_LEN as f32;
+                0.5 - 0.5 * x.cos()
+            })
+            .collect();
+
+        // 33 logarithmically spaced bands give 32 bits per sub-fingerprint.
+        let bin_width = BAND_ENERGY_SAMPLE_RATE as f32 / BAND_ENERGY_FRAME_LEN as f32;
+        let ratio = BAND_ENERGY_MAX_FREQ / BAND_ENERGY_MIN_FREQ;
+        let mut band_edges: Vec<usize> = (0..=33)
+            .map(|i| {
+                let freq = BAND_ENERGY_MIN_FREQ * ratio.powf(i as f32 / 33.0);
+                (freq / bin_width).round() as usize
+            })
+            .collect();
+        // Make sure that every band covers at least one bin.
+        for i in 1..band_edges.len() {
+            band_edges[i] = usize::max(band_edges[i], band_edges[i - 1] + 1);
+        }
+
+        let hash_duration = to_samples(hash_duration);
+        Self {
+            fft: Fft::new(BAND_ENERGY_FRAME_LEN),
+            window,
+            band_edges,
+            samples: Vec::with_capacity(2 * BAND_ENERGY_FRAME_LEN),
+            position: 0,
+            prev_energies: None,
+            sub_fingerprints: VecDeque::new(),
+            hash_duration,
+            hash_period: u64::max(to_samples(hash_period), 1),
+            next_hash: hash_duration,
+        }
+    }
+
+    fn feed(&mut self, samples: &[i16], mut on_hash: impl FnMut(u32, Duration)) {
+        self.samples.extend(
+            samples
+                .chunks_exact(2)
+                .map(|frame| (frame[0] as f32 + frame[1] as f32) / 2.0),
+        );
+
+        let mut consumed = 0;
+        while self.samples.len() - consumed >= BAND_ENERGY_FRAME_LEN {
+            let frame_end = self.position + (consumed + BAND_ENERGY_FRAME_LEN) as u64;
+            let frame = &self.samples[consumed..consumed + BAND_ENERGY_FRAME_LEN];
+            let spectrum = self.fft.power_spectrum(frame, &self.window);
+            let energies: Vec<f32> = self
+                .band_edges
+                .windows(2)
+                .map(|edges| spectrum[edges[0]..edges[1]].iter().sum())
+                .collect();
+            consumed += BAND_ENERGY_HOP_LEN;
+
+            if let Some(prev) = &self.prev_energies {
+                let mut bits = 0u32;
+                for m in 0..32 {
+                    let diff = (energies[m] - energies[m + 1]) - (prev[m] - prev[m + 1]);
+                    if diff > 0.0 {
+                        bits |= 1 << m;
+                    }
+                }
+                self.sub_fingerprints.push_back((bits, frame_end));
+            }
+            self.prev_energies = Some(energies);
+
+            // Emit a hash for each period that has been fully covered.
+            while frame_end >= self.next_hash {
+                let window_start = self.next_hash.saturating_sub(self.hash_duration);
+                while matches!(self.sub_fingerprints.front(), Some((_, end)) if *end <= window_start)
+                {
+                    self.sub_fingerprints.pop_front();
+                }
+                let bits: Vec<u32> = self
+                    .sub_fingerprints
+                    .iter()
+                    .take_while(|(_, end)| *end <= self.next_hash)
+                    .map(|(bits, _)| *bits)
+                    .collect();
+                if !bits.is_empty() {
+                    let ts = Duration::from_secs_f64(
+                        self.next_hash as f64 / BAND_ENERGY_SAMPLE_RATE as f64,
+                    );
+                    on_hash(chromaprint::simhash::simhash32(&bits), ts);
+                }
+                self.next_hash += self.hash_period;
+            }
+        }
+
+        self.samples.drain(..consumed);
+        self.position += consumed as u64;
+    }
+}
+
+/// Minimal radix-2 FFT for real input.
+struct Fft {
+    len: usize,
+    cos: Vec<f32>,
+    sin: Vec<f32>,
+    re: Vec<f32>,
+    im: Vec<f32>,
+}
+
+impl Fft {
+    fn new(len: usize) -> Self {
+        assert!(len.is_power_of_two());
+        let (cos, sin): (Vec<f32>, Vec<f32>) = (0..len / 2)
+            .map(|i| {
+                let x = -2.0 * std::f32::consts::PI * i as f32 / len as f32;
+                (x.cos(), x.sin())
+            })
+            .unzip();
+        Self {
+            len,
+            cos,
+            sin,
+            re: vec![0.0; len],
+            im: vec![0.0; len],
+        }
+    }
+
+    // Returns the power of each frequency bin up to the Nyquist frequency.
+    fn power_spectrum(&mut self, input: &[f32], window: &[f32]) -> Vec<f32> {
+        let n = self.len;
+        let bits = n.trailing_zeros();
+        for i in 0..n {
+            let j = i.reverse_bits() >> (usize::BITS - bits);
+            self.re[j] = input[i] * window[i];
+            self.im[j] = 0.0;
+        }
+
+        let mut size = 2;
+        while size <= n {
+            let half = size / 2;
+            let step = n / size;
+            for start in (0..n).step_by(size) {
+                for k in 0..half {
+                    let (wr, wi) = (self.cos[k * step], self.sin[k * step]);
+                    let (a, b) = (start + k, start + k + half);
+                    let tr = self.re[b] * wr - self.im[b] * wi;
+                    let ti = self.re[b] * wi + self.im[b] * wr;
+                    self.re[b] = self.re[a] - tr;
+                    self.im[b] = self.im[a] - ti;
+                    self.re[a] += tr;
+                    self.im[a] += ti;
+                }
+            }
+            size *= 2;
+        }
+
+        (0..=n / 2)
+            .map(|i| self.re[i] * self.re[i] + self.im[i] * self.im[i])
+            .collect()
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn tone(freq: f32, seconds: f32) -> Vec<i16> {
+        let n = (seconds * BAND_ENERGY_SAMPLE_RATE as f32) as usize;
+        (0..n)
+            .flat_map(|i| {
+                let t = i as f32 / BAND_ENERGY_SAMPLE_RATE as f32;
+                let s = (8000.0 * (2.0 * std::f32::consts::PI * freq * t).sin()) as i16;
+                [s, s]
+            })
+            .collect()
+    }
+
+    #[test]
+    fn test_fft() {
+        let mut fft = Fft::new(64);
+        let input: Vec<f32> = (0..64)
+            .map(|i| (2.0 * std::f32::consts::PI * 8.0 * i as f32 / 64.0).cos())
+            .collect();
+        let spectrum = fft.power_spectrum(&input, &[1.0; 64]);
+        let peak = (0..spectrum.len())
+            .max_by(|a, b| spectrum[*a].partial_cmp(&spectrum[*b]).unwrap())
+            .unwrap();
+        assert_eq!(peak, 8);
+    }
+
+    #[test]
+    fn test_band_energy_fingerprinter() {
+        let (hash_duration, hash_period) = (Duration::from_secs(3), Duration::from_millis(300));
+        let mut audio = tone(440.0, 5.0);
+        audio.extend(tone(880.0, 5.0));
+
+        // Hashes do not depend on how the audio is split up.
+        let run = |chunk_len: usize| {
+            let mut fingerprinter =
+                Fingerprinter::new(FingerprintEngine::BandEnergy, hash_duration, hash_period);
+            let mut hashes = Vec::new();
+            for chunk in audio.chunks(chunk_len) {
+                fingerprinter.feed(chunk, |hash, ts| hashes.push((hash, ts)));
+            }
+            hashes
+        };
+        let hashes = run(2048);
+        assert_eq!(hashes, run(300));
+
+        // One hash per period once the first `hash_duration` of audio is in.
+        assert_eq!(hashes.len(), 24);
+        assert!(hashes[0].1 >= hash_duration);
+        for pair in hashes.windows(2) {
+            assert!(pair[1].1 - pair[0].1 >= Duration::from_millis(290));
+        }
+    }
+}
@@ -0,0 +1,584 @@
+use std::borrow::Cow;
+use std::collections::{HashMap, HashSet};
+use std::fmt::Display;
+use std::io::Write;
+use std::path::{Path, PathBuf};
+use std::time::Duration;
+
+use serde::{Deserialize, Serialize};
+
+use super::analyzer::FrameHashes;
+use super::fingerprint::FingerprintEngine;
+use super::rehash::{resample_hashes, same_period};
+use super::simhash::SimhashIndex;
+use crate::util::FileIdentity;
+use crate::{Error, Result};
+
+/// Number of consecutive hashes that make up a window.
+const WINDOW_LEN: usize = 8;
+
+/// Windows are indexed every this many hashes. Queries look up the window at every position, so an
+/// occurrence is found no matter how it lines up with the indexed windows.
+const INDEX_STRIDE: usize = 2;
+
+/// Number of LSH bands per window. Band `b` holds the 16 bits of the window simhash that start at
+/// bit `8 * b`, so every bit is part of two bands and windows that differ in a few bits still share
+/// at least one band.
+const NUM_BANDS: u32 = 4;
+
+/// Buckets with more entries than this hold silence or other featureless audio, which says nothing
+/// about where a segment occurs. They are ignored by queries.
+const MAX_BUCKET_LEN: usize = 4096;
+
+/// Minimum number of band hits at the same alignment for a video to be checked against a query.
+const MIN_VOTES: u32 = 2;
+
+/// Minimum fraction of the hashes of a segment that have to match for an occurrence to be reported.
+const MIN_MATCH_RATIO: f32 = 0.5;
+
+/// Settings shared by all videos in a [LibraryIndex].
+#[derive(Clone, Copy, Debug, Deserialize, Serialize)]
+struct IndexSettings {
+    hash_period: f32,
+    hash_duration: f32,
+    engine: FingerprintEngine,
+}
+
+#[derive(Debug, Deserialize, Serialize)]
+struct IndexedVideo {
+    path: PathBuf,
+    identity: FileIdentity,
+    md5: String,
+    // Hashes of the primary track, along with their timestamps in milliseconds.
+    hashes: Vec<(u32, u32)>,
+}
+
+/// An occurrence of a segment in a video of a [LibraryIndex]. This is output by
+/// [LibraryIndex::query].
+#[derive(Clone, Debug, PartialEq)]
+pub struct SegmentMatch {
+    pub(crate) path: PathBuf,
+    pub(crate) start: Duration,
+    pub(crate) end: Duration,
+    pub(crate) score: f32,
+}
+
+impl SegmentMatch {
+    /// Returns the path of the video the segment occurs in.
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+
+    /// Returns the time of the first matching hash in the video.
+    pub fn start(&self) -> Duration {
+        self.start
+    }
+
+    /// Returns the time of the last matching hash in the video.
+    pub fn end(&self) -> Duration {
+        self.end
+    }
+
+    /// Returns the fraction of the hashes of the segment that matched, from 0 to 1.
+    pub fn score(&self) -> f32 {
+        self.score
+    }
+}
+
+/// Summary of a [LibraryIndex::update].
+#[derive(Debug, Default)]
+pub struct LibraryUpdate {
+    /// Number of videos that were added to the index, or indexed again because they changed.
+    pub indexed: usize,
+    /// Number of videos that were already up-to-date in the index.
+    pub unchanged: usize,
+    /// Number of videos that were dropped from the index because they no longer exist.
+    pub removed: usize,
+    /// Videos that could not be indexed, along with the error that caused them to be skipped.
+    pub skipped: Vec<(PathBuf, Error)>,
+}
+
+impl Display for LibraryUpdate {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        writeln!(
+            f,
+            "Indexed {} videos ({} unchanged, {} removed, {} skipped).",
+            self.indexed,
+            self.unchanged,
+            self.removed,
+            self.skipped.len(),
+        )?;
+        for (path, err) in &self.skipped {
+            writeln!(f, "* Skipped - {} ({})", path.display(), err)?;
+        }
+        Ok(())
+    }
+}
+
+/// A persistent index of the hashes of every video in a library, used to find where a segment of
+/// audio occurs across the library without comparing videos pairwise (e.g., for recaps, reused
+/// music, or commercials).
+///
+/// The primary track of each video is split into overlapping windows of a few hashes. The simhash of
+/// each window is split into bands, and each band is a key into a table of (video, position) pairs.
+/// A query looks up the windows of the segment, counts hits per video and alignment, and checks the
+/// most promising alignments hash by hash.
+///
+/// All videos in an index must use the same hash duration and [FingerprintEngine]. Videos analyzed
+/// with a finer hash period than the index are resampled to its period.
+#[derive(Debug, Default, Deserialize, Serialize)]
+pub struct LibraryIndex {
+    // Set by the first video added to the index.
+    settings: Option<IndexSettings>,
+    // Removed videos leave an empty slot behind so that the IDs of other videos stay valid.
+    videos: Vec<Option<IndexedVideo>>,
+    // Maps band keys to the (video, position) of each window with that band.
+    buckets: HashMap<u32, Vec<(u32, u32)>>,
+}
+
+impl LibraryIndex {
+    /// Loads the index stored at `path`. Returns an empty index if there is no file at `path`.
+    pub fn load(path: impl AsRef<Path>) -> Result<Self> {
+        let path = path.as_ref();
+        if !path.exists() {
+            return Ok(Default::default());
+        }
+        let f = std::io::BufReader::new(std::fs::File::open(path)?);
+        Ok(bincode::deserialize_from(f)?)
+    }
+
+    /// Writes the index to `path`.
+    pub fn save(&self, path: impl AsRef<Path>) -> Result<()> {
+        // Write to a temporary file first so that a failed write never clobbers the old index.
+        let path = path.as_ref();
+        let tmp_path = path.with_extension("tmp");
+        {
+            let mut f = std::io::BufWriter::new(std::fs::File::create(&tmp_path)?);
+            bincode::serialize_into(&mut f, self)?;
+            f.flush()?;
+        }
+        std::fs::rename(&tmp_path, path)?;
+        Ok(())
+    }
+
+    /// Returns the number of videos in the index.
+    pub fn len(&self) -> usize {
+        self.videos.iter().flatten().count()
+    }
+
+    /// Returns true if the index holds no videos.
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Brings the index up-to-date with the given videos and their frame hash data.
+    ///
+    /// Videos that are already indexed and have not changed since are left alone, so only new or
+    /// changed videos are hashed into the index. Videos that no longer exist on disk are dropped.
+    pub fn update(
+        &mut self,
+        videos: impl IntoIterator<Item = (PathBuf, FrameHashes)>,
+    ) -> LibraryUpdate {
+        let mut summary = LibraryUpdate::default();
+
+        // Videos that are gone, or that changed since they were indexed, are dropped from all
+        // buckets in a single pass.
+        let mut stale = HashSet::new();
+        for (id, slot) in self.videos.iter_mut().enumerate() {
+            if slot.as_ref().map_or(false, |video| !video.path.exists()) {
+                *slot = None;
+                stale.insert(id as u32);
+                summary.removed += 1;
+            }
+        }
+
+        let ids: HashMap<PathBuf, u32> = self
+            .videos
+            .iter()
+            .enumerate()
+            .filter_map(|(id, slot)| slot.as_ref().map(|video| (video.path.clone(), id as u32)))
+            .collect();
+        let mut pending = Vec::new();
+        for (path, frame_hashes) in videos {
+            let path = std::fs::canonicalize(&path).unwrap_or(path);
+            let id = ids.get(&path).copied();
+            if let Some(id) = id {
+                let video = self.videos[id as usize].as_ref().unwrap();
+                if video.identity == frame_hashes.identity && video.md5 == frame_hashes.md5 {
+                    summary.unchanged += 1;
+                    continue;
+                }
+                stale.insert(id);
+            }
+            pending.push((id, path, frame_hashes));
+        }
+        let all_stale = self
+            .videos
+            .iter()
+            .enumerate()
+            .all(|(id, slot)| slot.is_none() || stale.contains(&(id as u32)));
+        if all_stale {
+            // No video is left as it was, so start over, possibly with different settings.
+            *self = Default::default();
+            pending.iter_mut().for_each(|(id, _, _)| *id = None);
+        } else {
+            self.remove_postings(&stale);
+        }
+
+        for (id, path, frame_hashes) in pending {
+            match self.insert(id, path.clone(), &frame_hashes) {
+                Ok(()) => summary.indexed += 1,
+                Err(err) => summary.skipped.push((path, err)),
+            }
+        }
+        if self.is_empty() {
+            // Every changed video was skipped, so nothing holds on to the old settings.
+            *self = Default::default();
+        }
+
+        summary
+    }
+
+    /// Finds all occurrences of the part of a video between `start` and `end` in the index.
+    ///
+    /// `frame_hashes` is the frame hash data of `video`, which does not need to be part of the
+    /// index. If it is, the segment itself is not reported.
+    pub fn query(
+        &self,
+        video: impl AsRef<Path>,
+        frame_hashes: &FrameHashes,
+        start: Duration,
+        end: Duration,
+        hash_match_threshold: u32,
+    ) -> Result<Vec<SegmentMatch>> {
+        let settings = match self.settings {
+            Some(settings) => settings,
+            None => return Ok(Vec::new()),
+        };
+        let data = self.primary_track(frame_hashes)?;
+        let segment: Vec<(u32, Duration)> = data
+            .iter()
+            .filter(|(_, ts)| *ts >= start && *ts <= end)
+            .copied()
+            .collect();
+        if segment.len() < WINDOW_LEN {
+            tracing::warn!(
+                num_hashes = segment.len(),
+                "segment is too short to query the library index"
+            );
+            return Ok(Vec::new());
+        }
+        let (segment_start, segment_end) = (segment[0].1, segment[segment.len() - 1].1);
+
+        // Count band hits per video and alignment, i.e., position in the video minus position in
+        // the segment.
+        let mut votes: HashMap<(u32, i64), u32> = HashMap::new();
+        let hash_period = Duration::from_secs_f32(settings.hash_period);
+        for (pos, simhash) in windows(&segment, hash_period, 1) {
+            for key in band_keys(simhash) {
+                let postings = match self.buckets.get(&key) {
+                    Some(postings) if postings.len() <= MAX_BUCKET_LEN => postings,
+                    _ => continue,
+                };
+                for &(id, target) in postings {
+                    *votes.entry((id, target as i64 - pos as i64)).or_default() += 1;
+                }
+            }
+        }
+        let mut candidates: Vec<_> = votes
+            .into_iter()
+            .filter(|(_, votes)| *votes >= MIN_VOTES)
+            .collect();
+        candidates.sort_by(|a, b| b.1.cmp(&a.1).then(a.0.cmp(&b.0)));
+
+        let video = std::fs::canonicalize(video.as_ref()).unwrap_or_else(|_| video.as_ref().into());
+        let mut matches: Vec<(u32, SegmentMatch)> = Vec::new();
+        for ((id, offset), _) in candidates {
+            let indexed = match &self.videos[id as usize] {
+                Some(indexed) => indexed,
+                None => continue,
+            };
+
+            // Check the alignment hash by hash.
+            let (mut matched, mut first, mut last) = (0, None, 0);
+            for (i, (hash, _)) in segment.iter().enumerate() {
+                let target = i as i64 + offset;
+                if target < 0 || target >= indexed.hashes.len() as i64 {
+                    continue;
+                }
+                let target = target as usize;
+                if u32::count_ones(hash ^ indexed.hashes[target].0) <= hash_match_threshold {
+                    matched += 1;
+                    first.get_or_insert(target);
+                    last = target;
+                }
+            }
+            let score = matched as f32 / segment.len() as f32;
+            let first = match first {
+                Some(first) if score >= MIN_MATCH_RATIO => first,
+                _ => continue,
+            };
+
+            let start = Duration::from_millis(indexed.hashes[first].1 as u64);
+            let end = Duration::from_millis(indexed.hashes[last].1 as u64);
+            // The segment trivially matches itself.
+            if indexed.path == video && start <= segment_end && end >= segment_start {
+                continue;
+            }
+            // Nearby alignments of an occurrence that was already found are not new occurrences.
+            if matches
+                .iter()
+                .any(|(other, m)| *other == id && m.start <= end && m.end >= start)
+            {
+                continue;
+            }
+
+            matches.push((
+                id,
+                SegmentMatch {
+                    path: indexed.path.clone(),
+                    start,
+                    end,
+                    score,
+                },
+            ));
+        }
+
+        let mut matches: Vec<SegmentMatch> = matches.into_iter().map(|(_, m)| m).collect();
+        matches.sort_by(|a, b| a.path.cmp(&b.path).then(a.start.cmp(&b.start)));
+        Ok(matches)
+    }
+
+    // Returns the primary track of `frame_hashes` at the hash period of the index.
+    fn primary_track<'a>(
+        &self,
+        frame_hashes: &'a FrameHashes,
+    ) -> Result<Cow<'a, [(u32, Duration)]>> {
+        let settings = match self.settings {
+            Some(settings) => settings,
+            None => return Ok(Cow::Borrowed(&frame_hashes.data)),
+        };
+
+        if frame_hashes.engine != settings.engine {
+            return Err(Error::LibraryIndexMismatch(format!(
+                "hashes were computed with {}, but the index uses {}",
+                frame_hashes.engine, settings.engine
+            )));
+        }
+        if !same_period(frame_hashes.hash_duration, settings.hash_duration) {
+            return Err(Error::LibraryIndexMismatch(format!(
+                "hash duration is {}s, but the index uses {}s",
+                frame_hashes.hash_duration, settings.hash_duration
+            )));
+        }
+
+        if same_period(frame_hashes.hash_period, settings.hash_period) {
+            Ok(Cow::Borrowed(&frame_hashes.data))
+        } else if frame_hashes.hash_period < settings.hash_period {
+            let hash_period = Duration::from_secs_f32(settings.hash_period);
+            Ok(Cow::Owned(resample_hashes(&frame_hashes.data, hash_period)))
+        } else {
+            Err(Error::LibraryIndexMismatch(format!(
+                "hash period is {}s, which is coarser than the {}s used by the index",
+                frame_hashes.hash_period, settings.hash_period
+            )))
+        }
+    }
+
+    // Adds a video to the index, reusing the slot `id` if set.
+    fn insert(&mut self, id: Option<u32>, path: PathBuf, frame_hashes: &FrameHashes) -> Result<()> {
+        if let Some(id) = id {
+            self.videos[id as usize] = None;
+        }
+        let data = self.primary_track(frame_hashes)?;
+        let settings = *self.settings.get_or_insert(IndexSettings {
+            hash_period: frame_hashes.hash_period,
+            hash_duration: frame_hashes.hash_duration,
+            engine: frame_hashes.engine,
+        });
+        let id = id.unwrap_or_else(|| {
+            self.videos.push(None);
+            (self.videos.len() - 1) as u32
+        });
+
+        let hash_period = Duration::from_secs_f32(settings.hash_period);
+        for (pos, simhash) in windows(&data, hash_period, INDEX_STRIDE) {
+            for key in band_keys(simhash) {
+                self.buckets.entry(key).or_default().push((id, pos as u32));
+            }
+        }
+        self.videos[id as usize] = Some(IndexedVideo {
+            path,
+            identity: frame_hashes.identity,
+            md5: frame_hashes.md5.clone(),
+            hashes: data
+                .iter()
+                .map(|(hash, ts)| (*hash, ts.as_millis() as u32))
+                .collect(),
+        });
+
+        Ok(())
+    }
+
+    fn remove_postings(&mut self, ids: &HashSet<u32>) {
+        if ids.is_empty() {
+            return;
+        }
+        self.buckets.retain(|_, postings| {
+            postings.retain(|(id, _)| !ids.contains(id));
+            !postings.is_empty()
+        });
+    }
+}
+
+// Returns the position and simhash of every window that starts at a multiple of `stride`. Windows
+// that span a gap in the data (e.g., between the parts covered by a template) are skipped.
+pub(crate) fn windows(
+    data: &[(u32, Duration)],
+    hash_period: Duration,
+    stride: usize,
+) -> Vec<(usize, u32)> {
+    if data.len() < WINDOW_LEN {
+        return Vec::new();
+    }
+    let simhashes = SimhashIndex::new(data);
+    let max_span = hash_period * (2 * WINDOW_LEN as u32);
+    (0..=data.len() - WINDOW_LEN)
+        .step_by(stride)
+        .filter(|&i| data[i + WINDOW_LEN - 1].1.saturating_sub(data[i].1) <= max_span)
+        .map(|i| (i, simhashes.simhash(i, i + WINDOW_LEN - 1)))
+        .collect()
+}
+
+// Returns the keys of the LSH bands of a window simhash (see [NUM_BANDS]).
+pub(crate) fn band_keys(simhash: u32) -> impl Iterator<Item = u32> {
+    (0..NUM_BANDS).map(move |band| (band << 16) | (simhash.rotate_right(8 * band) & 0xFFFF))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn frame_hashes(data: Vec<(u32, Duration)>) -> FrameHashes {
+        FrameHashes {
+            hash_period: 0.3,
+            hash_duration: 3.0,
+            data,
+            md5: String::new(),
+            content_md5: String::new(),
+            truncated: None,
+            language: None,
+            tracks: Vec::new(),
+            identity: Default::default(),
+            coverage: None,
+            music_regions: None,
+            engine: Default::default(),
+            subtitle_hints: None,
+            chapters: Vec::new(),
+        }
+    }
+
+    // Builds 600 hashes of unique audio, with the given segment spliced in at `at`.
+    fn video(seed: u32, segment: &[u32], at: usize) -> FrameHashes {
+        let data = (0..600u32)
+            .map(|i| {
+                let hash = match (i as usize).checked_sub(at) {
+                    Some(j) if j < segment.len() => segment[j],
+                    _ => (i ^ (seed << 16)).wrapping_mul(2654435761),
+                };
+                (hash, Duration::from_millis(300 * i as u64))
+            })
+            .collect();
+        frame_hashes(data)
+    }
+
+    #[test]
+    fn test_library_index() {
+        let dir = crate::util::test_temp_path("library-index");
+        let _ = std::fs::remove_dir_all(&dir);
+        std::fs::create_dir_all(&dir).unwrap();
+        let paths: Vec<PathBuf> = ["a.mkv", "b.mkv", "c.mkv"]
+            .iter()
+            .map(|name| {
+                let path = dir.join(name);
+                std::fs::write(&path, name).unwrap();
+                std::fs::canonicalize(path).unwrap()
+            })
+            .collect();
+
+        // A 30 second segment that occurs in the first two videos, with a few bits flipped in the
+        // second one.
+        let segment: Vec<u32> = (0..100u32)
+            .map(|i| (i + 7).wrapping_mul(0x9E3779B9) ^ 0xA5A5A5A5)
+            .collect();
+        let noisy: Vec<u32> = segment
+            .iter()
+            .enumerate()
+            .map(|(i, hash)| hash ^ (1 << (i % 32)))
+            .collect();
+        let videos = || {
+            vec![
+                (paths[0].clone(), video(1, &segment, 100)),
+                (paths[1].clone(), video(2, &noisy, 400)),
+                (paths[2].clone(), video(3, &[], 0)),
+            ]
+        };
+
+        let mut index = LibraryIndex::default();
+        let summary = index.update(videos());
+        assert_eq!(summary.indexed, 3);
+        assert!(summary.skipped.is_empty());
+
+        let query = video(1, &segment, 100);
+        let matches = index
+            .query(
+                &paths[0],
+                &query,
+                Duration::from_secs(30),
+                Duration::from_secs(60),
+                4,
+            )
+            .unwrap();
+        assert_eq!(matches.len(), 1);
+        assert_eq!(matches[0].path(), paths[1]);
+        // The segment starts at 30s in the first video and at 120s in the second.
+        assert_eq!(matches[0].start(), Duration::from_secs(120));
+        assert_eq!(matches[0].end(), Duration::from_millis(149700));
+
+        // Nothing changed, so nothing is indexed again.
+        let index_path = dir.join("library.bin");
+        index.save(&index_path).unwrap();
+        let mut index = LibraryIndex::load(&index_path).unwrap();
+        let summary = index.update(videos());
+        assert_eq!((summary.indexed, summary.unchanged), (0, 3));
+
+        // Videos that are gone are dropped, and videos analyzed with another engine are skipped.
+        std::fs::remove_file(&paths[1]).unwrap();
+        let mut other = video(4, &segment, 0);
+        other.engine = FingerprintEngine::BandEnergy;
+        other.md5 = "changed".to_owned();
+        let summary = index.update(vec![(paths[2].clone(), other)]);
+        assert_eq!((summary.removed, summary.skipped.len()), (1, 1));
+        assert_eq!(index.len(), 1);
+        let matches = index
+            .query(
+                &paths[2],
+                &query,
+                Duration::from_secs(30),
+                Duration::from_secs(60),
+                4,
+            )
+            .unwrap();
+        assert_eq!(matches[0].path(), paths[0]);
+
+        // Once the only video left has changed, the index starts over with its settings.
+        let mut other = video(1, &segment, 100);
+        other.engine = FingerprintEngine::BandEnergy;
+        other.md5 = "changed".to_owned();
+        let summary = index.update(vec![(paths[0].clone(), other)]);
+        assert_eq!((summary.indexed, summary.skipped.len()), (1, 0));
+        assert_eq!(index.len(), 1);
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -1,8 +1,33 @@
 mod analyzer;
+mod cache;
+mod chapters;
 mod comparator;
+mod counters;
+mod dedup;
+mod fingerprint;
+mod library;
+mod planner;
+mod prefetcher;
+mod prescreen;
+mod rehash;
+mod simhash;
+mod sparse;
+mod subtitles;
+mod template;
 
-pub use analyzer::{Analyzer, FrameHashes};
+pub use analyzer::{
+    Analyzer, AnalyzerLimit, AnalyzerLimits, AnalyzerSummary, AudioTrackHashes, FrameHashes,
+    LimitAction, OutputOrder,
+};
+pub use cache::PcmCache;
+pub use chapters::Chapter;
 pub use comparator::{Comparator, SearchResult};
+pub use dedup::{AlignedSegment, Alignment, Duplicate, DuplicateDetector, DuplicateGroup};
+pub use fingerprint::FingerprintEngine;
+pub use library::{LibraryIndex, LibraryUpdate, SegmentMatch};
+pub use planner::{ComparatorEngine, ComparatorPlan, PairingStrategy, PlannedPair};
+pub use subtitles::{HintConfidence, SubtitleHint, SubtitleHints};
+pub use template::{AnalysisTemplate, Coverage, CoverageSource};
 
 /// Default hash match threshold.
 ///
@@ -47,5 +72,25 @@ pub const DEFAULT_HASH_DURATION: f32 = 3.0;
 /// The idea is to provide a buffer that reduces the amount of missed content.
 pub const DEFAULT_OPENING_AND_ENDING_TIME_PADDING: f32 = 0.0; // seconds
 
+/// Default template match ratio.
+///
+/// When analyzing with an [AnalysisTemplate], a match is complete once a run of matching hashes covers
+/// this fraction of the template's opening or ending.
+pub const DEFAULT_TEMPLATE_MATCH_RATIO: f32 = 0.6;
+
+/// Default size budget of a [PcmCache] (MiB).
+///
+/// Cached audio takes up about 80 MB per hour of video, so this holds roughly 25 hours.
+pub const DEFAULT_PCM_CACHE_BUDGET_MB: u64 = 2048;
+
+/// Default minimum coverage of a duplicate.
+///
+/// Two videos are considered to be duplicates if at least this fraction of each is covered by audio
+/// the two have in common. This leaves room for cuts, such as commercials or previews.
+pub const DEFAULT_DUPLICATE_COVERAGE: f32 = 0.7;
+
+/// Default path of the [LibraryIndex] used by the CLI.
+pub const DEFAULT_LIBRARY_INDEX_PATH: &str = "needle-library.bin";
+
 static FRAME_HASH_DATA_FILE_EXT: &str = "needle.bin";
 static SKIP_FILE_EXT: &str = "needle.skip.json";
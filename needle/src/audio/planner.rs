@@ -0,0 +1,309 @@
+use std::fmt::Display;
+
+/// Rough number of table cells that a single thread can fill per second. This is only used to
+/// estimate the cost of a plan.
+const CELLS_PER_SECOND: f64 = 2.0e8;
+
+/// Tables larger than this are always computed using [ComparatorEngine::Streaming].
+const MAX_EXACT_TABLE_BYTES: u64 = 256 * 1024 * 1024;
+
+/// Fraction of available memory that the comparator is allowed to use.
+const MEMORY_BUDGET_FRACTION: f64 = 0.5;
+
+/// If comparing all pairs is estimated to take longer than this, only neighbouring videos
+/// are compared.
+const MAX_ALL_PAIRS_SECONDS: f64 = 120.0;
+
+/// Number of neighbours that each video is compared against when not comparing all pairs.
+const DEFAULT_NEIGHBORS: usize = 4;
+
+/// Algorithm used to find common runs of hashes between a pair of videos.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum ComparatorEngine {
+    /// Builds the full table of run lengths before walking it. Memory usage grows with the
+    /// product of the hash counts of both videos.
+    Exact,
+    /// Produces the same results as [ComparatorEngine::Exact], but only keeps two rows of the
+    /// table in memory at a time.
+    Streaming,
+}
+
+impl ComparatorEngine {
+    /// Estimated peak memory, in bytes, to compare videos with `n` and `m` hashes.
+    pub(crate) fn memory(&self, n: usize, m: usize) -> u64 {
+        let cell = std::mem::size_of::<usize>() as u64;
+        match self {
+            Self::Exact => (n as u64 + 1) * (m as u64 + 1) * cell,
+            Self::Streaming => 2 * (m as u64 + 1) * cell,
+        }
+    }
+}
+
+impl Display for ComparatorEngine {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            Self::Exact => write!(f, "exact"),
+            Self::Streaming => write!(f, "streaming"),
+        }
+    }
+}
+
+/// Determines which pairs of videos are compared against each other.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum PairingStrategy {
+    /// Compare every video against every other video. Given N videos, this results in
+    /// `(N * (N-1)) / 2` pairs.
+    AllPairs,
+    /// Compare each video against the next `k` videos, in the order they were provided. For
+    /// sorted episodes of a show, this keeps most of the signal at a fraction of the cost.
+    Neighbors(usize),
+}
+
+impl PairingStrategy {
+    /// Returns the list of `(src, dst)` pairs for `n` videos. Pairs only appear once.
+    pub(crate) fn pairs(&self, n: usize) -> Vec<(usize, usize)> {
+        let k = match self {
+            Self::AllPairs => n,
+            Self::Neighbors(k) => usize::max(*k, 1),
+        };
+        (0..n)
+            .flat_map(|i| (i + 1..usize::min(n, i + k + 1)).map(move |j| (i, j)))
+            .collect()
+    }
+}
+
+impl Display for PairingStrategy {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            Self::AllPairs => write!(f, "all pairs"),
+            Self::Neighbors(k) => write!(f, "{} nearest neighbours", k),
+        }
+    }
+}
+
+/// A single comparison in a [ComparatorPlan].
+#[derive(Clone, Copy, Debug)]
+pub struct PlannedPair {
+    /// Index of the source video.
+    pub src: usize,
+    /// Index of the destination video.
+    pub dst: usize,
+    /// Engine used to compare the two videos.
+    pub engine: ComparatorEngine,
+    /// Number of table cells to compute.
+    pub cells: u64,
+}
+
+/// Describes how a [Comparator](super::Comparator) will search a set of videos: which pairs are
+/// compared, which engine is used for each pair, and how many threads are used.
+///
+/// Plans are built from the number of hashes in each video along with the available memory and
+/// cores. Use [Comparator::plan](super::Comparator::plan) to build one.
+#[derive(Clone, Debug)]
+pub struct ComparatorPlan {
+    /// Strategy used to pick the pairs to compare.
+    pub pairing: PairingStrategy,
+    /// Pairs to compare.
+    pub pairs: Vec<PlannedPair>,
+    /// Number of pairs to compare in parallel.
+    pub threads: usize,
+    /// Amount of memory the comparator is allowed to use, in bytes, if known.
+    pub memory_budget: Option<u64>,
+    /// Estimated peak memory usage, in bytes.
+    pub peak_memory: u64,
+    num_videos: usize,
+}
+
+impl ComparatorPlan {
+    /// Builds a plan for videos with the given number of hashes.
+    ///
+    /// `pairing` and `engine` override the planner's choices when set.
+    pub(crate) fn new(
+        hash_counts: &[usize],
+        max_threads: usize,
+        available_memory: Option<u64>,
+        pairing: Option<PairingStrategy>,
+        engine: Option<ComparatorEngine>,
+    ) -> Self {
+        let n = hash_counts.len();
+        let max_threads = usize::max(max_threads, 1);
+        let memory_budget = available_memory.map(|m| (m as f64 * MEMORY_BUDGET_FRACTION) as u64);
+        let cells = |(i, j): (usize, usize)| hash_counts[i] as u64 * hash_counts[j] as u64;
+
+        let pairing = pairing.unwrap_or_else(|| {
+            let all_pairs = PairingStrategy::AllPairs.pairs(n);
+            let total_cells: u64 = all_pairs.iter().copied().map(cells).sum();
+            let threads = usize::min(max_threads, usize::max(all_pairs.len(), 1));
+            let seconds = total_cells as f64 / CELLS_PER_SECOND / threads as f64;
+            if seconds > MAX_ALL_PAIRS_SECONDS && n > 2 * DEFAULT_NEIGHBORS + 1 {
+                PairingStrategy::Neighbors(DEFAULT_NEIGHBORS)
+            } else {
+                PairingStrategy::AllPairs
+            }
+        });
+        let pairs = pairing.pairs(n);
+
+        let mut threads = usize::min(max_threads, usize::max(pairs.len(), 1));
+
+        // Each thread works on one pair at a time, so it gets an equal share of the budget.
+        let exact_limit = memory_budget
+            .map(|budget| budget / threads as u64)
+            .unwrap_or(u64::MAX)
+            .min(MAX_EXACT_TABLE_BYTES);
+        let pairs: Vec<PlannedPair> = pairs
+            .into_iter()
+            .map(|(src, dst)| {
+                let (n, m) = (hash_counts[src], hash_counts[dst]);
+                let engine = engine.unwrap_or_else(|| {
+                    if ComparatorEngine::Exact.memory(n, m) <= exact_limit {
+                        ComparatorEngine::Exact
+                    } else {
+                        ComparatorEngine::Streaming
+                    }
+                });
+                PlannedPair {
+                    src,
+                    dst,
+                    engine,
+                    cells: cells((src, dst)),
+                }
+            })
+            .collect();
+
+        let max_pair_memory = pairs
+            .iter()
+            .map(|p| p.engine.memory(hash_counts[p.src], hash_counts[p.dst]))
+            .max()
+            .unwrap_or(0);
+
+        // If the exact engine was forced, run fewer pairs at once to stay within the budget.
+        if let Some(budget) = memory_budget {
+            if max_pair_memory > 0 {
+                let fit = usize::max((budget / max_pair_memory) as usize, 1);
+                threads = usize::min(threads, fit);
+            }
+        }
+
+        Self {
+            pairing,
+            pairs,
+            threads,
+            memory_budget,
+            peak_memory: max_pair_memory * threads as u64,
+            num_videos: n,
+        }
+    }
+
+    /// Total number of table cells computed by this plan.
+    pub fn total_cells(&self) -> u64 {
+        self.pairs.iter().map(|p| p.cells).sum()
+    }
+
+    /// Rough estimate of the time it will take to run this plan.
+    pub fn estimated_time(&self) -> std::time::Duration {
+        let seconds = self.total_cells() as f64 / CELLS_PER_SECOND / self.threads as f64;
+        std::time::Duration::from_secs_f64(seconds)
+    }
+}
+
+fn format_bytes(bytes: u64) -> String {
+    const UNITS: [&str; 4] = ["B", "KiB", "MiB", "GiB"];
+    let mut value = bytes as f64;
+    let mut unit = 0;
+    while value >= 1024.0 && unit < UNITS.len() - 1 {
+        value /= 1024.0;
+        unit += 1;
+    }
+    format!("{:.1} {}", value, UNITS[unit])
+}
+
+impl Display for ComparatorPlan {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        let num_exact = self
+            .pairs
+            .iter()
+            .filter(|p| p.engine == ComparatorEngine::Exact)
+            .count();
+        writeln!(f, "Comparison plan:")?;
+        writeln!(
+            f,
+            "* Pairs - {} ({} across {} videos)",
+            self.pairs.len(),
+            self.pairing,
+            self.num_videos
+        )?;
+        writeln!(
+            f,
+            "* Engines - {} exact, {} streaming",
+            num_exact,
+            self.pairs.len() - num_exact
+        )?;
+        writeln!(f, "* Threads - {}", self.threads)?;
+        writeln!(
+            f,
+            "* Estimated cost - {:.2e} cells (~{})",
+            self.total_cells() as f64,
+            crate::util::format_time(self.estimated_time())
+        )?;
+        match self.memory_budget {
+            Some(budget) => writeln!(
+                f,
+                "* Estimated peak memory - {} (budget: {})",
+                format_bytes(self.peak_memory),
+                format_bytes(budget)
+            ),
+            None => writeln!(
+                f,
+                "* Estimated peak memory - {}",
+                format_bytes(self.peak_memory)
+            ),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_pairs() {
+        assert_eq!(
+            PairingStrategy::AllPairs.pairs(4),
+            vec![(0, 1), (0, 2), (0, 3), (1, 2), (1, 3), (2, 3)]
+        );
+        assert_eq!(
+            PairingStrategy::Neighbors(1).pairs(4),
+            vec![(0, 1), (1, 2), (2, 3)]
+        );
+    }
+
+    #[test]
+    fn test_plan() {
+        // Small inputs: compare everything with the exact engine.
+        let plan = ComparatorPlan::new(&[100, 100, 100], 8, Some(1 << 30), None, None);
+        assert_eq!(plan.pairing, PairingStrategy::AllPairs);
+        assert_eq!(plan.threads, 3);
+        assert!(plan
+            .pairs
+            .iter()
+            .all(|p| p.engine == ComparatorEngine::Exact));
+
+        // Tables that do not fit in memory use the streaming engine.
+        let plan = ComparatorPlan::new(&[10_000, 10_000], 1, Some(1 << 20), None, None);
+        assert_eq!(plan.pairs[0].engine, ComparatorEngine::Streaming);
+
+        // Forcing the exact engine limits parallelism instead.
+        let plan = ComparatorPlan::new(
+            &[1000; 4],
+            4,
+            Some(32 * 1024 * 1024),
+            None,
+            Some(ComparatorEngine::Exact),
+        );
+        assert_eq!(plan.threads, 2);
+
+        // Large libraries only compare neighbours.
+        let plan = ComparatorPlan::new(&[20_000; 100], 4, None, None, None);
+        assert_eq!(plan.pairing, PairingStrategy::Neighbors(DEFAULT_NEIGHBORS));
+    }
+}
@@ -0,0 +1,141 @@
+extern crate ffmpeg_next;
+
+use std::collections::HashMap;
+use std::io::Read;
+use std::path::Path;
+use std::sync::{Condvar, Mutex};
+
+/// Number of bytes at the start of each video to pull into the page cache. This covers the
+/// container header as well as the first chunk of (interleaved) audio data.
+const READAHEAD_BYTES: usize = 4 * 1024 * 1024;
+
+#[derive(Default)]
+struct State {
+    // Number of videos that have been claimed by workers so far. Videos are claimed in order.
+    claimed: usize,
+    // Inputs that were opened ahead of time, keyed by video index.
+    ready: HashMap<usize, ffmpeg_next::format::context::Input>,
+    stopped: bool,
+}
+
+/// Prepares upcoming videos while workers are busy analyzing the current ones.
+///
+/// For each of the next `depth` videos in the schedule, the prefetcher warms the page cache with the
+/// start of the file and then opens and probes the video. Workers pick up the pre-opened input
+/// using [Prefetcher::take], which means that they can start decoding right away.
+pub(crate) struct Prefetcher {
+    depth: usize,
+    state: Mutex<State>,
+    cond: Condvar,
+}
+
+impl Prefetcher {
+    pub(crate) fn new(depth: usize) -> Self {
+        Self {
+            depth: usize::max(depth, 1),
+            state: Default::default(),
+            cond: Condvar::new(),
+        }
+    }
+
+    /// Marks the video at `idx` as claimed by a worker. This allows the prefetcher to move on
+    /// to later videos.
+    pub(crate) fn claim(&self, idx: usize) {
+        let mut state = self.state.lock().unwrap();
+        state.claimed = usize::max(state.claimed, idx + 1);
+        self.cond.notify_all();
+    }
+
+    /// Returns the pre-opened input for the video at `idx`, if it is ready.
+    pub(crate) fn take(&self, idx: usize) -> Option<ffmpeg_next::format::context::Input> {
+        self.state.lock().unwrap().ready.remove(&idx)
+    }
+
+    /// Stops the prefetcher and drops any inputs that were not picked up.
+    pub(crate) fn stop(&self) {
+        let mut state = self.state.lock().unwrap();
+        state.stopped = true;
+        state.ready.clear();
+        self.cond.notify_all();
+    }
+
+    /// Runs the prefetcher over the given list of videos. This blocks until all videos have
+    /// been prefetched or [Prefetcher::stop] is called, so it should be run on a separate thread.
+    ///
+    /// `should_open` determines whether a video needs to be opened ahead of time. Videos for which
+    /// it returns false only have their page cache warmed.
+    pub(crate) fn run<P: AsRef<Path>>(&self, videos: &[P], should_open: impl Fn(&Path) -> bool) {
+        for (idx, path) in videos.iter().enumerate() {
+            let path = path.as_ref();
+
+            // Wait until this video is one of the next `depth` videos to be claimed.
+            {
+                let mut state = self.state.lock().unwrap();
+                while !state.stopped && idx >= state.claimed + self.depth {
+                    state = self.cond.wait(state).unwrap();
+                }
+                if state.stopped {
+                    return;
+                }
+                if idx < state.claimed {
+                    // A worker got here first.
+                    continue;
+                }
+            }
+
+            readahead(path);
+
+            if !should_open(path) {
+                continue;
+            }
+
+            // Any errors are left for the worker to surface when it opens the video itself.
+            if let Ok(input) = ffmpeg_next::format::input(&path) {
+                let mut state = self.state.lock().unwrap();
+                if !state.stopped && idx >= state.claimed {
+                    state.ready.insert(idx, input);
+                }
+            }
+        }
+    }
+}
+
+/// Stops the wrapped [Prefetcher] when dropped. This ensures that the prefetcher thread exits
+/// even if a worker panics.
+pub(crate) struct StopGuard<'a>(pub(crate) &'a Prefetcher);
+
+impl<'a> Drop for StopGuard<'a> {
+    fn drop(&mut self) {
+        self.0.stop();
+    }
+}
+
+/// Asks the OS to pull the start of the file into the page cache.
+fn readahead(path: &Path) {
+    let mut f = match std::fs::File::open(path) {
+        Ok(f) => f,
+        Err(_) => return,
+    };
+
+    #[cfg(target_os = "linux")]
+    {
+        use std::os::unix::io::AsRawFd;
+        // SAFETY: The file descriptor is valid for the lifetime of `f`. The readahead is
+        // performed asynchronously by the kernel.
+        let ret = unsafe {
+            libc::posix_fadvise(
+                f.as_raw_fd(),
+                0,
+                READAHEAD_BYTES as libc::off_t,
+                libc::POSIX_FADV_WILLNEED,
+            )
+        };
+        if ret == 0 {
+            return;
+        }
+    }
+
+    // Fall back to reading the data in directly.
+    let mut buf = vec![0u8; READAHEAD_BYTES];
+    let _ = f.read(&mut buf);
+}
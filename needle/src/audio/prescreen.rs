@@ -0,0 +1,293 @@
+use std::collections::VecDeque;
+use std::time::Duration;
+
+/// Minimum amount of audio to fingerprint on either side of a music region.
+pub(crate) const MIN_MARGIN: Duration = Duration::from_secs(5);
+
+/// Length of each analysis frame, in milliseconds.
+const FRAME_MS: u64 = 20;
+
+/// Number of analysis frames in each classified window (1 second).
+const WINDOW_FRAMES: usize = 50;
+
+/// Windows with a lower RMS level than this (in S16 units) are treated as silence.
+const SILENCE_RMS: f64 = 100.0;
+
+/// Frames with less than this fraction of the window's mean energy are "low energy" frames.
+const LOW_ENERGY_FACTOR: f64 = 0.5;
+
+/// Speech is broken up by short pauses between syllables and words, so a large share of its frames
+/// are low energy frames. Music is much more even.
+const MAX_MUSIC_LOW_ENERGY_RATIO: f64 = 0.35;
+
+/// Speech alternates between voiced (few zero crossings) and unvoiced (many zero crossings) sounds,
+/// so its zero crossing rate varies a lot more than that of music. This is the maximum coefficient of
+/// variation of the zero crossing rate for music.
+const MAX_MUSIC_ZCR_VARIATION: f64 = 0.6;
+
+/// Classifies one second windows of audio as either music or not, using cheap time domain
+/// features: the share of low energy frames and the variability of the zero crossing rate.
+///
+/// The classifier is tuned to keep music: a window is only rejected if it is silent or if both
+/// features point to speech.
+struct MusicDetector {
+    frame_len: usize,
+    frame_pos: usize,
+    energy: f64,
+    crossings: u32,
+    last_negative: bool,
+    // (mean energy, zero crossing rate) of each frame in the current window.
+    frames: Vec<(f64, f64)>,
+}
+
+impl MusicDetector {
+    fn new(sample_rate: u32) -> Self {
+        Self {
+            frame_len: usize::max((sample_rate as u64 * FRAME_MS / 1000) as usize, 1),
+            frame_pos: 0,
+            energy: 0.0,
+            crossings: 0,
+            last_negative: false,
+            frames: Vec::with_capacity(WINDOW_FRAMES),
+        }
+    }
+
+    fn window_len(&self) -> usize {
+        self.frame_len * WINDOW_FRAMES
+    }
+
+    // Number of sample frames left until the current window is complete.
+    fn remaining(&self) -> usize {
+        self.window_len() - self.frames.len() * self.frame_len - self.frame_pos
+    }
+
+    // Feeds interleaved stereo samples. This must not go past the end of the current window. Returns
+    // the classification of the window once it is complete.
+    fn push(&mut self, samples: &[i16]) -> Option<bool> {
+        for frame in samples.chunks_exact(2) {
+            let mono = (frame[0] as f64 + frame[1] as f64) / 2.0;
+            self.energy += mono * mono;
+            let negative = mono < 0.0;
+            if negative != self.last_negative {
+                self.crossings += 1;
+            }
+            self.last_negative = negative;
+
+            self.frame_pos += 1;
+            if self.frame_pos == self.frame_len {
+                let n = self.frame_len as f64;
+                self.frames
+                    .push((self.energy / n, self.crossings as f64 / n));
+                self.frame_pos = 0;
+                self.energy = 0.0;
+                self.crossings = 0;
+            }
+        }
+
+        if self.frames.len() < WINDOW_FRAMES {
+            return None;
+        }
+        let is_music = Self::classify(&self.frames);
+        self.frames.clear();
+        Some(is_music)
+    }
+
+    fn classify(frames: &[(f64, f64)]) -> bool {
+        let n = frames.len() as f64;
+        let mean_energy = frames.iter().map(|f| f.0).sum::<f64>() / n;
+        if mean_energy.sqrt() < SILENCE_RMS {
+            return false;
+        }
+
+        let num_low_energy = frames
+            .iter()
+            .filter(|f| f.0 < mean_energy * LOW_ENERGY_FACTOR)
+            .count();
+        let low_energy_ratio = num_low_energy as f64 / n;
+
+        let mean_zcr = frames.iter().map(|f| f.1).sum::<f64>() / n;
+        let zcr_variation = if mean_zcr > 0.0 {
+            let variance = frames
+                .iter()
+                .map(|f| (f.1 - mean_zcr) * (f.1 - mean_zcr))
+                .sum::<f64>()
+                / n;
+            variance.sqrt() / mean_zcr
+        } else {
+            0.0
+        };
+
+        !(low_energy_ratio > MAX_MUSIC_LOW_ENERGY_RATIO && zcr_variation > MAX_MUSIC_ZCR_VARIATION)
+    }
+}
+
+/// Decides which stretches of a track's audio are worth fingerprinting.
+///
+/// Audio is passed through while music is playing, plus `margin` on either side. Everything else is
+/// held back in a small buffer. Once music is detected, the buffer (which covers the margin before
+/// the music) is released so that no hashes are lost at the start of a region.
+pub(crate) struct MusicGate {
+    detector: MusicDetector,
+    sample_rate: u32,
+    margin: u64,
+    // Number of sample frames seen so far.
+    position: u64,
+    // While active, audio is passed through until at least this position.
+    active_until: Option<u64>,
+    pending: VecDeque<i16>,
+    pending_start: u64,
+    // Regions of audio that were passed through, in sample frames.
+    regions: Vec<(u64, u64)>,
+}
+
+impl MusicGate {
+    pub(crate) fn new(sample_rate: u32, margin: Duration) -> Self {
+        let detector = MusicDetector::new(sample_rate);
+        let margin = (margin.as_secs_f64() * sample_rate as f64) as u64;
+        let capacity = 2 * (margin as usize + detector.window_len());
+        Self {
+            detector,
+            sample_rate,
+            margin,
+            position: 0,
+            active_until: None,
+            pending: VecDeque::with_capacity(capacity),
+            pending_start: 0,
+            regions: Vec::new(),
+        }
+    }
+
+    /// Passes interleaved stereo `samples` through the gate.
+    ///
+    /// `on_audio` is called with the audio to fingerprint. If the audio starts a new region, the
+    /// position of its first sample frame is passed in as well: since the audio is not contiguous
+    /// with whatever was passed through before, the fingerprinter needs to start over.
+    pub(crate) fn process(
+        &mut self,
+        samples: &[i16],
+        mut on_audio: impl FnMut(&[i16], Option<u64>),
+    ) {
+        let mut rest = samples;
+        while !rest.is_empty() {
+            let n = usize::min(rest.len(), self.detector.remaining() * 2);
+            let (chunk, tail) = rest.split_at(n);
+            rest = tail;
+
+            let is_music = self.detector.push(chunk);
+            if self.active_until.is_some() {
+                on_audio(chunk, None);
+            } else {
+                self.hold(chunk);
+            }
+            self.position += (chunk.len() / 2) as u64;
+
+            match (is_music, self.active_until) {
+                (Some(true), None) => {
+                    let start = self.pending_start;
+                    self.regions.push((start, self.position));
+                    on_audio(self.pending.make_contiguous(), Some(start));
+                    self.pending.clear();
+                    self.active_until = Some(self.position + self.margin);
+                }
+                (Some(true), Some(_)) => self.active_until = Some(self.position + self.margin),
+                (Some(false), Some(until)) if self.position >= until => {
+                    self.active_until = None;
+                    self.pending_start = self.position;
+                }
+                _ => (),
+            }
+            if self.active_until.is_some() {
+                if let Some(region) = self.regions.last_mut() {
+                    region.1 = self.position;
+                }
+            }
+        }
+    }
+
+    // Buffers audio that may turn out to be part of the margin before a music region.
+    fn hold(&mut self, chunk: &[i16]) {
+        self.pending.extend(chunk);
+        let capacity = 2 * (self.margin as usize + self.detector.window_len());
+        if self.pending.len() > capacity {
+            let excess = self.pending.len() - capacity;
+            self.pending.drain(..excess);
+            self.pending_start += (excess / 2) as u64;
+        }
+    }
+
+    /// Returns the regions of audio that were fingerprinted, relative to the start of the audio.
+    pub(crate) fn regions(&self) -> impl Iterator<Item = (Duration, Duration)> + '_ {
+        let to_duration =
+            |frames: u64| Duration::from_secs_f64(frames as f64 / self.sample_rate as f64);
+        self.regions
+            .iter()
+            .map(move |&(start, end)| (to_duration(start), to_duration(end)))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    const SAMPLE_RATE: u32 = 11025;
+
+    fn tone(seconds: f64) -> Vec<i16> {
+        let n = (seconds * SAMPLE_RATE as f64) as usize;
+        (0..n)
+            .flat_map(|i| {
+                let t = i as f64 / SAMPLE_RATE as f64;
+                let s = (8000.0 * (2.0 * std::f64::consts::PI * 440.0 * t).sin()) as i16;
+                [s, s]
+            })
+            .collect()
+    }
+
+    // Short bursts of sound broken up by pauses, roughly like syllables.
+    fn speech(seconds: f64) -> Vec<i16> {
+        let burst = tone(0.12);
+        let pause = vec![0i16; 2 * (0.13 * SAMPLE_RATE as f64) as usize];
+        let n = 2 * (seconds * SAMPLE_RATE as f64) as usize;
+        burst
+            .iter()
+            .chain(pause.iter())
+            .copied()
+            .cycle()
+            .take(n)
+            .collect()
+    }
+
+    #[test]
+    fn test_music_detector() {
+        let mut detector = MusicDetector::new(SAMPLE_RATE);
+        let window = detector.window_len();
+        assert_eq!(detector.push(&tone(1.0)[..2 * window]), Some(true));
+        assert_eq!(detector.push(&speech(1.0)[..2 * window]), Some(false));
+        assert_eq!(detector.push(&vec![0; 2 * window]), Some(false));
+    }
+
+    #[test]
+    fn test_music_gate() {
+        let mut gate = MusicGate::new(SAMPLE_RATE, Duration::from_secs(3));
+        let mut audio = speech(20.0);
+        audio.extend(tone(10.0));
+        audio.extend(speech(20.0));
+
+        let mut passed = 0;
+        let mut starts = Vec::new();
+        for chunk in audio.chunks(2048) {
+            gate.process(chunk, |samples, start| {
+                passed += samples.len();
+                starts.extend(start);
+            });
+        }
+
+        // A single region: the music, plus the margin on either side.
+        let regions: Vec<_> = gate.regions().collect();
+        assert_eq!(regions.len(), 1);
+        assert_eq!(starts.len(), 1);
+        let (start, end) = regions[0];
+        assert!(start <= Duration::from_secs(17) && start >= Duration::from_secs(15));
+        assert!(end >= Duration::from_secs(33) && end <= Duration::from_secs(35));
+        assert!(passed < audio.len() / 2);
+    }
+}
@@ -0,0 +1,173 @@
+use std::borrow::Cow;
+use std::path::Path;
+use std::time::Duration;
+
+use super::analyzer::FrameHashes;
+use crate::{Error, Result};
+
+/// Hash periods closer than this are considered to be the same.
+const PERIOD_EPSILON: f32 = 1e-4;
+
+pub(crate) fn same_period(a: f32, b: f32) -> bool {
+    (a - b).abs() < PERIOD_EPSILON
+}
+
+pub(crate) fn abs_diff(a: Duration, b: Duration) -> Duration {
+    if a > b {
+        a - b
+    } else {
+        b - a
+    }
+}
+
+/// Resamples hash data to a coarser `hash_period` by picking the hash closest to each point on the
+/// new grid. Original timestamps are kept.
+///
+/// If the new period is an integer multiple of the old one, this is the same as keeping every n-th
+/// hash.
+pub(crate) fn resample_hashes(
+    data: &[(u32, Duration)],
+    hash_period: Duration,
+) -> Vec<(u32, Duration)> {
+    let mut resampled = Vec::new();
+    let (first, last) = match (data.first(), data.last()) {
+        (Some(first), Some(last)) => (first.1, last.1),
+        _ => return resampled,
+    };
+
+    let mut target = first;
+    let mut i = 0;
+    let mut last_idx = None;
+    while target <= last {
+        // Move forward to the hash closest to the target timestamp.
+        while i + 1 < data.len() && abs_diff(data[i + 1].1, target) <= abs_diff(data[i].1, target) {
+            i += 1;
+        }
+        // Gaps in the original data can map several grid points to the same hash.
+        if last_idx != Some(i) {
+            resampled.push(data[i]);
+            last_idx = Some(i);
+        }
+        target += hash_period;
+    }
+
+    resampled
+}
+
+/// Brings two sets of hash data to the same hash period by resampling the finer one.
+///
+/// Hashes are compared index by index, so this is needed to compare videos that were analyzed with
+/// different hash periods.
+pub(crate) fn align_periods<'a>(
+    src: &'a [(u32, Duration)],
+    src_period: f32,
+    dst: &'a [(u32, Duration)],
+    dst_period: f32,
+) -> (Cow<'a, [(u32, Duration)]>, Cow<'a, [(u32, Duration)]>) {
+    if same_period(src_period, dst_period) {
+        (Cow::Borrowed(src), Cow::Borrowed(dst))
+    } else if src_period < dst_period {
+        let src = resample_hashes(src, Duration::from_secs_f32(dst_period));
+        (Cow::Owned(src), Cow::Borrowed(dst))
+    } else {
+        let dst = resample_hashes(dst, Duration::from_secs_f32(src_period));
+        (Cow::Borrowed(src), Cow::Owned(dst))
+    }
+}
+
+impl FrameHashes {
+    /// Derives frame hash data for a coarser `hash_period` from this data, without decoding the
+    /// video again.
+    ///
+    /// Each hash covers `hash_duration` of audio, so the duration cannot be changed without
+    /// re-analyzing the video. Likewise, a finer period cannot be derived from a coarser one.
+    pub fn rehash(&self, hash_period: f32, hash_duration: f32) -> Result<Self> {
+        if !same_period(hash_duration, self.hash_duration) {
+            return Err(Error::RehashUnsupported(format!(
+                "hash_duration can only be changed by re-analyzing (have {}s, want {}s)",
+                self.hash_duration, hash_duration
+            )));
+        }
+        if hash_period < self.hash_period && !same_period(hash_period, self.hash_period) {
+            return Err(Error::RehashUnsupported(format!(
+                "cannot derive a finer hash_period (have {}s, want {}s)",
+                self.hash_period, hash_period
+            )));
+        }
+
+        let period = Duration::from_secs_f32(hash_period);
+        let tracks = self
+            .tracks
+            .iter()
+            .map(|track| super::AudioTrackHashes {
+                stream_index: track.stream_index,
+                language: track.language.clone(),
+                data: resample_hashes(&track.data, period),
+            })
+            .collect();
+
+        Ok(Self {
+            hash_period,
+            hash_duration,
+            data: resample_hashes(&self.data, period),
+            md5: self.md5.clone(),
+            content_md5: self.content_md5.clone(),
+            truncated: self.truncated,
+            language: self.language.clone(),
+            tracks,
+            identity: self.identity,
+            coverage: self.coverage.clone(),
+            music_regions: self.music_regions.clone(),
+            engine: self.engine,
+            subtitle_hints: self.subtitle_hints.clone(),
+            chapters: self.chapters.clone(),
+        })
+    }
+
+    /// Writes this frame hash data alongside the provided video, replacing any existing data.
+    pub fn save_for_video(&self, video: impl AsRef<Path>) -> Result<()> {
+        self.to_path(
+            video
+                .as_ref()
+                .with_extension(super::FRAME_HASH_DATA_FILE_EXT),
+        )
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn hashes(period_ms: u64, n: u32) -> Vec<(u32, Duration)> {
+        (0..n)
+            .map(|i| (i, Duration::from_millis(3000 + period_ms * i as u64)))
+            .collect()
+    }
+
+    #[test]
+    fn test_resample_hashes() {
+        // Integer multiple: keep every third hash.
+        let resampled = resample_hashes(&hashes(100, 10), Duration::from_millis(300));
+        let kept: Vec<u32> = resampled.iter().map(|(h, _)| *h).collect();
+        assert_eq!(kept, vec![0, 3, 6, 9]);
+
+        // Non-integer ratio: pick the closest hash.
+        let resampled = resample_hashes(&hashes(200, 10), Duration::from_millis(300));
+        let kept: Vec<u32> = resampled.iter().map(|(h, _)| *h).collect();
+        assert_eq!(kept, vec![0, 2, 3, 5, 6, 8, 9]);
+
+        assert!(resample_hashes(&[], Duration::from_millis(300)).is_empty());
+    }
+
+    #[test]
+    fn test_align_periods() {
+        let (fine, coarse) = (hashes(100, 30), hashes(300, 10));
+        let (src, dst) = align_periods(&fine, 0.1, &coarse, 0.3);
+        assert_eq!(src.len(), dst.len());
+        assert!(matches!(dst, Cow::Borrowed(_)));
+
+        let (src, dst) = align_periods(&coarse, 0.3, &fine, 0.1);
+        assert_eq!(src.len(), dst.len());
+        assert!(matches!(src, Cow::Borrowed(_)));
+    }
+}
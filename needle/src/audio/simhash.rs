@@ -0,0 +1,74 @@
+use std::time::Duration;
+
+/// Prefix counts of set bits, per bit position, over a list of hashes.
+///
+/// The simhash of a range of hashes sets each bit that is set in more than half of the hashes in
+/// the range. With prefix counts, the number of hashes that have a given bit set in any range is a
+/// single subtraction, so the simhash of any range costs 32 subtractions instead of a pass over
+/// the range.
+#[derive(Clone, Debug, Default)]
+pub(crate) struct SimhashIndex {
+    // counts[i][b] is the number of hashes before index `i` that have bit `b` set.
+    counts: Vec<[u32; 32]>,
+}
+
+impl SimhashIndex {
+    pub(crate) fn new(data: &[(u32, Duration)]) -> Self {
+        let mut counts = Vec::with_capacity(data.len() + 1);
+        let mut row = [0u32; 32];
+        counts.push(row);
+        for (hash, _) in data {
+            for (bit, count) in row.iter_mut().enumerate() {
+                *count += (hash >> bit) & 1;
+            }
+            counts.push(row);
+        }
+        Self { counts }
+    }
+
+    /// Returns the number of hashes in the index.
+    pub(crate) fn len(&self) -> usize {
+        self.counts.len() - 1
+    }
+
+    /// Returns the simhash of the hashes in `start..=end`. This is the same as running
+    /// `simhash32` over the range.
+    pub(crate) fn simhash(&self, start: usize, end: usize) -> u32 {
+        let (before, last) = (&self.counts[start], &self.counts[end + 1]);
+        let len = (end + 1 - start) as u32;
+        let mut hash = 0;
+        for bit in 0..32 {
+            let ones = last[bit] - before[bit];
+            // Ties are broken towards zero.
+            if 2 * ones > len {
+                hash |= 1 << bit;
+            }
+        }
+        hash
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_simhash_index() {
+        let data: Vec<(u32, Duration)> = (0..200u32)
+            .map(|i| (i.wrapping_mul(2654435761) ^ (i << 7), Duration::ZERO))
+            .collect();
+        let index = SimhashIndex::new(&data);
+        assert_eq!(index.len(), data.len());
+
+        let hashes: Vec<u32> = data.iter().map(|(h, _)| *h).collect();
+        for (start, end) in [(0, 0), (0, 1), (3, 10), (17, 120), (0, 199), (199, 199)] {
+            assert_eq!(
+                index.simhash(start, end),
+                chromaprint_rust::simhash::simhash32(&hashes[start..=end]),
+                "range {}..={}",
+                start,
+                end
+            );
+        }
+    }
+}
@@ -0,0 +1,236 @@
+extern crate ffmpeg_next;
+
+use std::fs::File;
+use std::io::{Read, Seek, SeekFrom};
+use std::path::Path;
+
+use crate::Result;
+
+/// Neighbouring audio packets that are at most this far apart are read with a single read.
+const MAX_GAP_BYTES: u64 = 32 * 1024;
+
+/// Maximum size of a single coalesced read.
+const MAX_RANGE_BYTES: u64 = 4 * 1024 * 1024;
+
+// Flag set on index entries that the demuxer would mark as discarded (e.g., due to edit lists).
+const AVINDEX_DISCARD_FRAME: i32 = 0x0002;
+const AVINDEX_KEYFRAME: i32 = 0x0001;
+
+#[derive(Clone, Copy, Debug)]
+struct IndexEntry {
+    pos: u64,
+    size: usize,
+    timestamp: i64,
+    flags: i32,
+}
+
+// A contiguous range of bytes that holds one or more packets.
+#[derive(Debug)]
+struct ReadRange {
+    start: u64,
+    end: u64,
+    // Range of packet indices (into `entries`) contained in this byte range.
+    first: usize,
+    last: usize,
+}
+
+/// Reads the packets of a single audio stream straight from the file, using the sample index
+/// built by the demuxer.
+///
+/// In MP4/MOV files, audio usually makes up a small fraction of the file's bytes. Rather than
+/// demuxing the entire file, this reader only issues reads for the byte ranges that hold audio
+/// packets. Nearby packets are coalesced into larger reads.
+pub(crate) struct SparseAudioReader {
+    file: File,
+    stream_idx: usize,
+    entries: Vec<IndexEntry>,
+    ranges: Vec<ReadRange>,
+    next_range: usize,
+    next_entry: usize,
+    buf: Vec<u8>,
+    buf_start: u64,
+    bytes_read: u64,
+}
+
+impl SparseAudioReader {
+    /// Returns a reader for the given stream if the container's index fully describes it.
+    ///
+    /// Only MP4/MOV is supported: its index (`stbl`) covers every audio sample. Other containers
+    /// (e.g., MKV, whose cues only index keyframes) return `None`.
+    pub(crate) fn new(
+        path: impl AsRef<Path>,
+        ctx: &ffmpeg_next::format::context::Input,
+        stream_idx: usize,
+    ) -> Option<Self> {
+        if !ctx.format().name().split(',').any(|name| name == "mov") {
+            return None;
+        }
+
+        let stream = ctx.stream(stream_idx)?;
+        let entries = Self::read_index(&stream)?;
+        let ranges = Self::coalesce(&entries);
+        let file = File::open(path).ok()?;
+
+        tracing::debug!(
+            num_packets = entries.len(),
+            num_reads = ranges.len(),
+            "using sparse audio reads"
+        );
+
+        Some(Self {
+            file,
+            stream_idx,
+            entries,
+            ranges,
+            next_range: 0,
+            next_entry: 0,
+            buf: Vec::new(),
+            buf_start: 0,
+            bytes_read: 0,
+        })
+    }
+
+    fn read_index(stream: &ffmpeg_next::format::stream::Stream) -> Option<Vec<IndexEntry>> {
+        // SAFETY: The stream pointer is valid for as long as the input context is alive. Entries
+        // returned by FFmpeg are only read here and copied out.
+        unsafe {
+            let st = stream.as_ptr() as *mut ffmpeg_next::ffi::AVStream;
+            let count = ffmpeg_next::ffi::avformat_index_get_entries_count(st);
+            if count <= 0 {
+                return None;
+            }
+
+            let mut entries = Vec::with_capacity(count as usize);
+            for i in 0..count {
+                let entry = ffmpeg_next::ffi::avformat_index_get_entry(st, i);
+                if entry.is_null() {
+                    return None;
+                }
+                let entry = &*entry;
+                if entry.pos < 0 || entry.size() <= 0 {
+                    return None;
+                }
+                entries.push(IndexEntry {
+                    pos: entry.pos as u64,
+                    size: entry.size() as usize,
+                    timestamp: entry.timestamp,
+                    flags: entry.flags(),
+                });
+            }
+
+            Some(entries)
+        }
+    }
+
+    // Groups consecutive (in decode order) entries into as few reads as possible.
+    fn coalesce(entries: &[IndexEntry]) -> Vec<ReadRange> {
+        let mut ranges: Vec<ReadRange> = Vec::new();
+
+        for (i, entry) in entries.iter().enumerate() {
+            let (start, end) = (entry.pos, entry.pos + entry.size as u64);
+            if let Some(range) = ranges.last_mut() {
+                let is_near = start >= range.end && start - range.end <= MAX_GAP_BYTES;
+                if is_near && end - range.start <= MAX_RANGE_BYTES {
+                    range.end = end;
+                    range.last = i;
+                    continue;
+                }
+            }
+            ranges.push(ReadRange {
+                start,
+                end,
+                first: i,
+                last: i,
+            });
+        }
+
+        ranges
+    }
+
+    /// Total number of bytes read from the file so far.
+    pub(crate) fn bytes_read(&self) -> u64 {
+        self.bytes_read
+    }
+
+    /// Returns the next audio packet, or `None` once all packets have been read.
+    pub(crate) fn next_packet(&mut self) -> Result<Option<ffmpeg_next::Packet>> {
+        if self.next_entry >= self.entries.len() {
+            return Ok(None);
+        }
+
+        // Read in the next range if we've gone past the current one.
+        if self.next_range == 0 || self.next_entry > self.ranges[self.next_range - 1].last {
+            let range = &self.ranges[self.next_range];
+            debug_assert_eq!(range.first, self.next_entry);
+            self.buf.resize((range.end - range.start) as usize, 0);
+            self.file.seek(SeekFrom::Start(range.start))?;
+            self.file.read_exact(&mut self.buf)?;
+            self.buf_start = range.start;
+            self.bytes_read += self.buf.len() as u64;
+            self.next_range += 1;
+        }
+
+        let idx = self.next_entry;
+        let entry = self.entries[idx];
+        let offset = (entry.pos - self.buf_start) as usize;
+        let mut packet = ffmpeg_next::Packet::copy(&self.buf[offset..offset + entry.size]);
+        packet.set_stream(self.stream_idx);
+        packet.set_pts(Some(entry.timestamp));
+        packet.set_dts(Some(entry.timestamp));
+        if let Some(next) = self.entries.get(idx + 1) {
+            packet.set_duration(next.timestamp - entry.timestamp);
+        }
+        let mut flags = ffmpeg_next::codec::packet::Flags::empty();
+        if entry.flags & AVINDEX_KEYFRAME != 0 {
+            flags |= ffmpeg_next::codec::packet::Flags::KEY;
+        }
+        if entry.flags & AVINDEX_DISCARD_FRAME != 0 {
+            flags |= ffmpeg_next::codec::packet::Flags::DISCARD;
+        }
+        packet.set_flags(flags);
+
+        self.next_entry += 1;
+
+        Ok(Some(packet))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn entry(pos: u64, size: usize) -> IndexEntry {
+        IndexEntry {
+            pos,
+            size,
+            timestamp: 0,
+            flags: 0,
+        }
+    }
+
+    #[test]
+    fn test_coalesce() {
+        let entries = [
+            entry(0, 100),
+            // Small gap: coalesced.
+            entry(1000, 100),
+            // Large gap: new read.
+            entry(1_000_000, 100),
+            // Going backwards: new read.
+            entry(500, 100),
+        ];
+        let ranges = SparseAudioReader::coalesce(&entries);
+        let ranges: Vec<_> = ranges
+            .iter()
+            .map(|r| (r.start, r.end, r.first, r.last))
+            .collect();
+        assert_eq!(
+            ranges,
+            vec![
+                (0, 1100, 0, 1),
+                (1_000_000, 1_000_100, 2, 2),
+                (500, 600, 3, 3)
+            ]
+        );
+    }
+}
@@ -0,0 +1,410 @@
+use std::time::Duration;
+
+use serde::{Deserialize, Serialize};
+
+use super::template::{extend_ranges, Coverage, CoverageSource, GuideAction};
+
+/// Lines of the same song are at most this far apart.
+const MAX_EVENT_GAP: Duration = Duration::from_secs(15);
+
+/// Songs that are shorter or longer than this are unlikely to be an opening or ending.
+const MIN_SONG_DURATION: Duration = Duration::from_secs(super::DEFAULT_MIN_OPENING_DURATION as u64);
+const MAX_SONG_DURATION: Duration = Duration::from_secs(180);
+
+/// Audio decoded around each hinted window. Songs usually start before their first line and end
+/// after their last one.
+const HINT_PADDING: Duration = Duration::from_secs(10);
+
+/// How much a [SubtitleHint] can be trusted.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Deserialize, Serialize)]
+pub enum HintConfidence {
+    /// The window was inferred from karaoke lines near the start or end of the video. It may be an
+    /// insert song instead.
+    Low,
+    /// The window is made of lines that are explicitly labelled as the opening or ending, and has
+    /// a plausible length.
+    High,
+}
+
+/// A window of a video that likely contains its opening or ending, according to its subtitles.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Deserialize, Serialize)]
+pub struct SubtitleHint {
+    pub(crate) start: Duration,
+    pub(crate) end: Duration,
+    pub(crate) confidence: HintConfidence,
+}
+
+impl SubtitleHint {
+    /// Returns the start of the first line of the song.
+    pub fn start(&self) -> Duration {
+        self.start
+    }
+
+    /// Returns the end of the last line of the song.
+    pub fn end(&self) -> Duration {
+        self.end
+    }
+
+    /// Returns how much this hint can be trusted.
+    pub fn confidence(&self) -> HintConfidence {
+        self.confidence
+    }
+}
+
+/// Opening and ending windows derived from the ASS/SSA subtitle track of a video.
+///
+/// Fansubbed releases typically typeset the lyrics of the opening and ending using dedicated styles
+/// (e.g., "OP Romaji" or "ED-English"), often with karaoke timing. Reading the subtitle track only
+/// requires demuxing it, which is much cheaper than decoding the audio. See
+/// [Analyzer::with_subtitle_hints](super::Analyzer::with_subtitle_hints).
+#[derive(Clone, Debug, Default, PartialEq, Eq, Deserialize, Serialize)]
+pub struct SubtitleHints {
+    pub(crate) opening: Option<SubtitleHint>,
+    pub(crate) ending: Option<SubtitleHint>,
+}
+
+impl SubtitleHints {
+    /// Returns the hinted opening, if any.
+    pub fn opening(&self) -> Option<&SubtitleHint> {
+        self.opening.as_ref()
+    }
+
+    /// Returns the hinted ending, if any.
+    pub fn ending(&self) -> Option<&SubtitleHint> {
+        self.ending.as_ref()
+    }
+
+    /// Derives hints from the events of a subtitle track. `duration` is the duration of the video.
+    /// Returns `None` if no opening or ending could be found.
+    ///
+    /// Lines labelled as the opening or ending take precedence. Otherwise, karaoke lines in the
+    /// opening (ending) search window of the video are assumed to be the opening (ending).
+    pub(crate) fn from_events(events: &[SubtitleEvent], duration: Duration) -> Option<Self> {
+        let head_end = duration.mul_f32(super::DEFAULT_OPENING_SEARCH_PERCENTAGE);
+        let tail_start = duration.mul_f32(1.0 - super::DEFAULT_ENDING_SEARCH_PERCENTAGE);
+        let longest = |windows: Vec<(Duration, Duration)>| {
+            windows.into_iter().max_by_key(|(start, end)| *end - *start)
+        };
+        let labelled = |song| {
+            longest(clusters(events.iter().filter(|e| e.song == Some(song)))).map(|(start, end)| {
+                let plausible = (MIN_SONG_DURATION..=MAX_SONG_DURATION).contains(&(end - start));
+                SubtitleHint {
+                    start,
+                    end,
+                    confidence: if plausible {
+                        HintConfidence::High
+                    } else {
+                        HintConfidence::Low
+                    },
+                }
+            })
+        };
+        let karaoke = clusters(events.iter().filter(|e| e.karaoke && e.song.is_none()));
+        let inferred = |f: &dyn Fn(&(Duration, Duration)) -> bool| {
+            longest(karaoke.iter().copied().filter(f).collect()).map(|(start, end)| SubtitleHint {
+                start,
+                end,
+                confidence: HintConfidence::Low,
+            })
+        };
+
+        let opening = labelled(Song::Opening).or_else(|| inferred(&|w| w.0 < head_end));
+        let ending = labelled(Song::Ending).or_else(|| inferred(&|w| w.0 >= tail_start));
+        (opening.is_some() || ending.is_some()).then(|| Self { opening, ending })
+    }
+
+    /// Builds a guide that decodes the padded window of each song with a [HintConfidence::High]
+    /// hint, and the whole default search window of each song without one. Returns `None` if no
+    /// song has such a hint, in which case the whole video needs to be analyzed.
+    pub(crate) fn guide(&self, duration: Duration, hash_duration: Duration) -> Option<HintGuide> {
+        let confident = |hint: Option<&SubtitleHint>| {
+            hint.filter(|hint| hint.confidence == HintConfidence::High)
+                .map(|hint| {
+                    (
+                        hint.start.saturating_sub(HINT_PADDING),
+                        hint.end + HINT_PADDING,
+                    )
+                })
+        };
+        let (opening, ending) = (confident(self.opening()), confident(self.ending()));
+        if duration.is_zero() || (opening.is_none() && ending.is_none()) {
+            return None;
+        }
+
+        // Low confidence hints may be insert songs, and a song without a hint may simply not be
+        // typeset, so neither can be used to skip any part of the search window.
+        let opening = opening.unwrap_or((
+            Duration::ZERO,
+            duration.mul_f32(super::DEFAULT_OPENING_SEARCH_PERCENTAGE),
+        ));
+        let ending = ending.unwrap_or((
+            duration.mul_f32(1.0 - super::DEFAULT_ENDING_SEARCH_PERCENTAGE),
+            duration,
+        ));
+        let mut windows: Vec<(Duration, Duration)> = Vec::new();
+        let mut candidates = [opening, ending];
+        candidates.sort();
+        for (start, end) in candidates {
+            match windows.last_mut() {
+                Some(last) if start <= last.1 => last.1 = Duration::max(last.1, end),
+                _ => windows.push((start, end)),
+            }
+        }
+
+        Some(HintGuide {
+            duration,
+            hash_duration,
+            windows,
+            current: 0,
+            ranges: Vec::new(),
+        })
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub(crate) enum Song {
+    Opening,
+    Ending,
+}
+
+/// A single line of an ASS/SSA subtitle track.
+#[derive(Clone, Debug)]
+pub(crate) struct SubtitleEvent {
+    start: Duration,
+    end: Duration,
+    // Song the line is labelled with by its style, actor name or effect.
+    song: Option<Song>,
+    // Whether the line has karaoke timing tags.
+    karaoke: bool,
+}
+
+impl SubtitleEvent {
+    /// Parses the payload of an ASS/SSA packet. `start` and `end` are the timestamps of the packet.
+    ///
+    /// Packets from Matroska files (and recent versions of FFmpeg in general) hold the fields of
+    /// the event without its timing: `ReadOrder,Layer,Style,Name,MarginL,MarginR,MarginV,Effect,Text`.
+    /// Full "Dialogue:" lines are accepted as well.
+    pub(crate) fn parse(data: &[u8], start: Duration, end: Duration) -> Option<Self> {
+        let line = String::from_utf8_lossy(data);
+        let (fields, style_idx): (Vec<&str>, usize) = match line.trim().strip_prefix("Dialogue:") {
+            // Layer,Start,End,Style,Name,MarginL,MarginR,MarginV,Effect,Text
+            Some(rest) => (rest.trim_start().splitn(10, ',').collect(), 3),
+            None => (line.trim().splitn(9, ',').collect(), 2),
+        };
+        if fields.len() < style_idx + 7 {
+            return None;
+        }
+
+        let (style, name) = (fields[style_idx], fields[style_idx + 1]);
+        let (effect, text) = (fields[fields.len() - 2], fields[fields.len() - 1]);
+        Some(Self {
+            start,
+            end,
+            song: label(style)
+                .or_else(|| label(name))
+                .or_else(|| label(effect)),
+            karaoke: text.contains("\\k") || text.contains("\\K"),
+        })
+    }
+}
+
+// Returns the song a style or actor name refers to, e.g., "OP Romaji", "ED2_Kanji" or "Ending".
+fn label(field: &str) -> Option<Song> {
+    field
+        .split(|c: char| !c.is_ascii_alphanumeric())
+        .find_map(|token| {
+            let token = token.to_ascii_lowercase();
+            match token.trim_end_matches(|c: char| c.is_ascii_digit()) {
+                "op" | "opening" => Some(Song::Opening),
+                "ed" | "ending" => Some(Song::Ending),
+                _ => None,
+            }
+        })
+}
+
+// Groups events into windows of lines that are at most `MAX_EVENT_GAP` apart, in order.
+fn clusters<'a>(events: impl Iterator<Item = &'a SubtitleEvent>) -> Vec<(Duration, Duration)> {
+    let mut times: Vec<_> = events.map(|e| (e.start, e.end)).collect();
+    times.sort();
+
+    let mut windows: Vec<(Duration, Duration)> = Vec::new();
+    for (start, end) in times {
+        match windows.last_mut() {
+            Some(window) if start <= window.1 + MAX_EVENT_GAP => {
+                window.1 = Duration::max(window.1, end)
+            }
+            _ => windows.push((start, end)),
+        }
+    }
+    windows
+}
+
+/// Decides which parts of a single video to analyze, based on [SubtitleHints]. Each hinted window
+/// is decoded in turn, seeking over everything else.
+pub(crate) struct HintGuide {
+    duration: Duration,
+    hash_duration: Duration,
+    windows: Vec<(Duration, Duration)>,
+    current: usize,
+    ranges: Vec<(Duration, Duration)>,
+}
+
+impl HintGuide {
+    /// Returns the action to take before any audio is decoded.
+    pub(crate) fn start(&mut self) -> GuideAction {
+        self.enter(Duration::ZERO)
+    }
+
+    /// Feeds newly computed hashes of the primary track to the guide.
+    pub(crate) fn observe(&mut self, hashes: &[(u32, Duration)]) -> GuideAction {
+        for &(_, ts) in hashes {
+            extend_ranges(&mut self.ranges, ts, self.hash_duration);
+            if ts.saturating_sub(self.hash_duration) >= self.windows[self.current].1 {
+                self.current += 1;
+                return self.enter(ts);
+            }
+        }
+        GuideAction::Continue
+    }
+
+    // Moves on to the current window from `position`.
+    fn enter(&mut self, position: Duration) -> GuideAction {
+        match self.windows.get(self.current) {
+            None => GuideAction::Stop,
+            Some(&(start, _)) if start > position => {
+                // Start a new range once the first hash after the seek comes in.
+                self.ranges.push((Duration::MAX, Duration::ZERO));
+                GuideAction::Seek(start)
+            }
+            Some(_) => GuideAction::Continue,
+        }
+    }
+
+    /// Returns the coverage of the hashes observed so far.
+    pub(crate) fn coverage(self) -> Option<Coverage> {
+        Some(Coverage {
+            duration: self.duration,
+            source: CoverageSource::SubtitleHints,
+            ranges: self
+                .ranges
+                .into_iter()
+                .filter(|(start, end)| start < end)
+                .collect(),
+        })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn event(line: &str, start: u64, end: u64) -> SubtitleEvent {
+        SubtitleEvent::parse(
+            line.as_bytes(),
+            Duration::from_secs(start),
+            Duration::from_secs(end),
+        )
+        .unwrap()
+    }
+
+    #[test]
+    fn test_subtitle_hints() {
+        let duration = Duration::from_secs(1440);
+        let mut events = Vec::new();
+        // Opening lyrics, typeset in two layers.
+        for t in (90..175).step_by(5) {
+            events.push(event("0,0,OP Romaji,,0,0,0,,{\\k20}ko{\\k30}e", t, t + 4));
+            events.push(event("1,0,OP-English,,0,0,0,,Voice", t, t + 4));
+        }
+        // Dialogue, including a karaoke insert song in the middle of the episode.
+        for t in (200..1300).step_by(7) {
+            events.push(event("2,0,Default,Speaker,0,0,0,,Line", t, t + 3));
+        }
+        for t in (700..760).step_by(5) {
+            events.push(event("3,0,Insert,,0,0,0,,{\\kf40}la", t, t + 4));
+        }
+        // Karaoke ending without a dedicated style.
+        for t in (1320..1400).step_by(5) {
+            events.push(event(
+                "Dialogue: 0,0:22:00.00,0:22:04.00,Song,,0,0,0,,{\\k40}la",
+                t,
+                t + 4,
+            ));
+        }
+
+        let hints = SubtitleHints::from_events(&events, duration).unwrap();
+        let opening = hints.opening().unwrap();
+        assert_eq!(
+            (opening.start(), opening.end()),
+            (Duration::from_secs(90), Duration::from_secs(174))
+        );
+        assert_eq!(opening.confidence(), HintConfidence::High);
+        let ending = hints.ending().unwrap();
+        assert_eq!(
+            (ending.start(), ending.end()),
+            (Duration::from_secs(1320), Duration::from_secs(1399))
+        );
+        assert_eq!(ending.confidence(), HintConfidence::Low);
+
+        // Only the padded window of the opening is decoded. The ending may be an insert song, so
+        // its whole search window is decoded.
+        let mut guide = hints.guide(duration, Duration::from_secs(3)).unwrap();
+        assert_eq!(guide.start(), GuideAction::Seek(Duration::from_secs(80)));
+        let hashes: Vec<_> = (83..=186).map(|t| (0, Duration::from_secs(t))).collect();
+        assert_eq!(guide.observe(&hashes), GuideAction::Continue);
+        assert_eq!(
+            guide.observe(&[(0, Duration::from_secs(187))]),
+            GuideAction::Seek(Duration::from_secs(1080))
+        );
+        let hashes: Vec<_> = (1083..=1440).map(|t| (0, Duration::from_secs(t))).collect();
+        assert_eq!(guide.observe(&hashes), GuideAction::Continue);
+        let coverage = guide.coverage().unwrap();
+        assert_eq!(
+            coverage.ranges(),
+            &[
+                (Duration::from_secs(80), Duration::from_secs(187)),
+                (Duration::from_secs(1080), Duration::from_secs(1440)),
+            ]
+        );
+
+        // Hints that are not confident are not used to skip anything.
+        let hints = SubtitleHints {
+            opening: None,
+            ending: hints.ending,
+        };
+        assert!(hints.guide(duration, Duration::from_secs(3)).is_none());
+    }
+
+    #[test]
+    fn test_subtitle_hints_ending_only() {
+        let duration = Duration::from_secs(1440);
+        let hints = SubtitleHints {
+            opening: None,
+            ending: Some(SubtitleHint {
+                start: Duration::from_secs(1320),
+                end: Duration::from_secs(1399),
+                confidence: HintConfidence::High,
+            }),
+        };
+
+        // The opening is searched for in its whole search window before skipping to the ending.
+        let mut guide = hints.guide(duration, Duration::from_secs(3)).unwrap();
+        assert_eq!(guide.start(), GuideAction::Continue);
+        let hashes: Vec<_> = (3..=722).map(|t| (0, Duration::from_secs(t))).collect();
+        assert_eq!(guide.observe(&hashes), GuideAction::Continue);
+        assert_eq!(
+            guide.observe(&[(0, Duration::from_secs(723))]),
+            GuideAction::Seek(Duration::from_secs(1310))
+        );
+        let hashes: Vec<_> = (1313..=1412).map(|t| (0, Duration::from_secs(t))).collect();
+        assert_eq!(guide.observe(&hashes), GuideAction::Stop);
+        let coverage = guide.coverage().unwrap();
+        assert_eq!(
+            coverage.ranges(),
+            &[
+                (Duration::ZERO, Duration::from_secs(723)),
+                (Duration::from_secs(1310), Duration::from_secs(1412)),
+            ]
+        );
+    }
+}
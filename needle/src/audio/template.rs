@@ -0,0 +1,460 @@
+use std::path::Path;
+use std::time::Duration;
+
+use serde::{Deserialize, Serialize};
+
+use super::analyzer::FrameHashes;
+use super::fingerprint::FingerprintEngine;
+use super::subtitles::HintGuide;
+use crate::{Error, Result};
+
+/// Identifies what decided which parts of a video to analyze (see [Coverage::source]).
+#[derive(Clone, Copy, Debug, Deserialize, Serialize, PartialEq, Eq)]
+pub enum CoverageSource {
+    /// An [AnalysisTemplate] (see [Analyzer::with_template](super::Analyzer::with_template)).
+    Template,
+    /// The subtitles of the video (see
+    /// [Analyzer::with_subtitle_hints](super::Analyzer::with_subtitle_hints)).
+    SubtitleHints,
+    /// The chapters of the video. No audio is analyzed at all (see
+    /// [Analyzer::with_chapters](super::Analyzer::with_chapters)).
+    Chapters,
+}
+
+/// Describes which parts of a video are covered by frame hash data that was computed with an
+/// [AnalysisTemplate], subtitle hints or chapters.
+#[derive(Clone, Debug, Deserialize, Serialize, PartialEq, Eq)]
+pub struct Coverage {
+    pub(crate) duration: Duration,
+    pub(crate) ranges: Vec<(Duration, Duration)>,
+    pub(crate) source: CoverageSource,
+}
+
+impl Coverage {
+    /// Returns the duration of the full video.
+    pub fn duration(&self) -> Duration {
+        self.duration
+    }
+
+    /// Returns the time ranges of the video that were analyzed, in order.
+    pub fn ranges(&self) -> &[(Duration, Duration)] {
+        &self.ranges
+    }
+
+    /// Returns what decided which parts of the video to analyze.
+    pub fn source(&self) -> CoverageSource {
+        self.source
+    }
+}
+
+/// Reference hashes for the opening and/or ending of a series.
+///
+/// When an [Analyzer](super::Analyzer) is given a template, it matches hashes against the template
+/// while decoding. Once the opening has been found, the analyzer skips ahead to the end of the video
+/// and does the same for the ending. The resulting [FrameHashes] only cover part of the video (see
+/// [FrameHashes::coverage]).
+#[derive(Clone, Debug)]
+pub struct AnalysisTemplate {
+    hash_period: f32,
+    hash_duration: f32,
+    engine: FingerprintEngine,
+    opening: Option<Vec<u32>>,
+    ending: Option<Vec<u32>>,
+    hash_match_threshold: u32,
+    min_match_ratio: f32,
+    opening_search_percentage: f32,
+    ending_search_percentage: f32,
+}
+
+impl AnalysisTemplate {
+    /// Builds a template from the frame hash data of a reference video, along with the times of
+    /// its opening and ending as reported by a [Comparator](super::Comparator).
+    pub fn new(
+        frame_hashes: &FrameHashes,
+        opening: Option<(Duration, Duration)>,
+        ending: Option<(Duration, Duration)>,
+    ) -> Self {
+        // Hash timestamps mark the end of the audio they cover, while reported end times mark the
+        // start of the audio covered by the last matching hash.
+        let hash_duration = Duration::from_secs_f32(frame_hashes.hash_duration);
+        let extract = |(start, end): (Duration, Duration)| {
+            frame_hashes
+                .data
+                .iter()
+                .filter(|(_, ts)| *ts >= start && *ts <= end + hash_duration)
+                .map(|(hash, _)| *hash)
+                .collect::<Vec<_>>()
+        };
+        Self {
+            hash_period: frame_hashes.hash_period,
+            hash_duration: frame_hashes.hash_duration,
+            engine: frame_hashes.engine,
+            opening: opening.map(extract).filter(|h| !h.is_empty()),
+            ending: ending.map(extract).filter(|h| !h.is_empty()),
+            hash_match_threshold: super::DEFAULT_HASH_MATCH_THRESHOLD as u32,
+            min_match_ratio: super::DEFAULT_TEMPLATE_MATCH_RATIO,
+            opening_search_percentage: super::DEFAULT_OPENING_SEARCH_PERCENTAGE,
+            ending_search_percentage: super::DEFAULT_ENDING_SEARCH_PERCENTAGE,
+        }
+    }
+
+    /// Builds a template from a reference video that has already been analyzed and searched.
+    ///
+    /// The frame hash data and skip file stored alongside the video are used.
+    pub fn from_video(video: impl AsRef<Path>) -> Result<Self> {
+        let video = video.as_ref();
+        let frame_hashes = FrameHashes::from_video(video, false)?;
+        let result = super::comparator::load_skip_file(video, &frame_hashes.md5)?
+            .ok_or_else(|| Error::TemplateUnavailable(video.to_owned()))?;
+        let template = Self::new(&frame_hashes, result.opening, result.ending);
+        if template.opening.is_none() && template.ending.is_none() {
+            return Err(Error::TemplateUnavailable(video.to_owned()));
+        }
+        Ok(template)
+    }
+
+    /// Returns a new [AnalysisTemplate] with the provided `hash_match_threshold`.
+    pub fn with_hash_match_threshold(mut self, hash_match_threshold: u32) -> Self {
+        self.hash_match_threshold = hash_match_threshold;
+        self
+    }
+
+    /// Returns a new [AnalysisTemplate] with the provided `min_match_ratio`. This is the fraction
+    /// of the template that has to be matched before the analyzer moves on.
+    pub fn with_min_match_ratio(mut self, min_match_ratio: f32) -> Self {
+        self.min_match_ratio = min_match_ratio;
+        self
+    }
+
+    /// Returns a new [AnalysisTemplate] with the provided `opening_search_percentage`. If the opening
+    /// is not found in this portion of the start of the video, the analyzer moves on to the ending.
+    pub fn with_opening_search_percentage(mut self, opening_search_percentage: f32) -> Self {
+        self.opening_search_percentage = opening_search_percentage;
+        self
+    }
+
+    /// Returns a new [AnalysisTemplate] with the provided `ending_search_percentage`. This is the
+    /// portion of the end of the video that is analyzed when looking for the ending.
+    pub fn with_ending_search_percentage(mut self, ending_search_percentage: f32) -> Self {
+        self.ending_search_percentage = ending_search_percentage;
+        self
+    }
+
+    /// Builds a guide for a single video, or returns `None` if the template cannot be used with the
+    /// provided settings.
+    pub(crate) fn guide(
+        &self,
+        duration: Duration,
+        hash_period: f32,
+        hash_duration: f32,
+        engine: FingerprintEngine,
+    ) -> Option<TemplateGuide> {
+        if duration.is_zero() {
+            return None;
+        }
+        if !super::rehash::same_period(self.hash_duration, hash_duration)
+            || !super::rehash::same_period(self.hash_period, hash_period)
+            || self.engine != engine
+        {
+            tracing::warn!(
+                template_hash_period = self.hash_period,
+                template_hash_duration = self.hash_duration,
+                template_engine = %self.engine,
+                "template was built with different hash settings; analyzing the full video"
+            );
+            return None;
+        }
+
+        let matcher = |template: &Option<Vec<u32>>| {
+            template.as_ref().map(|template| {
+                RunMatcher::new(
+                    template.clone(),
+                    self.hash_match_threshold,
+                    self.min_match_ratio,
+                )
+            })
+        };
+
+        Some(TemplateGuide {
+            duration,
+            head_end: duration.mul_f32(self.opening_search_percentage),
+            tail_start: duration.mul_f32(1.0 - self.ending_search_percentage),
+            hash_duration: Duration::from_secs_f32(hash_duration),
+            opening: matcher(&self.opening),
+            ending: matcher(&self.ending),
+            phase: Phase::Head,
+            ranges: Vec::new(),
+        })
+    }
+}
+
+// Matches a stream of hashes against a template, one hash at a time. This is a single row of the
+// LCS table used by the comparator.
+struct RunMatcher {
+    template: Vec<u32>,
+    threshold: u32,
+    min_run: usize,
+    row: Vec<usize>,
+    matched: bool,
+}
+
+impl RunMatcher {
+    fn new(template: Vec<u32>, threshold: u32, min_match_ratio: f32) -> Self {
+        let min_run = usize::max((template.len() as f32 * min_match_ratio).ceil() as usize, 1);
+        let row = vec![0; template.len()];
+        Self {
+            template,
+            threshold,
+            min_run,
+            row,
+            matched: false,
+        }
+    }
+
+    // Feeds the next hash. Returns true once a long enough run has either ended or reached the end
+    // of the template.
+    fn push(&mut self, hash: u32) -> bool {
+        // Walk backwards so that each cell still sees the previous row's value to its left.
+        for k in (0..self.template.len()).rev() {
+            self.row[k] = if u32::count_ones(hash ^ self.template[k]) <= self.threshold {
+                if k == 0 {
+                    1
+                } else {
+                    self.row[k - 1] + 1
+                }
+            } else {
+                0
+            };
+        }
+
+        let longest = self.row.iter().copied().max().unwrap_or(0);
+        let reached_end = self.row.last().copied().unwrap_or(0) >= self.min_run;
+        let complete = reached_end || (self.matched && longest < self.min_run);
+        self.matched |= longest >= self.min_run;
+        complete
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum Phase {
+    Head,
+    Tail,
+    Done,
+}
+
+/// What the analyzer should do after a batch of hashes has been observed.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub(crate) enum GuideAction {
+    /// Keep decoding.
+    Continue,
+    /// Seek to the provided time and keep decoding from there.
+    Seek(Duration),
+    /// Stop decoding.
+    Stop,
+}
+
+/// Decides which parts of a single video to analyze.
+pub(crate) enum Guide {
+    /// Matches hashes against an [AnalysisTemplate].
+    Template(TemplateGuide),
+    /// Decodes the windows suggested by [SubtitleHints](super::SubtitleHints).
+    Hints(HintGuide),
+}
+
+impl Guide {
+    /// Returns the action to take before any audio is decoded.
+    pub(crate) fn start(&mut self) -> GuideAction {
+        match self {
+            Guide::Template(guide) => guide.start(),
+            Guide::Hints(guide) => guide.start(),
+        }
+    }
+
+    /// Feeds newly computed hashes of the primary track to the guide.
+    pub(crate) fn observe(&mut self, hashes: &[(u32, Duration)]) -> GuideAction {
+        match self {
+            Guide::Template(guide) => guide.observe(hashes),
+            Guide::Hints(guide) => guide.observe(hashes),
+        }
+    }
+
+    /// Returns the coverage of the hashes observed so far, or `None` if the whole video was
+    /// analyzed.
+    pub(crate) fn coverage(self) -> Option<Coverage> {
+        match self {
+            Guide::Template(guide) => guide.coverage(),
+            Guide::Hints(guide) => guide.coverage(),
+        }
+    }
+}
+
+/// Adds a hash with timestamp `ts` to the last of the `ranges` covered by a guide. Each hash
+/// covers the `hash_duration` of audio that ends at its timestamp.
+pub(crate) fn extend_ranges(
+    ranges: &mut Vec<(Duration, Duration)>,
+    ts: Duration,
+    hash_duration: Duration,
+) {
+    let start = ts.saturating_sub(hash_duration);
+    match ranges.last_mut() {
+        Some(range) => {
+            range.0 = Duration::min(range.0, start);
+            range.1 = Duration::max(range.1, ts);
+        }
+        None => ranges.push((start, ts)),
+    }
+}
+
+/// Decides which parts of a single video to analyze, based on an [AnalysisTemplate].
+pub(crate) struct TemplateGuide {
+    duration: Duration,
+    head_end: Duration,
+    tail_start: Duration,
+    hash_duration: Duration,
+    opening: Option<RunMatcher>,
+    ending: Option<RunMatcher>,
+    phase: Phase,
+    ranges: Vec<(Duration, Duration)>,
+}
+
+impl TemplateGuide {
+    /// Returns the action to take before any audio is decoded.
+    pub(crate) fn start(&mut self) -> GuideAction {
+        if self.opening.is_none() {
+            return self.finish_head(Duration::ZERO);
+        }
+        GuideAction::Continue
+    }
+
+    /// Feeds newly computed hashes of the primary track to the guide.
+    pub(crate) fn observe(&mut self, hashes: &[(u32, Duration)]) -> GuideAction {
+        for &(hash, ts) in hashes {
+            extend_ranges(&mut self.ranges, ts, self.hash_duration);
+            match self.phase {
+                Phase::Head => {
+                    let complete = self.opening.as_mut().map_or(true, |m| m.push(hash));
+                    let window_start = ts.saturating_sub(self.hash_duration);
+                    if complete || window_start >= self.head_end {
+                        if !complete {
+                            tracing::debug!("opening not found in the head of the video");
+                        }
+                        return self.finish_head(ts);
+                    }
+                }
+                Phase::Tail => {
+                    if self.ending.as_mut().map_or(false, |m| m.push(hash)) {
+                        self.phase = Phase::Done;
+                        return GuideAction::Stop;
+                    }
+                }
+                Phase::Done => return GuideAction::Stop,
+            }
+        }
+        GuideAction::Continue
+    }
+
+    fn finish_head(&mut self, position: Duration) -> GuideAction {
+        if self.ending.is_none() {
+            self.phase = Phase::Done;
+            return GuideAction::Stop;
+        }
+        self.phase = Phase::Tail;
+        if position < self.tail_start {
+            // Start a new range once the first hash after the seek comes in.
+            self.ranges.push((Duration::MAX, Duration::ZERO));
+            GuideAction::Seek(self.tail_start)
+        } else {
+            GuideAction::Continue
+        }
+    }
+
+    /// Returns the coverage of the hashes observed so far, or `None` if the whole video was
+    /// analyzed.
+    pub(crate) fn coverage(self) -> Option<Coverage> {
+        let ranges: Vec<_> = self
+            .ranges
+            .into_iter()
+            .filter(|(start, end)| start < end)
+            .collect();
+        let is_full = self.phase != Phase::Done && ranges.len() <= 1;
+        (!is_full).then(|| Coverage {
+            duration: self.duration,
+            ranges,
+            source: CoverageSource::Template,
+        })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn hashes(start: u32, n: u32) -> Vec<u32> {
+        (start..start + n)
+            .map(|i| i.wrapping_mul(0x9e37_79b9))
+            .collect()
+    }
+
+    fn timestamped(data: &[u32], start: Duration) -> Vec<(u32, Duration)> {
+        data.iter()
+            .enumerate()
+            .map(|(i, h)| (*h, start + Duration::from_millis(300 * i as u64)))
+            .collect()
+    }
+
+    #[test]
+    fn test_run_matcher() {
+        let template = hashes(1000, 20);
+        let mut matcher = RunMatcher::new(template.clone(), 0, 0.5);
+
+        // Unrelated hashes never complete a match.
+        assert!(!hashes(0, 50).into_iter().any(|h| matcher.push(h)));
+
+        // A partial match completes once the run breaks.
+        let mut stream = template[..15].to_vec();
+        stream.extend(hashes(5000, 5));
+        let done: Vec<bool> = stream.into_iter().map(|h| matcher.push(h)).collect();
+        assert_eq!(done.iter().position(|d| *d), Some(15));
+    }
+
+    #[test]
+    fn test_template_guide() {
+        let opening = hashes(1000, 20);
+        let ending = hashes(2000, 20);
+        let template = AnalysisTemplate {
+            hash_period: 0.3,
+            hash_duration: 3.0,
+            engine: FingerprintEngine::Chromaprint,
+            opening: Some(opening.clone()),
+            ending: Some(ending.clone()),
+            hash_match_threshold: 0,
+            min_match_ratio: 0.9,
+            opening_search_percentage: 0.5,
+            ending_search_percentage: 0.25,
+        };
+        let duration = Duration::from_secs(600);
+        let mut guide = template
+            .guide(duration, 0.3, 3.0, FingerprintEngine::Chromaprint)
+            .unwrap();
+        assert_eq!(guide.start(), GuideAction::Continue);
+
+        // Intro, then the opening.
+        let mut head = hashes(0, 10);
+        head.extend(&opening);
+        head.extend(hashes(100, 10));
+        let action = guide.observe(&timestamped(&head, Duration::ZERO));
+        assert_eq!(action, GuideAction::Seek(Duration::from_secs(450)));
+
+        let mut tail = hashes(200, 10);
+        tail.extend(&ending);
+        tail.extend(hashes(300, 10));
+        let action = guide.observe(&timestamped(&tail, Duration::from_secs(449)));
+        assert_eq!(action, GuideAction::Stop);
+
+        let coverage = guide.coverage().unwrap();
+        assert_eq!(coverage.duration(), duration);
+        assert_eq!(coverage.ranges().len(), 2);
+        assert!(coverage.ranges()[0].1 < Duration::from_secs(9));
+        assert_eq!(coverage.ranges()[1].0, Duration::from_secs(446));
+    }
+}
@@ -0,0 +1,223 @@
+use std::time::{Duration, Instant};
+
+/// How often workers check whether they need to back off.
+const PACE_INTERVAL: Duration = Duration::from_millis(50);
+
+/// How often disk utilization is sampled from `/proc/diskstats`.
+const DISK_SAMPLE_INTERVAL: Duration = Duration::from_millis(250);
+
+/// How long to back off for each time the disks are found to be busy.
+const DISK_BACKOFF: Duration = Duration::from_millis(100);
+
+/// Maximum number of consecutive disk backoffs. This ensures that analysis keeps making
+/// progress even if the disks are always busy.
+const MAX_DISK_BACKOFFS: usize = 5;
+
+/// Maximum amount of time a worker sleeps at once to meet the CPU target.
+const MAX_CPU_BACKOFF: Duration = Duration::from_secs(1);
+
+/// Configuration for running analysis in the background with a low impact on the rest of
+/// the system (e.g., a media server that is streaming to users).
+///
+/// In background mode:
+///
+/// 1. On Linux, worker threads run with the lowest CPU priority and the idle I/O priority class
+/// 2. Each worker is paced so that it stays around `cpu_target` utilization
+/// 3. On Linux, workers back off when any disk is busier than `disk_busy_threshold` (based on `/proc/diskstats`)
+#[derive(Clone, Copy, Debug)]
+pub struct BackgroundConfig {
+    /// Target CPU utilization of each worker thread, from 0 (exclusive) to 1.
+    pub cpu_target: f32,
+    /// Disk utilization, from 0 to 1, above which workers yield I/O to other processes.
+    pub disk_busy_threshold: f32,
+    /// Maximum number of worker threads to use.
+    pub max_workers: usize,
+}
+
+impl Default for BackgroundConfig {
+    fn default() -> Self {
+        let num_cpus = std::thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1);
+        Self {
+            cpu_target: 0.5,
+            disk_busy_threshold: 0.6,
+            max_workers: usize::max(1, num_cpus / 2),
+        }
+    }
+}
+
+/// Lowers the CPU and I/O priority of the calling thread.
+///
+/// Note that the priority cannot be raised back without elevated privileges, so this should only
+/// be called on threads that are dedicated to background work.
+pub(crate) fn lower_current_thread_priority() {
+    #[cfg(target_os = "linux")]
+    {
+        // Linux-specific ioprio constants (see `ioprio_set(2)`).
+        const IOPRIO_WHO_PROCESS: libc::c_int = 1;
+        const IOPRIO_CLASS_IDLE: libc::c_int = 3;
+        const IOPRIO_CLASS_SHIFT: libc::c_int = 13;
+
+        // SAFETY: These syscalls only affect the scheduling of the calling thread.
+        unsafe {
+            let tid = libc::syscall(libc::SYS_gettid) as libc::id_t;
+            if libc::setpriority(libc::PRIO_PROCESS, tid, 19) != 0 {
+                tracing::warn!("failed to lower CPU priority of worker thread");
+            }
+            if libc::syscall(
+                libc::SYS_ioprio_set,
+                IOPRIO_WHO_PROCESS,
+                tid,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT,
+            ) != 0
+            {
+                tracing::warn!("failed to lower I/O priority of worker thread");
+            }
+        }
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    tracing::debug!("thread priorities are only adjusted on Linux");
+}
+
+/// Returns the CPU time consumed by the calling thread.
+fn thread_cpu_time() -> Option<Duration> {
+    #[cfg(unix)]
+    {
+        let mut ts = libc::timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        };
+        // SAFETY: `ts` is a valid timespec that outlives the call.
+        let ret = unsafe { libc::clock_gettime(libc::CLOCK_THREAD_CPUTIME_ID, &mut ts) };
+        if ret != 0 {
+            return None;
+        }
+        Some(Duration::new(ts.tv_sec as u64, ts.tv_nsec as u32))
+    }
+
+    #[cfg(not(unix))]
+    None
+}
+
+/// Tracks utilization of block devices using `/proc/diskstats`.
+struct DiskMonitor {
+    last_sample: Instant,
+    // Sum of "time spent doing I/Os" (ms) per device.
+    last_io_ticks: Vec<(String, u64)>,
+    utilization: f32,
+}
+
+impl DiskMonitor {
+    fn new() -> Option<Self> {
+        let io_ticks = Self::read_io_ticks()?;
+        Some(Self {
+            last_sample: Instant::now(),
+            last_io_ticks: io_ticks,
+            utilization: 0.0,
+        })
+    }
+
+    fn read_io_ticks() -> Option<Vec<(String, u64)>> {
+        let stats = std::fs::read_to_string("/proc/diskstats").ok()?;
+        let io_ticks = stats
+            .lines()
+            .filter_map(|line| {
+                let fields: Vec<&str> = line.split_whitespace().collect();
+                let name = *fields.get(2)?;
+                // Skip virtual devices that never contend with real disks.
+                if ["loop", "ram", "zram", "sr", "fd"]
+                    .iter()
+                    .any(|prefix| name.starts_with(prefix))
+                {
+                    return None;
+                }
+                let io_ticks = fields.get(12)?.parse().ok()?;
+                Some((name.to_owned(), io_ticks))
+            })
+            .collect();
+        Some(io_ticks)
+    }
+
+    /// Returns the utilization (0 to 1) of the busiest device.
+    fn utilization(&mut self) -> f32 {
+        let elapsed = self.last_sample.elapsed();
+        if elapsed < DISK_SAMPLE_INTERVAL {
+            return self.utilization;
+        }
+
+        if let Some(io_ticks) = Self::read_io_ticks() {
+            let elapsed_ms = elapsed.as_millis() as f32;
+            self.utilization = io_ticks
+                .iter()
+                .filter_map(|(name, ticks)| {
+                    let (_, last_ticks) = self.last_io_ticks.iter().find(|(n, _)| n == name)?;
+                    Some(ticks.saturating_sub(*last_ticks) as f32 / elapsed_ms)
+                })
+                .fold(0.0, f32::max)
+                .min(1.0);
+            self.last_io_ticks = io_ticks;
+        }
+        self.last_sample = Instant::now();
+
+        self.utilization
+    }
+}
+
+/// Paces a worker thread according to a [BackgroundConfig].
+///
+/// Workers are expected to call [Pacer::pace] frequently (e.g., once per packet). The pacer
+/// sleeps whenever the thread used more CPU than its target, or whenever the disks are busy.
+pub(crate) struct Pacer {
+    config: BackgroundConfig,
+    last_check: Instant,
+    last_cpu_time: Option<Duration>,
+    disk_monitor: Option<DiskMonitor>,
+}
+
+impl Pacer {
+    pub(crate) fn new(config: BackgroundConfig) -> Self {
+        Self {
+            config,
+            last_check: Instant::now(),
+            last_cpu_time: thread_cpu_time(),
+            disk_monitor: DiskMonitor::new(),
+        }
+    }
+
+    pub(crate) fn pace(&mut self) {
+        let wall = self.last_check.elapsed();
+        if wall < PACE_INTERVAL {
+            return;
+        }
+
+        // If the thread CPU time is not available, assume that the worker was busy the
+        // whole time.
+        let cpu_time = thread_cpu_time();
+        let cpu = match (cpu_time, self.last_cpu_time) {
+            (Some(now), Some(last)) => now.saturating_sub(last),
+            _ => wall,
+        };
+
+        // Sleep long enough to bring utilization over this interval down to the target.
+        let cpu_target = self.config.cpu_target.clamp(0.01, 1.0);
+        let budget = cpu.div_f32(cpu_target);
+        let backoff = budget.saturating_sub(wall).min(MAX_CPU_BACKOFF);
+        if !backoff.is_zero() {
+            std::thread::sleep(backoff);
+        }
+
+        if let Some(disk_monitor) = &mut self.disk_monitor {
+            for _ in 0..MAX_DISK_BACKOFFS {
+                if disk_monitor.utilization() < self.config.disk_busy_threshold {
+                    break;
+                }
+                std::thread::sleep(DISK_BACKOFF);
+            }
+        }
+
+        self.last_check = Instant::now();
+        self.last_cpu_time = thread_cpu_time();
+    }
+}
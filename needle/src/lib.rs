@@ -110,6 +110,10 @@ use std::path::PathBuf;
 
 /// Detects opening and endings across videos using just audio streams.
 pub mod audio;
+/// Helpers for running analysis with a low impact on the rest of the system.
+pub mod background;
+/// Low-overhead timers for the stages of analysis and search.
+pub mod timing;
 /// Common utility functions.
 pub mod util;
 #[cfg(feature = "video")]
@@ -122,12 +126,31 @@ pub enum Error {
     /// Frame hash data was not found on disk.
     #[error("frame hash data not found at: {0:?}")]
     FrameHashDataNotFound(PathBuf),
+    /// Frame hash data was written using a format version that is not supported by this version
+    /// of needle. The video needs to be analyzed again.
+    #[error("frame hash data at {0:?} uses unsupported format version {1}, re-analyze the video")]
+    FrameHashDataUnsupported(PathBuf, u32),
     /// No paths were provided to the [crate::audio::Analyzer].
     #[error("no paths provided to analyzer")]
     AnalyzerMissingPaths,
     /// Invalid path.
     #[error("path does not exist: {0:?}")]
     PathNotFound(PathBuf),
+    /// Analysis of a video was stopped because it exceeded one of the configured [crate::audio::AnalyzerLimits].
+    #[error("analysis of {0:?} stopped after exceeding the {1}")]
+    AnalyzerLimitExceeded(PathBuf, crate::audio::AnalyzerLimit),
+    /// Frame hash data cannot be derived with the requested settings.
+    #[error("cannot rehash frame hash data: {0}")]
+    RehashUnsupported(String),
+    /// No opening or ending is known for the reference video of an [crate::audio::AnalysisTemplate].
+    #[error("no opening or ending found for template video: {0:?}")]
+    TemplateUnavailable(PathBuf),
+    /// Frame hash data cannot be added to or queried against a [crate::audio::LibraryIndex].
+    #[error("frame hash data does not match the library index: {0}")]
+    LibraryIndexMismatch(String),
+    /// No opening or ending is known for the reference video that results are transferred from.
+    #[error("no opening or ending found for reference video: {0:?}")]
+    TransferSourceUnavailable(PathBuf),
     /// Wraps [ffmpeg_next::Error].
     #[error("FFmpeg error: {0}")]
     FFmpegError(#[from] ffmpeg_next::Error),
@@ -1,9 +1,11 @@
 use std::path::PathBuf;
-use std::time::Duration;
+use std::time::{Duration, Instant};
 
 use clap::{ArgAction, CommandFactory, ErrorKind, Parser, Subcommand};
 
 use needle::audio;
+use needle::background::BackgroundConfig;
+use needle::timing::TimingSummary;
 #[cfg(feature = "video")]
 use needle::video;
 
@@ -14,6 +16,36 @@ enum Mode {
     Video,
 }
 
+#[derive(clap::ValueEnum, Clone, Debug)]
+enum OnLimit {
+    Truncate,
+    Skip,
+}
+
+impl From<&OnLimit> for audio::LimitAction {
+    fn from(on_limit: &OnLimit) -> Self {
+        match on_limit {
+            OnLimit::Truncate => audio::LimitAction::Truncate,
+            OnLimit::Skip => audio::LimitAction::Skip,
+        }
+    }
+}
+
+#[derive(clap::ValueEnum, Clone, Debug)]
+enum FingerprintEngine {
+    Chromaprint,
+    BandEnergy,
+}
+
+impl From<&FingerprintEngine> for audio::FingerprintEngine {
+    fn from(engine: &FingerprintEngine) -> Self {
+        match engine {
+            FingerprintEngine::Chromaprint => audio::FingerprintEngine::Chromaprint,
+            FingerprintEngine::BandEnergy => audio::FingerprintEngine::BandEnergy,
+        }
+    }
+}
+
 #[derive(Debug, Subcommand)]
 enum Commands {
     #[clap(after_help = "Displays info about needle and its dependencies.")]
@@ -66,6 +98,119 @@ enum Commands {
             help = "Re-analyze all videos and ignore any existing hash data on disk."
         )]
         force: bool,
+
+        #[clap(
+            long,
+            value_parser = clap::value_parser!(f32),
+            help = "Maximum time to spend analyzing a single video, in seconds. By default, there is no limit."
+        )]
+        max_wall_time: Option<f32>,
+
+        #[clap(
+            long,
+            value_parser = clap::value_parser!(f32),
+            help = "Maximum duration of audio to decode for a single video, in seconds. By default, there is no limit."
+        )]
+        max_audio_duration: Option<f32>,
+
+        #[clap(
+            long,
+            value_parser = clap::value_parser!(u64),
+            help = "Maximum number of packets to read from a single video. By default, there is no limit."
+        )]
+        max_packets: Option<u64>,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Read audio packets directly from the file using the container's index instead of demuxing the whole file. This can cut the amount of data read by an order of magnitude. Currently only supported for MP4/MOV files."
+        )]
+        sparse_reads: bool,
+
+        #[clap(
+            long,
+            default_value_t = 1,
+            value_parser = clap::value_parser!(u8).range(1..),
+            help = "Maximum number of audio tracks to analyze per video. The best audio track is always analyzed; additional tracks (e.g., a dub in another language) are analyzed in the same pass over the file. During search, tracks with a matching language are compared."
+        )]
+        audio_tracks: u8,
+
+        #[clap(
+            long,
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Reference episode of the same show to use as a template. The reference must already have been analyzed and searched. While decoding, hashes are matched against the opening and ending of the reference, and any audio in between is skipped. This makes analysis of new episodes much faster, but the resulting hash data only covers parts of each video."
+        )]
+        template: Option<PathBuf>,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Only fingerprint music-like stretches of audio (plus a few seconds on either side). Openings and endings are music, so skipping dialogue saves a lot of work on dialogue-heavy shows and reduces false matches."
+        )]
+        music_prescreen: bool,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Read the ASS/SSA subtitle track of each video first. If the opening or ending is explicitly labelled, only the audio around its lines is decoded; the other song is still searched for in its whole search window. Videos without labelled songs are analyzed in full. Ignored when a template is used."
+        )]
+        subtitle_hints: bool,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Read the chapters of each video. Videos with chapters named after both the opening and the ending (e.g., \"Opening\" and \"ED\") are not decoded at all."
+        )]
+        chapters: bool,
+
+        #[clap(long, value_enum, default_value_t = FingerprintEngine::Chromaprint, help = "Algorithm used to hash audio. 'band-energy' is an experimental alternative to 'chromaprint' that is less accurate. Both engines decode the audio in full, so neither is much faster than the other overall. Videos analyzed with different engines are never compared with each other.")]
+        fingerprint_engine: FingerprintEngine,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Configure audio decoders for fingerprinting rather than listening: surround audio is downmixed by the decoder, and quality-only processing (dynamic range compression, lossless extensions, parametric stereo) is skipped where supported. Hashes are nearly identical to those of a full decode."
+        )]
+        fast_decode: bool,
+
+        #[clap(
+            long,
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Directory to cache decoded audio in. Audio is stored as low rate mono PCM (about 80 MB per hour of video). When a video has to be analyzed again, e.g. with a different --hash-period or --fingerprint-engine, its hashes are rebuilt from the cache instead of decoding the video. By default, no audio is cached."
+        )]
+        pcm_cache: Option<PathBuf>,
+
+        #[clap(
+            long,
+            default_value_t = audio::DEFAULT_PCM_CACHE_BUDGET_MB,
+            value_parser = clap::value_parser!(u64),
+            help = "Maximum size of the audio cache, in MiB. Once the cache grows past this size, the least recently used entries are evicted."
+        )]
+        pcm_cache_budget: u64,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Run in background mode. This lowers the CPU and I/O priority of the analysis, uses at most half of the available cores, and backs off whenever the disks are busy. Useful when running on a machine that is also serving media."
+        )]
+        background: bool,
+
+        #[clap(
+            long,
+            default_value_t = 50,
+            value_parser = clap::value_parser!(u8).range(1..=100),
+            help = "Target CPU utilization (in percent) of each worker thread in background mode."
+        )]
+        background_cpu_target: u8,
+
+        #[clap(long, value_enum, default_value_t = OnLimit::Truncate, help = "What to do when a video hits one of the --max-* limits. 'truncate' keeps the hash data computed so far and marks it as truncated, while 'skip' discards the video and reports an error.")]
+        on_limit: OnLimit,
     },
 
     #[clap(
@@ -168,6 +313,195 @@ enum Commands {
             help = "If set, needle will only search for openings."
         )]
         openings_only: bool,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Detect near-duplicate videos (e.g., two releases of the same episode) before searching. Only one video of each group of duplicates is searched, and its result is mapped onto the others. See the 'dedup' command."
+        )]
+        detect_duplicates: bool,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Accept the opening and ending found in the subtitles of a video (see 'analyze --subtitle-hints') without searching it, if the subtitles explicitly label them."
+        )]
+        subtitle_hints: bool,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Use the chapters of each video (see 'analyze --chapters'): chapters named after the opening and ending are accepted without searching, the search windows are narrowed to nearby chapter boundaries, and reported times are moved onto nearby chapter boundaries."
+        )]
+        chapters: bool,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Print the comparison plan before searching. The plan lists which pairs of videos are compared, the search engine used for each pair, the number of threads, and the estimated time and memory usage."
+        )]
+        explain_plan: bool,
+    },
+
+    #[clap(
+        arg_required_else_help = true,
+        after_help = "Derive frame hash data with a coarser hash period from existing frame hash data, without decoding the videos again. The frame hash data on disk is replaced. Note that changing the hash duration requires re-analyzing the videos."
+    )]
+    Rehash {
+        #[clap(
+            required = true,
+            multiple_values = true,
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Video files or directories to rehash."
+        )]
+        paths: Vec<PathBuf>,
+
+        #[clap(
+            long,
+            value_parser = clap::value_parser!(f32),
+            help = "New period between hashes, in seconds. Must not be smaller than the period the videos were analyzed with."
+        )]
+        hash_period: f32,
+    },
+
+    #[clap(
+        arg_required_else_help = true,
+        after_help = "Find near-duplicate videos, such as a TV rip and a Blu-ray release of the same episode, using existing frame hash data. Prints each group of duplicates along with the segments each duplicate has in common with the first video of its group."
+    )]
+    Dedup {
+        #[clap(
+            required = true,
+            multiple_values = true,
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Video files or directories to check for duplicates. Videos must have been analyzed first."
+        )]
+        paths: Vec<PathBuf>,
+
+        #[clap(
+            long,
+            default_value_t = audio::DEFAULT_HASH_MATCH_THRESHOLD,
+            value_parser = clap::value_parser!(u16),
+            help = "Threshold to use when comparing hashes. The range is 0 (exact match) to 32 (no match).",
+        )]
+        hash_match_threshold: u16,
+
+        #[clap(
+            long,
+            default_value_t = audio::DEFAULT_DUPLICATE_COVERAGE,
+            value_parser = clap::value_parser!(f32),
+            help = "Minimum fraction of each video that has to be covered by common audio for two videos to be duplicates."
+        )]
+        min_coverage: f32,
+    },
+
+    #[clap(
+        arg_required_else_help = true,
+        after_help = "Transfer the opening and ending of a video to other releases of the same video (e.g., an extended cut, or a PAL release) without searching them. The audio of each release is aligned with the reference video, allowing for cuts and a constant difference in speed. The reference video needs a skip file, and all videos must have been analyzed first."
+    )]
+    Transfer {
+        #[clap(
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Video with a known opening and ending, i.e., with a skip file."
+        )]
+        reference: PathBuf,
+
+        #[clap(
+            required = true,
+            multiple_values = true,
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Video files or directories to transfer the opening and ending to."
+        )]
+        paths: Vec<PathBuf>,
+
+        #[clap(
+            long,
+            default_value_t = audio::DEFAULT_HASH_MATCH_THRESHOLD,
+            value_parser = clap::value_parser!(u16),
+            help = "Threshold to use when comparing hashes. The range is 0 (exact match) to 32 (no match).",
+        )]
+        hash_match_threshold: u16,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Write skip files for the videos that the opening or ending was transferred to."
+        )]
+        write_skip_files: bool,
+
+        #[clap(
+            long,
+            default_value = "false",
+            action(ArgAction::SetTrue),
+            help = "Do not display the transferred results in stdout."
+        )]
+        no_display: bool,
+    },
+
+    #[clap(
+        arg_required_else_help = true,
+        after_help = "Add the frame hash data of one or more analyzed videos to a library index. The index is updated incrementally: only new or changed videos are added, and videos that no longer exist are dropped. The index is used by the 'query' command."
+    )]
+    Index {
+        #[clap(
+            required = true,
+            multiple_values = true,
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Video files or directories to index. Videos must have been analyzed first."
+        )]
+        paths: Vec<PathBuf>,
+
+        #[clap(
+            long,
+            default_value = audio::DEFAULT_LIBRARY_INDEX_PATH,
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Path of the library index."
+        )]
+        index: PathBuf,
+    },
+
+    #[clap(
+        arg_required_else_help = true,
+        after_help = "Find every occurrence of a segment of an analyzed video across a library index (see the 'index' command), e.g. to find recaps, reused music or commercials. Prints the path of each matching video along with the start and end of the occurrence, in milliseconds."
+    )]
+    Query {
+        #[clap(
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Analyzed video that contains the segment."
+        )]
+        file: PathBuf,
+
+        #[clap(
+            value_parser = clap::value_parser!(f32),
+            help = "Start of the segment, in seconds."
+        )]
+        start: f32,
+
+        #[clap(
+            value_parser = clap::value_parser!(f32),
+            help = "End of the segment, in seconds."
+        )]
+        end: f32,
+
+        #[clap(
+            long,
+            default_value = audio::DEFAULT_LIBRARY_INDEX_PATH,
+            value_parser = clap::value_parser!(PathBuf),
+            help = "Path of the library index."
+        )]
+        index: PathBuf,
+
+        #[clap(
+            long,
+            default_value_t = audio::DEFAULT_HASH_MATCH_THRESHOLD,
+            value_parser = clap::value_parser!(u16),
+            help = "Threshold to use when comparing hashes. The range is 0 (exact match) to 32 (no match).",
+        )]
+        hash_match_threshold: u16,
     },
 }
 
@@ -204,6 +538,8 @@ impl Cli {
             Commands::Analyze {
                 hash_period,
                 hash_duration,
+                max_wall_time,
+                max_audio_duration,
                 ..
             } => {
                 if hash_period <= 0.0 {
@@ -220,6 +556,20 @@ impl Cli {
                     )
                     .exit();
                 }
+                if max_wall_time.map_or(false, |t| t <= 0.0) {
+                    cmd.error(
+                        ErrorKind::InvalidValue,
+                        "max_wall_time must be a positive number",
+                    )
+                    .exit();
+                }
+                if max_audio_duration.map_or(false, |t| t <= 0.0) {
+                    cmd.error(
+                        ErrorKind::InvalidValue,
+                        "max_audio_duration must be a positive number",
+                    )
+                    .exit();
+                }
             }
             Commands::Search {
                 opening_search_percentage,
@@ -249,9 +599,105 @@ impl Cli {
                     .exit();
                 }
             }
+            Commands::Rehash { hash_period, .. } => {
+                if hash_period <= 0.0 {
+                    cmd.error(
+                        ErrorKind::InvalidValue,
+                        "hash_period must be a positive number",
+                    )
+                    .exit();
+                }
+            }
+            Commands::Dedup {
+                hash_match_threshold,
+                min_coverage,
+                ..
+            } => {
+                if hash_match_threshold > 32 {
+                    cmd.error(
+                        ErrorKind::InvalidValue,
+                        "hash_match_threshold cannot be larger than 32",
+                    )
+                    .exit();
+                }
+                if min_coverage <= 0.0 || min_coverage > 1.0 {
+                    cmd.error(
+                        ErrorKind::InvalidValue,
+                        "min_coverage must be in the range (0, 1]",
+                    )
+                    .exit();
+                }
+            }
+            Commands::Transfer {
+                hash_match_threshold,
+                ..
+            } => {
+                if hash_match_threshold > 32 {
+                    cmd.error(
+                        ErrorKind::InvalidValue,
+                        "hash_match_threshold cannot be larger than 32",
+                    )
+                    .exit();
+                }
+            }
+            Commands::Index { .. } => (),
+            Commands::Query {
+                start,
+                end,
+                hash_match_threshold,
+                ..
+            } => {
+                if start < 0.0 || end <= start {
+                    cmd.error(
+                        ErrorKind::InvalidValue,
+                        "start must be a non-negative number that is smaller than end",
+                    )
+                    .exit();
+                }
+                if hash_match_threshold > 32 {
+                    cmd.error(
+                        ErrorKind::InvalidValue,
+                        "hash_match_threshold cannot be larger than 32",
+                    )
+                    .exit();
+                }
+            }
         }
     }
 
+    // Loads the frame hash data of all videos in `paths`, sorted by path. Videos whose data cannot
+    // be loaded are reported and skipped.
+    fn load_analyzed_video_files(
+        &self,
+        paths: &[PathBuf],
+        timings: &mut TimingSummary,
+    ) -> Vec<(PathBuf, audio::FrameHashes)> {
+        let videos = match needle::util::load_analyzed_video_files(
+            paths,
+            !self.file_headers_only,
+            !cfg!(feature = "video"),
+            timings,
+        ) {
+            Err(e) => {
+                let mut cmd = Cli::command();
+                cmd.error(ErrorKind::InvalidValue, e.to_string()).exit();
+            }
+            Ok(v) => v,
+        };
+        let mut videos: Vec<_> = videos
+            .into_iter()
+            .filter_map(|(video, frame_hashes)| match frame_hashes {
+                Ok(frame_hashes) => Some((video, frame_hashes)),
+                Err(e) => {
+                    println!("Skipping {} ({})...", video.display(), e);
+                    None
+                }
+            })
+            .collect();
+        videos.sort_by(|a, b| a.0.cmp(&b.0));
+        videos
+    }
+
     fn find_video_files(&self, paths: &[PathBuf]) -> Vec<PathBuf> {
         match needle::util::find_video_files(
             paths,
@@ -274,11 +720,21 @@ fn main() -> needle::Result<()> {
 
     tracing::subscriber::set_global_default(subscriber).expect("setting default subscriber failed");
 
-    ffmpeg_next::init().unwrap();
-
     let args = Cli::parse();
     args.validate();
 
+    // FFmpeg is only needed to analyze or probe videos. Searching videos that were already
+    // analyzed only needs their frame hash data, so FFmpeg is initialized on demand in that case.
+    match args.command {
+        Commands::Search { analyze: false, .. }
+        | Commands::Rehash { .. }
+        | Commands::Dedup { .. }
+        | Commands::Transfer { .. }
+        | Commands::Index { .. }
+        | Commands::Query { .. } => (),
+        _ => needle::util::init_ffmpeg(),
+    }
+
     match args.command {
         Commands::Analyze {
             ref mode,
@@ -286,13 +742,78 @@ fn main() -> needle::Result<()> {
             hash_duration,
             threaded_decoding,
             force,
+            max_wall_time,
+            max_audio_duration,
+            max_packets,
+            ref on_limit,
+            background,
+            background_cpu_target,
+            sparse_reads,
+            audio_tracks,
+            ref template,
+            music_prescreen,
+            subtitle_hints,
+            chapters,
+            ref fingerprint_engine,
+            fast_decode,
+            ref pcm_cache,
+            pcm_cache_budget,
             ref paths,
         } => match mode {
             Mode::Audio => {
                 let mut videos = args.find_video_files(paths);
                 videos.sort();
-                let analyzer = audio::Analyzer::from_files(videos, threaded_decoding, force);
-                analyzer.run(hash_period, hash_duration, true, !args.no_threading)?;
+                let template = template
+                    .as_ref()
+                    .map(audio::AnalysisTemplate::from_video)
+                    .transpose()?;
+                let pcm_cache = pcm_cache
+                    .as_ref()
+                    .map(|dir| audio::PcmCache::new(dir, pcm_cache_budget << 20))
+                    .transpose()?;
+                let limits = audio::AnalyzerLimits {
+                    max_wall_time: max_wall_time.map(Duration::from_secs_f32),
+                    max_audio_duration: max_audio_duration.map(Duration::from_secs_f32),
+                    max_packets,
+                    action: on_limit.into(),
+                };
+                let background = background.then(|| BackgroundConfig {
+                    cpu_target: background_cpu_target as f32 / 100.0,
+                    ..Default::default()
+                });
+                let analyzer = audio::Analyzer::from_files(videos, threaded_decoding, force)
+                    .with_limits(limits)
+                    .with_background(background)
+                    .with_sparse_reads(sparse_reads)
+                    .with_audio_tracks(audio_tracks as usize)
+                    .with_template(template)
+                    .with_music_prescreen(music_prescreen)
+                    .with_subtitle_hints(subtitle_hints)
+                    .with_chapters(chapters)
+                    .with_fingerprint_engine(fingerprint_engine.into())
+                    .with_fast_decode(fast_decode)
+                    .with_pcm_cache(pcm_cache);
+                // Results are written to disk, so there is no need to keep them around.
+                let started = Instant::now();
+                let mut summary = audio::AnalyzerSummary::default();
+                analyzer.run_streaming(
+                    hash_period,
+                    hash_duration,
+                    true,
+                    !args.no_threading,
+                    audio::OutputOrder::Completion,
+                    |idx, result| {
+                        let path = analyzer.videos()[idx].clone();
+                        summary.record(path, result);
+                    },
+                )?;
+                summary.elapsed = started.elapsed();
+                summary.stages = analyzer.timings();
+                print!("\n{}", summary);
+                // Failed videos are listed in the summary, but scripts only see the exit status.
+                if !summary.failed.is_empty() {
+                    std::process::exit(1);
+                }
             }
             #[cfg(feature = "video")]
             Mode::Video => {
@@ -313,10 +834,28 @@ fn main() -> needle::Result<()> {
             write_skip_files,
             time_padding,
             openings_only,
+            detect_duplicates,
+            subtitle_hints,
+            chapters,
+            explain_plan,
             ref paths,
         } => {
-            let mut videos = args.find_video_files(paths);
-            videos.sort();
+            // Without --analyze, videos that have up-to-date frame hash data are not opened at all.
+            let mut timings = TimingSummary::default();
+            let mut videos: Vec<(PathBuf, Option<audio::FrameHashes>)> = if analyze {
+                args.find_video_files(paths)
+                    .into_iter()
+                    .map(|video| (video, None))
+                    .collect()
+            } else {
+                // Videos without usable frame hash data are skipped instead of failing the whole
+                // search.
+                args.load_analyzed_video_files(paths, &mut timings)
+                    .into_iter()
+                    .map(|(video, frame_hashes)| (video, Some(frame_hashes)))
+                    .collect()
+            };
+            videos.sort_by(|a, b| a.0.cmp(&b.0));
             if videos.len() < 2 {
                 let mut cmd = Cli::command();
                 cmd.error(
@@ -331,6 +870,9 @@ fn main() -> needle::Result<()> {
             let min_opening_duration = Duration::from_secs(min_opening_duration.into());
             let min_ending_duration = Duration::from_secs(min_ending_duration.into());
             let time_padding = Duration::from_secs_f32(time_padding);
+            let (videos, frame_hashes): (Vec<_>, Vec<_>) = videos.into_iter().unzip();
+            // Frame hash data is only used as-is if it was found for every video.
+            let frame_hashes: Option<Vec<_>> = frame_hashes.into_iter().collect();
             let comparator = audio::Comparator::from_files(videos)
                 .with_openings_only(openings_only)
                 .with_hash_match_threshold(hash_match_threshold as u32)
@@ -338,15 +880,146 @@ fn main() -> needle::Result<()> {
                 .with_ending_search_percentage(ending_search_percentage)
                 .with_min_opening_duration(min_opening_duration)
                 .with_min_ending_duration(min_ending_duration)
-                .with_time_padding(time_padding);
-            comparator.run(
-                analyze,
+                .with_time_padding(time_padding)
+                .with_duplicate_detection(detect_duplicates)
+                .with_subtitle_hints(subtitle_hints)
+                .with_chapters(chapters)
+                .with_explain_plan(explain_plan);
+            match frame_hashes {
+                Some(frame_hashes) => comparator.run_with_frame_hashes(
+                    frame_hashes,
+                    !no_display,
+                    use_skip_files,
+                    write_skip_files,
+                    !args.no_threading,
+                )?,
+                None => comparator.run(
+                    analyze,
+                    !no_display,
+                    use_skip_files,
+                    write_skip_files,
+                    !args.no_threading,
+                )?,
+            };
+            if !no_display {
+                timings.merge(&comparator.timings());
+                print!("\n{}", timings);
+            }
+        }
+        Commands::Rehash {
+            hash_period,
+            ref paths,
+        } => {
+            let videos = args.load_analyzed_video_files(paths, &mut Default::default());
+            for (video, frame_hashes) in videos {
+                match frame_hashes.rehash(hash_period, frame_hashes.hash_duration()) {
+                    Ok(rehashed) => {
+                        rehashed.save_for_video(&video)?;
+                        println!("Rehashed {}", video.display());
+                    }
+                    Err(e) => println!("Skipping {} ({})...", video.display(), e),
+                }
+            }
+        }
+        Commands::Dedup {
+            hash_match_threshold,
+            min_coverage,
+            ref paths,
+        } => {
+            let (videos, frame_hashes): (Vec<_>, Vec<_>) = args
+                .load_analyzed_video_files(paths, &mut Default::default())
+                .into_iter()
+                .unzip();
+            let groups = audio::DuplicateDetector::default()
+                .with_hash_match_threshold(hash_match_threshold as u32)
+                .with_min_coverage(min_coverage)
+                .run(&frame_hashes);
+            if groups.is_empty() {
+                println!("No duplicates found.");
+            }
+            for group in groups {
+                println!("\n{}\n", videos[group.reference].display());
+                for duplicate in group.duplicates {
+                    println!(
+                        "* Duplicate - {} ({:.0}% coverage)",
+                        videos[duplicate.video].display(),
+                        duplicate.alignment.coverage * 100.0
+                    );
+                    for segment in duplicate.alignment.segments {
+                        println!(
+                            "  * {}-{} -> {}-{}",
+                            needle::util::format_time(segment.reference_start),
+                            needle::util::format_time(segment.reference_start + segment.duration),
+                            needle::util::format_time(segment.other_start),
+                            needle::util::format_time(segment.other_start + segment.duration),
+                        );
+                    }
+                }
+            }
+        }
+        Commands::Transfer {
+            hash_match_threshold,
+            write_skip_files,
+            no_display,
+            ref reference,
+            ref paths,
+        } => {
+            // The same file can be reached through different paths (e.g., `./ep1.mkv` and
+            // `ep1.mkv`), so paths are compared in canonical form.
+            let canonical = |path: &PathBuf| std::fs::canonicalize(path).unwrap_or(path.clone());
+            let canonical_reference = canonical(reference);
+            let (videos, frame_hashes): (Vec<_>, Vec<_>) = args
+                .load_analyzed_video_files(paths, &mut Default::default())
+                .into_iter()
+                .filter(|(video, _)| canonical(video) != canonical_reference)
+                .unzip();
+            let comparator = audio::Comparator::from_files(videos)
+                .with_hash_match_threshold(hash_match_threshold as u32);
+            comparator.run_transfer_with_frame_hashes(
+                reference,
+                frame_hashes,
                 !no_display,
-                use_skip_files,
                 write_skip_files,
-                !args.no_threading,
             )?;
         }
+        Commands::Index {
+            ref index,
+            ref paths,
+        } => {
+            let videos = args.load_analyzed_video_files(paths, &mut Default::default());
+            let mut library = audio::LibraryIndex::load(index)?;
+            let summary = library.update(videos);
+            library.save(index)?;
+            print!("{}", summary);
+        }
+        Commands::Query {
+            ref file,
+            start,
+            end,
+            ref index,
+            hash_match_threshold,
+        } => {
+            let frame_hashes = audio::FrameHashes::from_video(file, false)?;
+            let library = audio::LibraryIndex::load(index)?;
+            let matches = library.query(
+                file,
+                &frame_hashes,
+                Duration::from_secs_f32(start),
+                Duration::from_secs_f32(end),
+                hash_match_threshold as u32,
+            )?;
+            if matches.is_empty() {
+                println!("No matches found.");
+            }
+            for m in matches {
+                println!(
+                    "{}\t{}\t{}",
+                    m.path().display(),
+                    m.start().as_millis(),
+                    m.end().as_millis()
+                );
+            }
+        }
         Commands::Info => {
             println!("FFmpeg version: {}", needle::util::ffmpeg_version_string());
         }
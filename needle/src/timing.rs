@@ -0,0 +1,225 @@
+use std::fmt::Display;
+use std::time::{Duration, Instant};
+
+/// Number of [Stage] variants.
+const NUM_STAGES: usize = 10;
+
+/// A stage of analysis or search that is timed separately.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Stage {
+    /// Opening a video and probing its streams (including computing its MD5 hashes and reading
+    /// subtitle hints).
+    Open,
+    /// Reading audio packets from a video.
+    Demux,
+    /// Decoding audio packets.
+    Decode,
+    /// Resampling decoded audio for fingerprinting.
+    Resample,
+    /// Computing hashes from resampled audio.
+    Fingerprint,
+    /// Writing frame hash data to disk.
+    HashWrite,
+    /// Loading frame hash data from disk.
+    HashLoad,
+    /// Searching a pair of videos for common openings and endings.
+    PairSearch,
+    /// Picking the best opening and ending of a video among its matches.
+    CandidateSelection,
+    /// Writing skip files to disk.
+    SkipFileWrite,
+}
+
+impl Stage {
+    const ALL: [Stage; NUM_STAGES] = [
+        Stage::Open,
+        Stage::Demux,
+        Stage::Decode,
+        Stage::Resample,
+        Stage::Fingerprint,
+        Stage::HashWrite,
+        Stage::HashLoad,
+        Stage::PairSearch,
+        Stage::CandidateSelection,
+        Stage::SkipFileWrite,
+    ];
+}
+
+impl Display for Stage {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        let name = match self {
+            Stage::Open => "open/probe",
+            Stage::Demux => "demux",
+            Stage::Decode => "decode",
+            Stage::Resample => "resample",
+            Stage::Fingerprint => "fingerprint",
+            Stage::HashWrite => "hash write",
+            Stage::HashLoad => "hash load",
+            Stage::PairSearch => "pair search",
+            Stage::CandidateSelection => "candidate selection",
+            Stage::SkipFileWrite => "skip file write",
+        };
+        f.pad(name)
+    }
+}
+
+/// Time spent in each [Stage] while processing a single item (e.g., a video).
+///
+/// This is a plain array of durations, so timing a stage only costs two reads of the monotonic
+/// clock.
+#[derive(Clone, Copy, Debug, Default)]
+pub(crate) struct StageTimes([Duration; NUM_STAGES]);
+
+impl StageTimes {
+    pub(crate) fn add(&mut self, stage: Stage, duration: Duration) {
+        self.0[stage as usize] += duration;
+    }
+
+    /// Runs `f` and adds the time it took to `stage`.
+    pub(crate) fn time<T>(&mut self, stage: Stage, f: impl FnOnce() -> T) -> T {
+        let started = Instant::now();
+        let result = f();
+        self.add(stage, started.elapsed());
+        result
+    }
+
+    pub(crate) fn merge(&mut self, other: &StageTimes) {
+        for (total, duration) in self.0.iter_mut().zip(other.0) {
+            *total += duration;
+        }
+    }
+}
+
+/// Per-stage timings collected over a run of an [Analyzer](crate::audio::Analyzer) or
+/// [Comparator](crate::audio::Comparator).
+///
+/// Each stage holds one sample per item that went through it: one per video for analysis stages,
+/// and one per pair of videos for [Stage::PairSearch]. The [Display] implementation prints the
+/// total and percentiles of each stage, which shows at a glance whether a run is bound by I/O,
+/// decoding, or comparisons.
+#[derive(Clone, Debug, Default)]
+pub struct TimingSummary {
+    samples: [Vec<Duration>; NUM_STAGES],
+}
+
+impl TimingSummary {
+    /// Adds a sample to the given stage.
+    pub fn record(&mut self, stage: Stage, duration: Duration) {
+        self.samples[stage as usize].push(duration);
+    }
+
+    /// Adds the times of a single item. Stages that the item did not go through are ignored.
+    pub(crate) fn record_times(&mut self, times: &StageTimes) {
+        for stage in Stage::ALL {
+            let duration = times.0[stage as usize];
+            if !duration.is_zero() {
+                self.record(stage, duration);
+            }
+        }
+    }
+
+    /// Adds all samples of `other` to this summary.
+    pub fn merge(&mut self, other: &TimingSummary) {
+        for (samples, other) in self.samples.iter_mut().zip(&other.samples) {
+            samples.extend_from_slice(other);
+        }
+    }
+
+    /// Returns true if no samples were recorded.
+    pub fn is_empty(&self) -> bool {
+        self.samples.iter().all(|samples| samples.is_empty())
+    }
+
+    /// Returns the number of samples recorded for `stage`.
+    pub fn count(&self, stage: Stage) -> usize {
+        self.samples[stage as usize].len()
+    }
+
+    /// Returns the total time spent in `stage`.
+    pub fn total(&self, stage: Stage) -> Duration {
+        self.samples[stage as usize].iter().sum()
+    }
+
+    /// Returns the `p`-th percentile (from 0 to 100) of the samples of `stage`, using the nearest
+    /// rank method. Returns `None` if there are no samples.
+    pub fn percentile(&self, stage: Stage, p: f32) -> Option<Duration> {
+        let mut samples = self.samples[stage as usize].clone();
+        samples.sort_unstable();
+        Self::nearest_rank(&samples, p)
+    }
+
+    fn nearest_rank(sorted: &[Duration], p: f32) -> Option<Duration> {
+        if sorted.is_empty() {
+            return None;
+        }
+        let rank = f32::ceil(p.clamp(0.0, 100.0) / 100.0 * sorted.len() as f32) as usize;
+        Some(sorted[usize::max(rank, 1) - 1])
+    }
+}
+
+impl Display for TimingSummary {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        writeln!(
+            f,
+            "{:<20} {:>6} {:>10} {:>10} {:>10} {:>10} {:>10}",
+            "Stage", "Count", "Total", "p50", "p90", "p99", "Max"
+        )?;
+        for stage in Stage::ALL {
+            let mut samples = self.samples[stage as usize].clone();
+            if samples.is_empty() {
+                continue;
+            }
+            samples.sort_unstable();
+            let ms = |d: Option<Duration>| format!("{:.1}ms", d.unwrap().as_secs_f64() * 1000.0);
+            writeln!(
+                f,
+                "{:<20} {:>6} {:>10} {:>10} {:>10} {:>10} {:>10}",
+                stage,
+                samples.len(),
+                ms(Some(samples.iter().sum())),
+                ms(Self::nearest_rank(&samples, 50.0)),
+                ms(Self::nearest_rank(&samples, 90.0)),
+                ms(Self::nearest_rank(&samples, 99.0)),
+                ms(samples.last().copied()),
+            )?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_timing_summary() {
+        let mut summary = TimingSummary::default();
+        assert!(summary.is_empty());
+        for ms in 1..=100 {
+            summary.record(Stage::Decode, Duration::from_millis(ms));
+        }
+
+        let mut times = StageTimes::default();
+        times.add(Stage::Demux, Duration::from_millis(3));
+        times.add(Stage::Demux, Duration::from_millis(2));
+        summary.record_times(&times);
+
+        assert_eq!(summary.count(Stage::Decode), 100);
+        assert_eq!(summary.total(Stage::Decode), Duration::from_millis(5050));
+        assert_eq!(
+            summary.percentile(Stage::Decode, 50.0),
+            Some(Duration::from_millis(50))
+        );
+        assert_eq!(
+            summary.percentile(Stage::Decode, 99.0),
+            Some(Duration::from_millis(99))
+        );
+        assert_eq!(
+            summary.percentile(Stage::Demux, 0.0),
+            Some(Duration::from_millis(5))
+        );
+        // Stages an item did not go through are not recorded.
+        assert_eq!(summary.count(Stage::Fingerprint), 0);
+        assert_eq!(summary.percentile(Stage::Fingerprint, 50.0), None);
+    }
+}
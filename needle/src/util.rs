@@ -1,9 +1,46 @@
 use std::io::Read;
 use std::path::{Path, PathBuf};
-use std::time::Duration;
+use std::sync::Once;
+use std::time::{Duration, Instant};
 
+use serde::{Deserialize, Serialize};
+
+use crate::audio::FrameHashes;
+use crate::timing::{Stage, TimingSummary};
 use crate::{Error, Result};
 
+/// Identifies a version of a file using only its metadata. This allows checking whether a file
+/// has changed without reading any of its contents.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, Deserialize, Serialize)]
+pub(crate) struct FileIdentity {
+    pub(crate) size: u64,
+    // Modification time relative to the Unix epoch, if supported by the platform.
+    pub(crate) modified: Option<Duration>,
+}
+
+impl FileIdentity {
+    pub(crate) fn from_path(path: impl AsRef<Path>) -> Result<Self> {
+        let metadata = std::fs::metadata(path)?;
+        let modified = metadata
+            .modified()
+            .ok()
+            .and_then(|t| t.duration_since(std::time::UNIX_EPOCH).ok());
+        Ok(Self {
+            size: metadata.len(),
+            modified,
+        })
+    }
+}
+
+/// Initializes FFmpeg. This is a no-op after the first call.
+///
+/// Only needed before decoding or probing videos, so callers that only work with existing frame
+/// hash data can skip it altogether.
+pub fn init_ffmpeg() {
+    static INIT: Once = Once::new();
+    INIT.call_once(|| ffmpeg_next::init().expect("failed to initialize FFmpeg"));
+}
+
 /// Formats the given [Duration] as "MM:SSs"
 pub fn format_time(t: Duration) -> String {
     let minutes = t.as_secs() / 60;
@@ -27,6 +64,7 @@ pub fn is_valid_video_file(path: impl AsRef<Path>, full: bool, audio: bool) -> b
         return infer::is_video(&buf);
     }
 
+    init_ffmpeg();
     if let Ok(input) = ffmpeg_next::format::input(&path.as_ref()) {
         let num_video_streams = input
             .streams()
@@ -52,6 +90,87 @@ pub fn find_video_files<P: AsRef<Path>>(
     full: bool,
     audio: bool,
 ) -> Result<Vec<PathBuf>> {
+    let valid_video_files = find_candidate_files(paths)?
+        .into_iter()
+        .filter(|p| is_valid_video_file(p, full, audio))
+        .collect();
+
+    Ok(valid_video_files)
+}
+
+/// Same as [find_video_files], but also loads the frame hash data stored alongside each video.
+///
+/// Files that have frame hash data on disk, and have not changed since they were analyzed, are
+/// accepted without being opened: only their metadata is checked. Other files are validated as
+/// usual using [is_valid_video_file] and are returned without frame hash data, even if they have
+/// some on disk. This is meant for callers that analyze such files again; use
+/// [load_analyzed_video_files] to load whatever data is on disk instead.
+pub fn find_analyzed_video_files<P: AsRef<Path>>(
+    paths: &[P],
+    full: bool,
+    audio: bool,
+) -> Result<Vec<(PathBuf, Option<FrameHashes>)>> {
+    find_analyzed_video_files_with_timings(paths, full, audio, &mut Default::default())
+}
+
+/// Same as [find_analyzed_video_files], but records the time taken to load the frame hash data of
+/// each video in `timings` (see [Stage::HashLoad]).
+pub fn find_analyzed_video_files_with_timings<P: AsRef<Path>>(
+    paths: &[P],
+    full: bool,
+    audio: bool,
+    timings: &mut TimingSummary,
+) -> Result<Vec<(PathBuf, Option<FrameHashes>)>> {
+    let video_files = find_candidate_files(paths)?
+        .into_iter()
+        .filter_map(|p| {
+            let started = Instant::now();
+            match FrameHashes::from_video_if_current(&p) {
+                Some(frame_hashes) => {
+                    timings.record(Stage::HashLoad, started.elapsed());
+                    Some((p, Some(frame_hashes)))
+                }
+                None => is_valid_video_file(&p, full, audio).then(|| (p, None)),
+            }
+        })
+        .collect();
+
+    Ok(video_files)
+}
+
+/// Same as [find_analyzed_video_files_with_timings], but also loads the frame hash data of files
+/// that changed since they were analyzed (e.g., because they were copied, or because the data was
+/// written by an older version of needle). Files whose frame hash data cannot be loaded are
+/// returned along with the error.
+pub fn load_analyzed_video_files<P: AsRef<Path>>(
+    paths: &[P],
+    full: bool,
+    audio: bool,
+    timings: &mut TimingSummary,
+) -> Result<Vec<(PathBuf, Result<FrameHashes>)>> {
+    let video_files = find_analyzed_video_files_with_timings(paths, full, audio, timings)?
+        .into_iter()
+        .map(|(p, frame_hashes)| {
+            let frame_hashes = match frame_hashes {
+                Some(frame_hashes) => Ok(frame_hashes),
+                None => {
+                    let started = Instant::now();
+                    let frame_hashes = FrameHashes::from_video(&p, false);
+                    if frame_hashes.is_ok() {
+                        timings.record(Stage::HashLoad, started.elapsed());
+                    }
+                    frame_hashes
+                }
+            };
+            (p, frame_hashes)
+        })
+        .collect();
+
+    Ok(video_files)
+}
+
+// Returns all files that were either provided directly or are in one of the provided directories.
+fn find_candidate_files<P: AsRef<Path>>(paths: &[P]) -> Result<Vec<PathBuf>> {
     // Validate all paths.
     for path in paths {
         let path = path.as_ref();
@@ -60,29 +179,20 @@ pub fn find_video_files<P: AsRef<Path>>(
         }
     }
 
-    // Find valid video files.
-    let mut valid_video_files = Vec::new();
+    let mut files = Vec::new();
     for path in paths {
         let path = path.as_ref();
         if path.is_dir() {
-            valid_video_files.extend(
-                std::fs::read_dir(path)
-                    .unwrap()
-                    .map(|p| {
-                        let entry = p.unwrap();
-                        entry.path()
-                    })
-                    .filter(|p| is_valid_video_file(p, full, audio))
-                    .collect::<Vec<_>>(),
-            );
+            files.extend(std::fs::read_dir(path).unwrap().map(|p| {
+                let entry = p.unwrap();
+                entry.path()
+            }));
         } else {
-            if is_valid_video_file(path, full, audio) {
-                valid_video_files.push(path.to_owned());
-            }
+            files.push(path.to_owned());
         }
     }
 
-    Ok(valid_video_files)
+    Ok(files)
 }
 
 pub(crate) fn compute_header_md5sum(video: impl AsRef<Path>) -> crate::Result<String> {
@@ -93,6 +203,22 @@ pub(crate) fn compute_header_md5sum(video: impl AsRef<Path>) -> crate::Result<St
     Ok(hash)
 }
 
+/// Returns the amount of memory (in bytes) that is available to new allocations, if known.
+pub(crate) fn available_memory() -> Option<u64> {
+    #[cfg(target_os = "linux")]
+    {
+        let meminfo = std::fs::read_to_string("/proc/meminfo").ok()?;
+        let line = meminfo
+            .lines()
+            .find(|line| line.starts_with("MemAvailable:"))?;
+        let kb: u64 = line.split_whitespace().nth(1)?.parse().ok()?;
+        Some(kb * 1024)
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    None
+}
+
 /// Returns the underlying FFmpeg version integer used by needle.
 pub fn ffmpeg_version() -> u32 {
     ffmpeg_next::util::version()
@@ -110,3 +236,10 @@ pub fn ffmpeg_version_string() -> String {
         version_int & 0xFF             // MICRO
     )
 }
+
+/// Returns a path in the temporary directory for a test to use. The path is unique to the test
+/// process, so concurrent test runs on the same machine do not clobber each other's files.
+#[cfg(test)]
+pub(crate) fn test_temp_path(name: &str) -> PathBuf {
+    std::env::temp_dir().join(format!("needle-test-{}-{}", name, std::process::id()))
+}
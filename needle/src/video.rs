@@ -3,10 +3,15 @@ extern crate ffmpeg_next;
 extern crate image;
 
 use std::path::Path;
+use std::sync::{mpsc, Mutex};
 use std::time::Duration;
 
 use crate::{Error, Result};
 
+/// Number of GRAY8 frame buffers allocated per hashing worker. Beyond the frame that a worker is
+/// hashing, this lets the decoder queue up frames while the workers are busy.
+const FRAME_BUFFERS_PER_WORKER: usize = 2;
+
 /// Wraps the `FFmpeg` video decoder.
 struct VideoDecoder {
     decoder: ffmpeg_next::codec::decoder::Video,
@@ -171,12 +176,27 @@ impl VideoComparator {
             .map(|ts| Duration::from_millis(ts as u64))
     }
 
+    // Returns the number of workers that hash frames while the calling thread decodes.
+    fn num_hash_workers() -> usize {
+        std::thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1)
+            .saturating_sub(1)
+            .max(1)
+    }
+
     // Given a video stream, applies the function `F` to each frame in the stream and
     // collects the results into a `Vec`.
     //
     // `count` can be used to limit the number of frames to process. To sample fewer frames,
     // use the `skip_by` option. For example, if `skip_by` is set to 5, one in every 5 frames
     // will be processed.
+    //
+    // Frames are decoded and converted to GRAY8 on the calling thread, and `F` is applied by a
+    // pool of workers. Converted frames are passed to the workers in a fixed set of buffers that
+    // the workers hand back once they are done with them, so the decoder never gets more than a
+    // few frames ahead and no frames are allocated per packet. The output is in the order in
+    // which the decoder returned the frames, i.e., in PTS order.
     fn process_frames<T, F>(
         ctx: &mut ffmpeg_next::format::context::Input,
         decoder: &mut VideoDecoder,
@@ -186,40 +206,83 @@ impl VideoComparator {
         map_frame_fn: F,
     ) -> Vec<T>
     where
-        F: Fn(&ffmpeg_next::frame::Video, &ffmpeg_next::format::stream::Stream) -> T,
+        T: Send,
+        F: Fn(&ffmpeg_next::frame::Video, ffmpeg_next::Rational) -> T + Sync,
     {
         let _g = tracing::span!(tracing::Level::TRACE, "process_frames", count);
 
         let skip_by = skip_by.unwrap_or(1);
-        let mut output: Vec<T> = Vec::new();
+        let time_base = ctx
+            .stream(stream_idx)
+            .expect("invalid stream index")
+            .time_base();
+        let num_workers = Self::num_hash_workers();
         let mut frame =
             ffmpeg_next::frame::Video::new(decoder.format(), decoder.width(), decoder.height());
-        let mut frame_gray = ffmpeg_next::frame::Video::new(
-            ffmpeg_next::format::Pixel::GRAY8,
-            decoder.width(),
-            decoder.height(),
-        );
 
-        ctx.packets()
-            .filter(|(s, _)| s.index() == stream_idx)
-            .take(count.unwrap_or(usize::MAX))
-            .enumerate()
-            .map(|(i, (s, mut p))| {
-                if i % skip_by != 0 {
-                    p.set_flags(ffmpeg_next::codec::packet::Flags::DISCARD);
-                }
-                (s, p)
-            })
-            .for_each(|(s, p)| {
-                decoder.send_packet(&p).unwrap();
-                while decoder.receive_frame(&mut frame).is_ok() {
-                    decoder.convert_frame(&frame, &mut frame_gray).unwrap();
-                    frame_gray.set_pts(frame.pts());
-                    output.push(map_frame_fn(&frame_gray, &s));
-                }
-            });
-
-        output
+        let (free_tx, free_rx) = mpsc::channel();
+        for _ in 0..FRAME_BUFFERS_PER_WORKER * num_workers {
+            let frame_gray = ffmpeg_next::frame::Video::new(
+                ffmpeg_next::format::Pixel::GRAY8,
+                decoder.width(),
+                decoder.height(),
+            );
+            free_tx.send(frame_gray).unwrap();
+        }
+        let (work_tx, work_rx) = mpsc::channel::<(usize, ffmpeg_next::frame::Video)>();
+        let work_rx = Mutex::new(work_rx);
+        let (result_tx, result_rx) = mpsc::channel();
+
+        std::thread::scope(|s| {
+            for _ in 0..num_workers {
+                let (free_tx, result_tx) = (free_tx.clone(), result_tx.clone());
+                let (work_rx, map_frame_fn) = (&work_rx, &map_frame_fn);
+                s.spawn(move || loop {
+                    // The lock is released before the frame is hashed.
+                    let next = work_rx.lock().unwrap().recv();
+                    let (seq, frame_gray) = match next {
+                        Ok(next) => next,
+                        Err(_) => break,
+                    };
+                    let output = map_frame_fn(&frame_gray, time_base);
+                    // The decoder only stops receiving buffers if it panicked.
+                    let _ = free_tx.send(frame_gray);
+                    result_tx.send((seq, output)).unwrap();
+                });
+            }
+            // Only the workers return buffers and send results, so both channels close once the
+            // workers are done.
+            drop((free_tx, result_tx));
+
+            let mut seq = 0;
+            ctx.packets()
+                .filter(|(s, _)| s.index() == stream_idx)
+                .take(count.unwrap_or(usize::MAX))
+                .enumerate()
+                .map(|(i, (_, mut p))| {
+                    if i % skip_by != 0 {
+                        p.set_flags(ffmpeg_next::codec::packet::Flags::DISCARD);
+                    }
+                    p
+                })
+                .for_each(|p| {
+                    decoder.send_packet(&p).unwrap();
+                    while decoder.receive_frame(&mut frame).is_ok() {
+                        let mut frame_gray = free_rx.recv().expect("all hashing workers exited");
+                        decoder.convert_frame(&frame, &mut frame_gray).unwrap();
+                        frame_gray.set_pts(frame.pts());
+                        work_tx.send((seq, frame_gray)).unwrap();
+                        seq += 1;
+                    }
+                });
+
+            // Closing the work channel stops the workers.
+            drop(work_tx);
+        });
+
+        let mut output: Vec<(usize, T)> = result_rx.into_iter().collect();
+        output.sort_unstable_by_key(|(seq, _)| *seq);
+        output.into_iter().map(|(_, output)| output).collect()
     }
 
     // Returns all packets for a given stream.
@@ -246,8 +309,8 @@ impl VideoComparator {
         tracing::debug!(num_packets = packets.len());
 
         let map_frame_fn = |output_prefix: Option<&'static str>| {
-            move |f: &ffmpeg_next::frame::video::Video, s: &ffmpeg_next::format::stream::Stream| {
-                let time_base = f64::from(s.time_base());
+            move |f: &ffmpeg_next::frame::video::Video, time_base: ffmpeg_next::Rational| {
+                let time_base = f64::from(time_base);
                 let pts = f.pts().unwrap();
                 let ts = Duration::from_millis((pts as f64 * time_base * 1000.0) as u64);
 